@@ -18,12 +18,52 @@ chafafunc.c
 #include <sys/ioctl.h> /* ioctl */
 #endif
 
+#ifndef COVER_RENDER_CACHE_SIZE
+#define COVER_RENDER_CACHE_SIZE 2
+#endif
+
+#ifndef COLOR_SAMPLE_GRID
+#define COLOR_SAMPLE_GRID 64
+#endif
+
+#define COLOR_BUCKET_BITS 4
+#define COLOR_BUCKETS (1 << (3 * COLOR_BUCKET_BITS))
+
 typedef struct
 {
         gint width_cells, height_cells;
         gint width_pixels, height_pixels;
 } TermSize;
 
+typedef struct
+{
+        char path[MAXPATHLEN];
+        FIBITMAP *bitmap;
+        gint width_cells, height_cells;
+        gint cell_width, cell_height;
+        ChafaPixelMode pixel_mode;
+        GString *printable;
+} CoverRender;
+
+// The terminal capabilities don't change while running, so they are only detected once
+ChafaTermInfo *termInfo = NULL;
+ChafaCanvasMode canvasMode;
+ChafaPixelMode pixelMode;
+ChafaSymbolMap *symbolMap = NULL;
+
+typedef struct
+{
+        unsigned int count;
+        unsigned int weight;
+        unsigned int red;
+        unsigned int green;
+        unsigned int blue;
+} ColorBucket;
+
+// Most recently rendered covers, the current and the upcoming song
+CoverRender coverRenders[COVER_RENDER_CACHE_SIZE];
+int nextCoverRender = 0;
+
 static void detect_terminal(ChafaTermInfo **term_info_out, ChafaCanvasMode *mode_out, ChafaPixelMode *pixel_mode_out)
 {
         ChafaCanvasMode mode;
@@ -157,34 +197,39 @@ tty_init(void)
 #endif
 }
 
+static void
+init_terminal(void)
+{
+        if (termInfo != NULL)
+                return;
+
+        detect_terminal(&termInfo, &canvasMode, &pixelMode);
+
+        /* Specify the symbols we want */
+
+        symbolMap = chafa_symbol_map_new();
+        chafa_symbol_map_add_by_tags(symbolMap, CHAFA_SYMBOL_TAG_BLOCK);
+}
+
 static GString *
 convert_image(const void *pixels, gint pix_width, gint pix_height,
               gint pix_rowstride, ChafaPixelType pixel_type,
               gint width_cells, gint height_cells,
               gint cell_width, gint cell_height)
 {
-        ChafaTermInfo *term_info;
-        ChafaCanvasMode mode;
-        ChafaPixelMode pixel_mode;
-        ChafaSymbolMap *symbol_map;
         ChafaCanvasConfig *config;
         ChafaCanvas *canvas;
         GString *printable;
 
-        detect_terminal(&term_info, &mode, &pixel_mode);
-
-        /* Specify the symbols we want */
-
-        symbol_map = chafa_symbol_map_new();
-        chafa_symbol_map_add_by_tags(symbol_map, CHAFA_SYMBOL_TAG_BLOCK);
+        init_terminal();
 
         /* Set up a configuration with the symbols and the canvas size in characters */
 
         config = chafa_canvas_config_new();
-        chafa_canvas_config_set_canvas_mode(config, mode);
-        chafa_canvas_config_set_pixel_mode(config, pixel_mode);
+        chafa_canvas_config_set_canvas_mode(config, canvasMode);
+        chafa_canvas_config_set_pixel_mode(config, pixelMode);
         chafa_canvas_config_set_geometry(config, width_cells, height_cells);
-        chafa_canvas_config_set_symbol_map(config, symbol_map);
+        chafa_canvas_config_set_symbol_map(config, symbolMap);
 
         if (cell_width > 0 && cell_height > 0)
         {
@@ -207,21 +252,92 @@ convert_image(const void *pixels, gint pix_width, gint pix_height,
                                      pix_rowstride);
 
         /* Build printable string */
-        printable = chafa_canvas_print(canvas, term_info);
+        printable = chafa_canvas_print(canvas, termInfo);
 
         /* Clean up and return */
 
         chafa_canvas_unref(canvas);
         chafa_canvas_config_unref(config);
-        chafa_symbol_map_unref(symbol_map);
-        chafa_term_info_unref(term_info);
         canvas = NULL;
         config = NULL;
-        symbol_map = NULL;
-        term_info = NULL;
         return printable;
 }
 
+static GString *
+get_cover_render(FIBITMAP *bitmap, const char *path,
+                 gint width_cells, gint height_cells,
+                 gint cell_width, gint cell_height)
+{
+        init_terminal();
+
+        if (path == NULL)
+                path = "";
+
+        for (int i = 0; i < COVER_RENDER_CACHE_SIZE; i++)
+        {
+                CoverRender *render = &coverRenders[i];
+
+                if (render->printable != NULL && render->bitmap == bitmap && strcmp(render->path, path) == 0 &&
+                    render->width_cells == width_cells && render->height_cells == height_cells &&
+                    render->cell_width == cell_width && render->cell_height == cell_height &&
+                    render->pixel_mode == pixelMode)
+                        return render->printable;
+        }
+
+        int pix_width = FreeImage_GetWidth(bitmap);
+        int pix_height = FreeImage_GetHeight(bitmap);
+        int n_channels = FreeImage_GetBPP(bitmap) / 8;
+        unsigned char *pixels = (unsigned char *)FreeImage_GetBits(bitmap);
+
+        GString *printable = convert_image(pixels, pix_width, pix_height, pix_width * n_channels, CHAFA_PIXEL_BGRA8_UNASSOCIATED,
+                                           width_cells, height_cells, cell_width, cell_height);
+
+        if (printable == NULL)
+                return NULL;
+
+        // Replace the oldest render
+        CoverRender *render = &coverRenders[nextCoverRender];
+        nextCoverRender = (nextCoverRender + 1) % COVER_RENDER_CACHE_SIZE;
+
+        if (render->printable != NULL)
+                g_string_free(render->printable, TRUE);
+
+        snprintf(render->path, sizeof(render->path), "%s", path);
+        render->bitmap = bitmap;
+        render->width_cells = width_cells;
+        render->height_cells = height_cells;
+        render->cell_width = cell_width;
+        render->cell_height = cell_height;
+        render->pixel_mode = pixelMode;
+        render->printable = printable;
+
+        return printable;
+}
+
+void freeCoverRenders(void)
+{
+        for (int i = 0; i < COVER_RENDER_CACHE_SIZE; i++)
+        {
+                if (coverRenders[i].printable != NULL)
+                {
+                        g_string_free(coverRenders[i].printable, TRUE);
+                        coverRenders[i].printable = NULL;
+                }
+        }
+
+        if (symbolMap != NULL)
+        {
+                chafa_symbol_map_unref(symbolMap);
+                symbolMap = NULL;
+        }
+
+        if (termInfo != NULL)
+        {
+                chafa_term_info_unref(termInfo);
+                termInfo = NULL;
+        }
+}
+
 void printImage(const char *image_path, int width, int height)
 {
         FreeImage_Initialise(false);
@@ -390,16 +506,31 @@ float calcAspectRatio()
         return (float)cell_height / (float)cell_width;        
 }
 
-void printSquareBitmapCentered(FIBITMAP *bitmap, int baseHeight)
+int getMaxCoverSize(void)
+{
+        TermSize term_size;
+        gint cell_height = 16;
+        gint rows = 50;
+
+        tty_init();
+        get_tty_size(&term_size);
+
+        if (term_size.height_cells > 0)
+                rows = term_size.height_cells;
+
+        if (term_size.height_cells > 0 && term_size.height_pixels > 0)
+                cell_height = term_size.height_pixels / term_size.height_cells;
+
+        // The cover is square and never taller than the terminal
+        return rows * cell_height;
+}
+
+void printSquareBitmapCentered(FIBITMAP *bitmap, const char *path, int baseHeight)
 {
         if (bitmap == NULL)
         {
                 return;
         }
-        int pix_width = FreeImage_GetWidth(bitmap);
-        int pix_height = FreeImage_GetHeight(bitmap);
-        int n_channels = FreeImage_GetBPP(bitmap) / 8;
-        unsigned char *pixels = (unsigned char *)FreeImage_GetBits(bitmap);
 
         TermSize term_size;
         GString *printable;
@@ -424,22 +555,29 @@ void printSquareBitmapCentered(FIBITMAP *bitmap, int baseHeight)
 
         int correctedWidth = (int)(baseHeight * aspect_ratio_correction);
 
-        // Convert image to a printable string
-        printable = convert_image(pixels, pix_width, pix_height, pix_width * n_channels, CHAFA_PIXEL_BGRA8_UNASSOCIATED,
-                                  correctedWidth, baseHeight, cell_width, cell_height);
-        g_string_append_c(printable, '\0');
-        const gchar *delimiters = "\n";
-        gchar **lines = g_strsplit(printable->str, delimiters, -1);
+        // Reuse the printable string if this cover was already rendered at this size
+        printable = get_cover_render(bitmap, path, correctedWidth, baseHeight, cell_width, cell_height);
+
+        if (printable == NULL)
+                return;
 
         int indentation = ((term_size.width_cells - correctedWidth) / 2) + 1;
 
-        for (int i = 0; lines[i] != NULL; i++)
+        const gchar *line = printable->str;
+        const gchar *end = printable->str + printable->len;
+
+        while (line <= end)
         {
-                printf("\n%*s%s", indentation, "", lines[i]);
-        }
+                const gchar *newline = memchr(line, '\n', end - line);
+                int length = (newline != NULL) ? newline - line : end - line;
 
-        g_strfreev(lines);
-        g_string_free(printable, TRUE);
+                printf("\n%*s%.*s", indentation, "", length, line);
+
+                if (newline == NULL)
+                        break;
+
+                line = newline + 1;
+        }
 }
 
 void printBitmapCentered(FIBITMAP *bitmap, int width, int height)
@@ -489,15 +627,12 @@ unsigned char luminance(unsigned char r, unsigned char g, unsigned char b)
         return (unsigned char)(0.2126 * r + 0.7152 * g + 0.0722 * b);
 }
 
-void checkIfBrightPixel(unsigned char r, unsigned char g, unsigned char b, bool *found)
+bool isAccentCandidate(unsigned char r, unsigned char g, unsigned char b)
 {
-        // Calc luminace and use to find Ascii char.
+        // Skip dark, grayish and near-white pixels
         unsigned char ch = luminance(r, g, b);
 
-        if (ch > 80 && !(r < g + 20 && r > g - 20 && g < b + 20 && g > b - 20) && !(r > 150 && g > 150 && b > 150))
-        {
-                *found = true;
-        }
+        return ch > 80 && !(r < g + 20 && r > g - 20 && g < b + 20 && g > b - 20) && !(r > 150 && g > 150 && b > 150);
 }
 
 int getCoverColor(FIBITMAP *bitmap, unsigned char *r, unsigned char *g, unsigned char *b)
@@ -505,44 +640,80 @@ int getCoverColor(FIBITMAP *bitmap, unsigned char *r, unsigned char *g, unsigned
         int rwidth = FreeImage_GetWidth(bitmap);
         int rheight = FreeImage_GetHeight(bitmap);
         int rchannels = FreeImage_GetBPP(bitmap) / 8;
+        int pitch = FreeImage_GetPitch(bitmap);
         unsigned char *read_data = (unsigned char *)FreeImage_GetBits(bitmap);
 
-        if (read_data == NULL)
+        if (read_data == NULL || rwidth <= 0 || rheight <= 0 || rchannels < 1)
         {
                 return -1;
         }
 
-        bool found = false;
-        int numPixels = rwidth * rheight;
+        ColorBucket *buckets = calloc(COLOR_BUCKETS, sizeof(ColorBucket));
 
-        for (int i = 0; i < numPixels; i++)
+        if (buckets == NULL)
+                return -1;
+
+        // Sample a fixed grid so the cost doesn't depend on the image size
+        int stepX = (rwidth > COLOR_SAMPLE_GRID) ? rwidth / COLOR_SAMPLE_GRID : 1;
+        int stepY = (rheight > COLOR_SAMPLE_GRID) ? rheight / COLOR_SAMPLE_GRID : 1;
+
+        for (int y = 0; y < rheight; y += stepY)
         {
-                int index = i * rchannels;
-                unsigned char blue = 0;
-                unsigned char green = 0;
-                unsigned char red = 0;
+                unsigned char *row = read_data + (size_t)y * pitch;
 
-                if (rchannels >= 3)
+                for (int x = 0; x < rwidth; x += stepX)
                 {
-                        blue = read_data[index + 0];
-                        green = read_data[index + 1];
-                        red = read_data[index + 2];
-                }
-                else if (rchannels >= 1)
-                {
-                        blue = green = red = read_data[index];
+                        unsigned char *pixel = row + x * rchannels;
+                        unsigned char blue, green, red;
+
+                        if (rchannels >= 3)
+                        {
+                                blue = pixel[0];
+                                green = pixel[1];
+                                red = pixel[2];
+                        }
+                        else
+                        {
+                                blue = green = red = pixel[0];
+                        }
+
+                        if (!isAccentCandidate(red, green, blue))
+                                continue;
+
+                        unsigned char maxChannel = red > green ? (red > blue ? red : blue) : (green > blue ? green : blue);
+                        unsigned char minChannel = red < green ? (red < blue ? red : blue) : (green < blue ? green : blue);
+
+                        int index = ((red >> (8 - COLOR_BUCKET_BITS)) << (2 * COLOR_BUCKET_BITS)) |
+                                    ((green >> (8 - COLOR_BUCKET_BITS)) << COLOR_BUCKET_BITS) |
+                                    (blue >> (8 - COLOR_BUCKET_BITS));
+
+                        ColorBucket *bucket = &buckets[index];
+
+                        bucket->count++;
+                        bucket->weight += maxChannel - minChannel; // Favor saturated colors
+                        bucket->red += red;
+                        bucket->green += green;
+                        bucket->blue += blue;
                 }
+        }
 
-                checkIfBrightPixel(red, green, blue, &found);
+        // The heaviest bucket is the dominant accent color, use the mean of the pixels in it
+        int best = -1;
 
-                if (found)
-                {
-                        *(r) = red;
-                        *(g) = green;
-                        *(b) = blue;
-                        break;
-                }
+        for (int i = 0; i < COLOR_BUCKETS; i++)
+        {
+                if (buckets[i].count > 0 && (best < 0 || buckets[i].weight > buckets[best].weight))
+                        best = i;
         }
 
+        if (best >= 0)
+        {
+                *(r) = buckets[best].red / buckets[best].count;
+                *(g) = buckets[best].green / buckets[best].count;
+                *(b) = buckets[best].blue / buckets[best].count;
+        }
+
+        free(buckets);
+
         return 0;
 }
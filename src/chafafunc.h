@@ -5,12 +5,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/param.h>
 #include <unistd.h>
 
 float calcAspectRatio();
+int getMaxCoverSize(void);
 void printImage(const char *image_path, int width, int height);
 FIBITMAP *getBitmap(const char *image_path);
 void printBitmap(FIBITMAP *bitmap, int width, int height);
 void printBitmapCentered(FIBITMAP *bitmap, int width, int height);
-void printSquareBitmapCentered(FIBITMAP *bitmap, int baseHeight);
+void printSquareBitmapCentered(FIBITMAP *bitmap, const char *path, int baseHeight);
+void freeCoverRenders(void);
 int getCoverColor(FIBITMAP *bitmap, unsigned char *r, unsigned char *g, unsigned char *b);
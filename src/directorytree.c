@@ -1,59 +1,227 @@
 #include "directorytree.h"
 
-static int lastUsedId = 0;
+#ifndef MAX_SCAN_THREADS
+#define MAX_SCAN_THREADS 16
+#endif
+
+#define LIBRARY_CACHE_MAGIC "KEWLIB\0\0"
+#define LIBRARY_CACHE_VERSION 1
+
+// The library cache is a header, a node array in depth-first order and a table of null-terminated names
+typedef struct
+{
+        char magic[8];
+        uint32_t version;
+        uint32_t numNodes;
+        uint32_t stringsSize;
+        uint32_t reserved;
+} LibraryCacheHeader;
+
+typedef struct
+{
+        int32_t id;
+        uint32_t nameOffset;
+        int32_t parent; // Indices into the node array, -1 if none
+        int32_t firstChild;
+        int32_t nextSibling;
+        int32_t isDirectory;
+} CachedNode;
+
+typedef struct
+{
+        CachedNode *nodes;
+        int numNodes;
+        int nodesCapacity;
+        char *strings;
+        size_t stringsSize;
+        size_t stringsCapacity;
+} LibraryCacheWriter;
+
+#define ARENA_CHUNK_SIZE (1024 * 1024)
+
+typedef struct ArenaChunk
+{
+        struct ArenaChunk *next;
+        size_t used;
+        size_t size;
+        max_align_t data[];
+} ArenaChunk;
+
+// Holds all entries and strings of one tree, so the whole tree is freed at once
+struct EntryArena
+{
+        FileSystemEntry *root;
+        ArenaChunk *chunks;
+        void *map; // Mapped library cache the names point into, if any
+        size_t mapSize;
+        int lastId; // Highest id in the tree
+        unsigned int version; // Changes whenever the tree does, unique across trees
+        pthread_mutex_t mutex;
+        struct EntryArena *next;
+};
+
+EntryArena *entryArenas = NULL; // One per live tree
+pthread_mutex_t entryArenasMutex = PTHREAD_MUTEX_INITIALIZER;
+unsigned int lastTreeVersion = 0;
 
 typedef void (*TimeoutCallback)(void);
 
-FileSystemEntry *createEntry(const char *name, int isDirectory, FileSystemEntry *parent)
+EntryArena *createArena()
 {
-        FileSystemEntry *newEntry = (FileSystemEntry *)malloc(sizeof(FileSystemEntry));
-        if (newEntry != NULL)
+        EntryArena *arena = calloc(1, sizeof(EntryArena));
+
+        if (arena != NULL)
         {
-                newEntry->name = strdup(name);
+                pthread_mutex_init(&arena->mutex, NULL);
 
-                newEntry->isDirectory = isDirectory;
-                newEntry->isEnqueued = 0;
-                newEntry->parent = parent;
-                newEntry->children = NULL;
-                newEntry->next = NULL;
-                newEntry->id = ++lastUsedId;
-                if (parent != NULL)
-                {
-                        newEntry->parentId = parent->id;
-                }
-                else
+                pthread_mutex_lock(&entryArenasMutex);
+                arena->version = ++lastTreeVersion;
+                pthread_mutex_unlock(&entryArenasMutex);
+        }
+
+        return arena;
+}
+
+// Safe to call from several threads, the scanner workers share one arena
+void *arenaAlloc(EntryArena *arena, size_t size)
+{
+        size = (size + sizeof(max_align_t) - 1) / sizeof(max_align_t) * sizeof(max_align_t);
+
+        pthread_mutex_lock(&arena->mutex);
+
+        ArenaChunk *chunk = arena->chunks;
+
+        if (chunk == NULL || chunk->size - chunk->used < size)
+        {
+                size_t chunkSize = (size > ARENA_CHUNK_SIZE) ? size : ARENA_CHUNK_SIZE;
+
+                chunk = malloc(sizeof(ArenaChunk) + chunkSize);
+
+                if (chunk == NULL)
                 {
-                        newEntry->parentId = -1;
+                        pthread_mutex_unlock(&arena->mutex);
+                        return NULL;
                 }
+
+                chunk->used = 0;
+                chunk->size = chunkSize;
+                chunk->next = arena->chunks;
+                arena->chunks = chunk;
         }
-        return newEntry;
+
+        void *ptr = (char *)chunk->data + chunk->used;
+        chunk->used += size;
+
+        pthread_mutex_unlock(&arena->mutex);
+
+        return ptr;
 }
 
-void addChild(FileSystemEntry *parent, FileSystemEntry *child)
+void freeArena(EntryArena *arena)
 {
-        if (parent != NULL)
+        ArenaChunk *chunk = arena->chunks;
+
+        while (chunk != NULL)
         {
-                child->next = parent->children;
-                parent->children = child;
+                ArenaChunk *next = chunk->next;
+                free(chunk);
+                chunk = next;
         }
+
+        if (arena->map != NULL)
+                munmap(arena->map, arena->mapSize);
+
+        pthread_mutex_destroy(&arena->mutex);
+        free(arena);
 }
 
-void setFullPath(FileSystemEntry *entry, const char *parentPath, const char *entryName)
+// Hands the chunks of src over to dst, so they are freed with dst's tree
+void mergeArena(EntryArena *dst, EntryArena *src)
 {
-        if (entry == NULL || parentPath == NULL || entryName == NULL)
+        ArenaChunk *last = src->chunks;
+
+        if (last != NULL)
         {
+                while (last->next != NULL)
+                        last = last->next;
 
-                return;
+                pthread_mutex_lock(&dst->mutex);
+                last->next = dst->chunks;
+                dst->chunks = src->chunks;
+                pthread_mutex_unlock(&dst->mutex);
+
+                src->chunks = NULL;
         }
 
-        size_t fullPathLength = strlen(parentPath) + strlen(entryName) + 2; // +2 for '/' and '\0'
+        freeArena(src);
+}
+
+// Registers the arena as the owner of the tree starting at root
+void setArenaRoot(EntryArena *arena, FileSystemEntry *root)
+{
+        arena->root = root;
+
+        pthread_mutex_lock(&entryArenasMutex);
+        arena->next = entryArenas;
+        entryArenas = arena;
+        pthread_mutex_unlock(&entryArenasMutex);
+}
+
+FileSystemEntry *createRootEntry(EntryArena *arena, const char *fullPath)
+{
+        FileSystemEntry *root = arenaAlloc(arena, sizeof(FileSystemEntry));
+        char *name = arenaAlloc(arena, strlen("root") + 1);
+        char *path = arenaAlloc(arena, strlen(fullPath) + 1);
+
+        if (root == NULL || name == NULL || path == NULL)
+                return NULL;
+
+        strcpy(name, "root");
+        strcpy(path, fullPath);
+
+        root->id = ++arena->lastId;
+        root->name = name;
+        root->fullPath = path;
+        root->isDirectory = 1;
+        root->isEnqueued = 0;
+        root->parentId = -1;
+        root->parent = NULL;
+        root->children = NULL;
+        root->next = NULL;
+
+        setArenaRoot(arena, root);
+
+        return root;
+}
+
+// Writes the full path to fullPath, which the name then points into. Returns the number of bytes used.
+size_t initEntry(FileSystemEntry *entry, char *fullPath, const char *parentPath, const char *name, int isDirectory, FileSystemEntry *parent)
+{
+        size_t parentPathLength = strlen(parentPath);
+        size_t fullPathLength = parentPathLength + 1 + strlen(name) + 1;
+
+        snprintf(fullPath, fullPathLength, "%s/%s", parentPath, name);
+
+        entry->id = 0;
+        entry->fullPath = fullPath;
+        entry->name = fullPath + parentPathLength + 1;
+        entry->isDirectory = isDirectory;
+        entry->isEnqueued = 0;
+        entry->parentId = -1;
+        entry->parent = parent;
+        entry->children = NULL;
+        entry->next = NULL;
+
+        return fullPathLength;
+}
 
-        entry->fullPath = (char *)malloc(fullPathLength);
-        if (entry->fullPath == NULL)
+void addChild(FileSystemEntry *parent, FileSystemEntry *child)
+{
+        if (parent != NULL)
         {
-                return;
+                child->next = parent->children;
+                parent->children = child;
         }
-        snprintf(entry->fullPath, fullPathLength, "%s/%s", parentPath, entryName);
 }
 
 void displayTreeSimple(FileSystemEntry *root, int depth)
@@ -87,18 +255,25 @@ void freeTree(FileSystemEntry *root)
                 return;
         }
 
-        FileSystemEntry *child = root->children;
-        while (child != NULL)
+        EntryArena *arena = NULL;
+
+        pthread_mutex_lock(&entryArenasMutex);
+
+        for (EntryArena **link = &entryArenas; *link != NULL; link = &(*link)->next)
         {
-                FileSystemEntry *next = child->next;
-                freeTree(child);
-                child = next;
+                if ((*link)->root == root)
+                {
+                        arena = *link;
+                        *link = arena->next;
+                        break;
+                }
         }
 
-        free(root->name);
-        free(root->fullPath);
+        pthread_mutex_unlock(&entryArenasMutex);
 
-        free(root);
+        // Entries and strings all live in the arena
+        if (arena != NULL)
+                freeArena(arena);
 }
 
 int removeEmptyDirectories(FileSystemEntry *node)
@@ -129,12 +304,8 @@ int removeEmptyDirectories(FileSystemEntry *node)
                                         prevChild->next = currentChild->next;
                                 }
 
-                                FileSystemEntry *toFree = currentChild;
+                                // Only unlinked, the memory goes with the arena
                                 currentChild = currentChild->next;
-
-                                free(toFree->name);
-                                free(toFree->fullPath);
-                                free(toFree);
                                 numEntries++;
                                 continue;
                         }
@@ -146,408 +317,1050 @@ int removeEmptyDirectories(FileSystemEntry *node)
         return numEntries;
 }
 
-char *stringToUpperWithoutSpaces(const char *str)
+// Uppercase without spaces, written once per entry so sorting doesn't allocate
+void makeSortKey(const char *str, char *key)
 {
-        if (str == NULL)
-        {
-                return NULL;
-        }
+        size_t keyIndex = 0;
 
-        size_t len = strlen(str);
-        char *result = (char *)malloc(len + 1);
-        if (result == NULL)
-        {
-                return NULL;
-        }
-
-        size_t resultIndex = 0;
-        for (size_t i = 0; i < len; ++i)
+        for (size_t i = 0; str[i] != '\0'; ++i)
         {
                 if (!isspace((unsigned char)str[i]))
                 {
-                        result[resultIndex++] = toupper((unsigned char)str[i]);
+                        key[keyIndex++] = toupper((unsigned char)str[i]);
                 }
         }
 
-        result[resultIndex] = '\0';
-
-        return result;
+        key[keyIndex] = '\0';
 }
 
-int compareLibEntries(const struct dirent **a, const struct dirent **b)
+typedef struct
+{
+        char *name;
+        char *sortKey; // Shares the allocation of name
+        int isDirectory;
+} ScannedEntry;
+
+typedef struct
 {
-        char *nameA = stringToUpperWithoutSpaces((*a)->d_name);
-        char *nameB = stringToUpperWithoutSpaces((*b)->d_name);
+        FileSystemEntry *directory;
+        const char *path;
+} ScanJob;
+
+typedef struct
+{
+        ScanJob *jobs;
+        int numJobs;
+        int capacity;
+        int unfinishedJobs; // Queued plus in progress
+        EntryArena *arena;
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+} DirectoryScanner;
+
+int compareScannedEntries(const void *a, const void *b)
+{
+        const char *nameA = ((const ScannedEntry *)a)->sortKey;
+        const char *nameB = ((const ScannedEntry *)b)->sortKey;
 
         if (nameA[0] == '_' && nameB[0] != '_')
         {
-                free(nameA);
-                free(nameB);
                 return 1;
         }
         else if (nameA[0] != '_' && nameB[0] == '_')
         {
-                free(nameA);
-                free(nameB);
                 return -1;
         }
 
-        int result = strcmp(nameB, nameA);
-        free(nameA);
-        free(nameB);
+        int result = compareNatural(nameB, nameA);
+
+        // Keys like "02" and "2" are equal, fall back to the names so the order is stable
+        if (result == 0)
+                result = strcmp(((const ScannedEntry *)b)->name, ((const ScannedEntry *)a)->name);
 
         return result;
 }
 
-int readDirectory(const char *path, FileSystemEntry *parent)
+void pushScanJob(DirectoryScanner *scanner, FileSystemEntry *directory, const char *path)
 {
+        pthread_mutex_lock(&scanner->mutex);
 
+        if (scanner->numJobs == scanner->capacity)
+        {
+                int capacity = (scanner->capacity > 0) ? scanner->capacity * 2 : 64;
+                ScanJob *jobs = realloc(scanner->jobs, capacity * sizeof(ScanJob));
+
+                if (jobs == NULL)
+                {
+                        pthread_mutex_unlock(&scanner->mutex);
+                        return;
+                }
+
+                scanner->jobs = jobs;
+                scanner->capacity = capacity;
+        }
+
+        scanner->jobs[scanner->numJobs].directory = directory;
+        scanner->jobs[scanner->numJobs].path = path;
+        scanner->numJobs++;
+        scanner->unfinishedJobs++;
+
+        pthread_cond_signal(&scanner->cond);
+        pthread_mutex_unlock(&scanner->mutex);
+}
+
+// Reads one directory into its entry and queues the subdirectories for the workers
+void scanDirectory(DirectoryScanner *scanner, FileSystemEntry *parent, const char *path, regex_t *regex)
+{
         DIR *directory = opendir(path);
         if (directory == NULL)
         {
                 perror("Error opening directory");
-                return 0;
+                return;
         }
 
-        struct dirent **entries;
-        int dirEntries = scandir(path, &entries, NULL, compareLibEntries);
-        if (dirEntries < 0)
+        ScannedEntry *entries = NULL;
+        int numEntries = 0;
+        int capacity = 0;
+        struct dirent *entry;
+
+        while ((entry = readdir(directory)) != NULL)
         {
-                perror("Error scanning directory entries");
-                closedir(directory);
-                return 0;
+                if (entry->d_name[0] == '.')
+                        continue;
+
+                int isDirectory = getEntryType(dirfd(directory), entry);
+
+                if (isDirectory < 0)
+                        continue;
+
+                if (!isDirectory)
+                {
+                        char exto[6];
+                        extractExtension(entry->d_name, sizeof(exto) - 1, exto);
+
+                        if (match_regex(regex, exto) != 0)
+                                continue;
+                }
+
+                if (numEntries == capacity)
+                {
+                        capacity = (capacity > 0) ? capacity * 2 : 32;
+                        ScannedEntry *tmp = realloc(entries, capacity * sizeof(ScannedEntry));
+
+                        if (tmp == NULL)
+                                break;
+
+                        entries = tmp;
+                }
+
+                size_t nameLength = strlen(entry->d_name) + 1;
+                char *name = malloc(nameLength * 2);
+
+                if (name == NULL)
+                        continue;
+
+                memcpy(name, entry->d_name, nameLength);
+                makeSortKey(entry->d_name, name + nameLength);
+
+                entries[numEntries].name = name;
+                entries[numEntries].sortKey = name + nameLength;
+                entries[numEntries].isDirectory = isDirectory;
+
+                numEntries++;
         }
 
+        closedir(directory);
+
+        // Sorting here instead of when merging keeps the tree the same no matter which worker got there first
+        if (numEntries > 1)
+                qsort(entries, numEntries, sizeof(ScannedEntry), compareScannedEntries);
+
+        // All children of a directory are allocated together, each name points into its full path
+        size_t pathLength = strlen(path);
+        size_t stringsSize = 0;
+
+        for (int i = 0; i < numEntries; i++)
+                stringsSize += pathLength + 1 + strlen(entries[i].name) + 1;
+
+        FileSystemEntry *children = (numEntries > 0) ? arenaAlloc(scanner->arena, numEntries * sizeof(FileSystemEntry)) : NULL;
+        char *strings = (numEntries > 0) ? arenaAlloc(scanner->arena, stringsSize) : NULL;
+
+        for (int i = 0; i < numEntries; i++)
+        {
+                if (children != NULL && strings != NULL)
+                {
+                        FileSystemEntry *child = &children[i];
+
+                        strings += initEntry(child, strings, path, entries[i].name, entries[i].isDirectory, parent);
+
+                        addChild(parent, child);
+
+                        if (child->isDirectory)
+                                pushScanJob(scanner, child, child->fullPath);
+                }
+
+                free(entries[i].name);
+        }
+
+        free(entries);
+}
+
+void *directoryScanWorker(void *arg)
+{
+        DirectoryScanner *scanner = (DirectoryScanner *)arg;
+
         regex_t regex;
         regcomp(&regex, AUDIO_EXTENSIONS, REG_EXTENDED);
 
-        int numEntries = 0;
-
-        for (int i = 0; i < dirEntries; ++i)
+        while (true)
         {
-                struct dirent *entry = entries[i];
+                pthread_mutex_lock(&scanner->mutex);
 
-                if (entry->d_name[0] != '.' && strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+                while (scanner->numJobs == 0 && scanner->unfinishedJobs > 0)
+                        pthread_cond_wait(&scanner->cond, &scanner->mutex);
+
+                if (scanner->numJobs == 0)
                 {
-                        char childPath[MAXPATHLEN];
-                        snprintf(childPath, sizeof(childPath), "%s/%s", path, entry->d_name);
+                        pthread_mutex_unlock(&scanner->mutex);
+                        break;
+                }
 
-                        struct stat fileStats;
-                        if (stat(childPath, &fileStats) == -1)
-                        {
-                                continue;
-                        }
+                // Newest first, so workers go deep and the queue stays small
+                ScanJob job = scanner->jobs[--scanner->numJobs];
 
-                        int isDirectory = true;
+                pthread_mutex_unlock(&scanner->mutex);
 
-                        if (S_ISREG(fileStats.st_mode))
-                        {
-                                isDirectory = false;
-                        }
+                scanDirectory(scanner, job.directory, job.path, &regex);
 
-                        char exto[6];
-                        extractExtension(entry->d_name, sizeof(exto) - 1, exto);
+                pthread_mutex_lock(&scanner->mutex);
 
-                        int isAudio = match_regex(&regex, exto);
+                scanner->unfinishedJobs--;
 
-                        if (isAudio == 0 || isDirectory)
-                        {
-                                FileSystemEntry *child = createEntry(entry->d_name, isDirectory, parent);
+                if (scanner->unfinishedJobs == 0)
+                        pthread_cond_broadcast(&scanner->cond);
 
-                                if (entry != NULL)
-                                {
-                                        setFullPath(child, path, entry->d_name);
-                                }
+                pthread_mutex_unlock(&scanner->mutex);
+        }
 
-                                addChild(parent, child);
+        regfree(&regex);
 
-                                if (isDirectory)
-                                {
-                                        numEntries++;
-                                        numEntries += readDirectory(childPath, child);
-                                }
-                        }
+        return NULL;
+}
+
+int getNumScanThreads()
+{
+        long numCpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+        // Scanning mostly waits on the file system, so use more threads than cores
+        int numThreads = (numCpus > 0) ? (int)numCpus * 2 : 4;
+
+        return (numThreads > MAX_SCAN_THREADS) ? MAX_SCAN_THREADS : numThreads;
+}
+
+// Numbers the entries the same way a single-threaded depth-first scan would
+int assignIds(FileSystemEntry *parent, int *lastId)
+{
+        int numDirectories = 0;
+        int numChildren = 0;
+
+        for (FileSystemEntry *child = parent->children; child != NULL; child = child->next)
+                numChildren++;
+
+        FileSystemEntry **children = malloc(numChildren * sizeof(FileSystemEntry *));
+
+        if (children == NULL && numChildren > 0)
+                return 0;
+
+        int i = numChildren;
+        for (FileSystemEntry *child = parent->children; child != NULL; child = child->next)
+                children[--i] = child;
+
+        for (i = 0; i < numChildren; i++)
+        {
+                FileSystemEntry *child = children[i];
+
+                child->id = ++(*lastId);
+                child->parentId = parent->id;
+
+                if (child->isDirectory)
+                {
+                        numDirectories++;
+                        numDirectories += assignIds(child, lastId);
                 }
+        }
+
+        free(children);
+
+        return numDirectories;
+}
 
-                free(entry);
+int readDirectory(const char *path, FileSystemEntry *parent, EntryArena *arena)
+{
+        DirectoryScanner scanner;
+
+        scanner.arena = arena;
+        scanner.jobs = NULL;
+        scanner.numJobs = 0;
+        scanner.capacity = 0;
+        scanner.unfinishedJobs = 0;
+        pthread_mutex_init(&scanner.mutex, NULL);
+        pthread_cond_init(&scanner.cond, NULL);
+
+        pushScanJob(&scanner, parent, path);
+
+        int numThreads = getNumScanThreads();
+        pthread_t threads[MAX_SCAN_THREADS];
+        int numStarted = 0;
+
+        for (int i = 0; i < numThreads; i++)
+        {
+                if (pthread_create(&threads[numStarted], NULL, directoryScanWorker, &scanner) == 0)
+                        numStarted++;
         }
 
-        free(entries);
-        regfree(&regex);
+        // Scan on this thread if no workers could be started
+        if (numStarted == 0)
+                directoryScanWorker(&scanner);
 
-        closedir(directory);
+        for (int i = 0; i < numStarted; i++)
+                pthread_join(threads[i], NULL);
+
+        free(scanner.jobs);
+        pthread_cond_destroy(&scanner.cond);
+        pthread_mutex_destroy(&scanner.mutex);
+
+        int numEntries = assignIds(parent, &arena->lastId);
 
         return numEntries;
 }
 
-void writeTreeToFile(FileSystemEntry *node, FILE *file, int parentId)
+// Grows the node array and string table of the cache being written
+int appendCachedNode(LibraryCacheWriter *writer, FileSystemEntry *entry, int parent)
 {
-        if (node == NULL)
+        if (writer->numNodes == writer->nodesCapacity)
         {
-                return;
+                int capacity = (writer->nodesCapacity > 0) ? writer->nodesCapacity * 2 : 1024;
+                CachedNode *nodes = realloc(writer->nodes, capacity * sizeof(CachedNode));
+
+                if (nodes == NULL)
+                        return -1;
+
+                writer->nodes = nodes;
+                writer->nodesCapacity = capacity;
         }
 
-        fprintf(file, "%d\t%s\t%d\t%d\n", node->id, node->name, node->isDirectory, parentId);
+        size_t nameLength = strlen(entry->name) + 1;
 
-        FileSystemEntry *child = node->children;
-        FileSystemEntry *tmp = NULL;
-        while (child)
+        if (writer->stringsSize + nameLength > writer->stringsCapacity)
         {
-                tmp = child->next;
-                writeTreeToFile(child, file, node->id);
-                child = tmp;
+                size_t capacity = (writer->stringsCapacity > 0) ? writer->stringsCapacity * 2 : 65536;
+
+                while (capacity < writer->stringsSize + nameLength)
+                        capacity *= 2;
+
+                char *strings = realloc(writer->strings, capacity);
+
+                if (strings == NULL)
+                        return -1;
+
+                writer->strings = strings;
+                writer->stringsCapacity = capacity;
         }
 
-        free(node->name);
-        free(node->fullPath);
-        free(node);
+        int index = writer->numNodes++;
+        CachedNode *node = &writer->nodes[index];
+
+        node->id = entry->id;
+        node->nameOffset = (uint32_t)writer->stringsSize;
+        node->parent = parent;
+        node->firstChild = -1;
+        node->nextSibling = -1;
+        node->isDirectory = entry->isDirectory;
+
+        memcpy(writer->strings + writer->stringsSize, entry->name, nameLength);
+        writer->stringsSize += nameLength;
+
+        // Indices are used instead of pointers since the array may move
+        int prevChild = -1;
+
+        for (FileSystemEntry *child = entry->children; child != NULL; child = child->next)
+        {
+                int childIndex = appendCachedNode(writer, child, index);
+
+                if (childIndex < 0)
+                        return -1;
+
+                if (prevChild < 0)
+                        writer->nodes[index].firstChild = childIndex;
+                else
+                        writer->nodes[prevChild].nextSibling = childIndex;
+
+                prevChild = childIndex;
+        }
+
+        return index;
 }
 
-void freeAndWriteTree(FileSystemEntry *root, const char *filename)
+int writeLibraryCache(FileSystemEntry *root, const char *filename)
 {
-        FILE *file = fopen(filename, "w");
+        LibraryCacheWriter writer = {0};
+
+        if (appendCachedNode(&writer, root, -1) < 0)
+        {
+                free(writer.nodes);
+                free(writer.strings);
+                return -1;
+        }
+
+        LibraryCacheHeader header = {0};
+        memcpy(header.magic, LIBRARY_CACHE_MAGIC, sizeof(header.magic));
+        header.version = LIBRARY_CACHE_VERSION;
+        header.numNodes = (uint32_t)writer.numNodes;
+        header.stringsSize = (uint32_t)writer.stringsSize;
+
+        // Write next to the old cache and rename over it, it may still be mapped
+        char tmpFilename[MAXPATHLEN];
+        snprintf(tmpFilename, sizeof(tmpFilename), "%s.tmp", filename);
+
+        FILE *file = fopen(tmpFilename, "wb");
         if (!file)
         {
                 perror("Failed to open file");
+                free(writer.nodes);
+                free(writer.strings);
+                return -1;
+        }
+
+        bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                       fwrite(writer.nodes, sizeof(CachedNode), writer.numNodes, file) == (size_t)writer.numNodes &&
+                       fwrite(writer.strings, 1, writer.stringsSize, file) == writer.stringsSize;
+
+        if (fclose(file) != 0)
+                written = false;
+
+        free(writer.nodes);
+        free(writer.strings);
+
+        if (!written || rename(tmpFilename, filename) != 0)
+        {
+                unlink(tmpFilename);
+                return -1;
+        }
+
+        return 0;
+}
+
+void freeAndWriteTree(FileSystemEntry *root, const char *filename)
+{
+        if (root == NULL)
+        {
                 return;
         }
 
-        writeTreeToFile(root, file, -1);
-        fclose(file);
+        writeLibraryCache(root, filename);
+        freeTree(root);
 }
 
 FileSystemEntry *createDirectoryTree(const char *startPath, int *numEntries)
 {
-        FileSystemEntry *root = createEntry("root", 1, NULL);
+        EntryArena *arena = createArena();
+        FileSystemEntry *root = (arena != NULL) ? createRootEntry(arena, "/") : NULL;
 
-        setFullPath(root, "", "");
+        if (root == NULL)
+        {
+                if (arena != NULL)
+                        freeArena(arena);
 
-        *numEntries = readDirectory(startPath, root);
-        *numEntries -= removeEmptyDirectories(root);
+                *numEntries = 0;
+                return NULL;
+        }
 
-        lastUsedId = 0;
+        *numEntries = readDirectory(startPath, root, arena);
+        *numEntries -= removeEmptyDirectories(root);
 
         return root;
 }
 
-FileSystemEntry **resizeNodesArray(FileSystemEntry **nodes, int oldSize, int newSize)
+EntryArena *findArena(FileSystemEntry *root)
 {
-        FileSystemEntry **newNodes = realloc(nodes, newSize * sizeof(FileSystemEntry *));
-        if (newNodes)
+        EntryArena *arena = NULL;
+
+        pthread_mutex_lock(&entryArenasMutex);
+
+        for (arena = entryArenas; arena != NULL; arena = arena->next)
         {
-                for (int i = oldSize; i < newSize; i++)
+                if (arena->root == root)
+                        break;
+        }
+
+        pthread_mutex_unlock(&entryArenasMutex);
+
+        return arena;
+}
+
+// Lets others tell whether a tree has changed since they last looked at it
+unsigned int getTreeVersion(FileSystemEntry *root)
+{
+        unsigned int version = 0;
+
+        pthread_mutex_lock(&entryArenasMutex);
+
+        for (EntryArena *arena = entryArenas; arena != NULL; arena = arena->next)
+        {
+                if (arena->root == root)
                 {
-                        newNodes[i] = NULL;
+                        version = arena->version;
+                        break;
                 }
         }
-        return newNodes;
+
+        pthread_mutex_unlock(&entryArenasMutex);
+
+        return version;
 }
 
-FileSystemEntry *reconstructTreeFromFile(const char *filename, const char *startMusicPath, int *numDirectoryEntries)
+int countDirectories(FileSystemEntry *entry)
 {
-        FILE *file = fopen(filename, "r");
-        if (!file)
+        int numDirectories = entry->isDirectory ? 1 : 0;
+
+        for (FileSystemEntry *child = entry->children; child != NULL; child = child->next)
         {
-                return NULL;
+                if (child->isDirectory)
+                        numDirectories += countDirectories(child);
         }
 
-        char line[1024];
-        int nodesCount = 0, nodesCapacity = 1000, oldCapacity = 0;
-        FileSystemEntry **nodes = calloc(nodesCapacity, sizeof(FileSystemEntry *));
-        if (!nodes)
+        return numDirectories;
+}
+
+void unlinkEntry(FileSystemEntry *parent, FileSystemEntry *entry)
+{
+        FileSystemEntry **link = &parent->children;
+
+        while (*link != NULL && *link != entry)
+                link = &(*link)->next;
+
+        // Readers may still be on the entry, so it keeps its next pointer and memory
+        if (*link != NULL)
+                *link = entry->next;
+}
+
+// Links the child in at the position a scan would have put it
+void insertChildSorted(FileSystemEntry *parent, FileSystemEntry *child)
+{
+        char childKey[NAME_MAX + 1];
+        char siblingKey[NAME_MAX + 1];
+
+        if (strlen(child->name) > NAME_MAX)
+        {
+                addChild(parent, child);
+                return;
+        }
+
+        makeSortKey(child->name, childKey);
+
+        ScannedEntry childEntry = {child->name, childKey, child->isDirectory};
+        FileSystemEntry **link = &parent->children;
+
+        while (*link != NULL)
         {
-                fclose(file);
+                if (strlen((*link)->name) <= NAME_MAX)
+                {
+                        makeSortKey((*link)->name, siblingKey);
+
+                        ScannedEntry sibling = {(*link)->name, siblingKey, (*link)->isDirectory};
+
+                        // The scan sorts in descending order and prepends
+                        if (compareScannedEntries(&childEntry, &sibling) > 0)
+                                break;
+                }
+
+                link = &(*link)->next;
+        }
+
+        child->next = *link;
+        *link = child;
+}
+
+// Returns the deepest directory in the tree along path
+FileSystemEntry *findEntryByPath(FileSystemEntry *root, const char *rootPath, const char *path)
+{
+        size_t rootPathLength = strlen(rootPath);
+
+        if (root == NULL || strncmp(path, rootPath, rootPathLength) != 0)
+                return NULL;
+
+        const char *rest = path + rootPathLength;
+
+        if (*rest != '\0' && *rest != '/')
                 return NULL;
+
+        FileSystemEntry *entry = root;
+
+        while (*rest != '\0')
+        {
+                while (*rest == '/')
+                        rest++;
+
+                size_t length = strcspn(rest, "/");
+
+                if (length == 0)
+                        break;
+
+                FileSystemEntry *child = entry->children;
+
+                while (child != NULL && !(child->isDirectory && strncmp(child->name, rest, length) == 0 && child->name[length] == '\0'))
+                        child = child->next;
+
+                if (child == NULL)
+                        break;
+
+                entry = child;
+                rest += length;
         }
 
-        FileSystemEntry *root = NULL;
+        return entry;
+}
 
-        while (fgets(line, sizeof(line), file))
+void bumpTreeVersion(EntryArena *arena)
+{
+        pthread_mutex_lock(&entryArenasMutex);
+        arena->version = ++lastTreeVersion;
+        pthread_mutex_unlock(&entryArenasMutex);
+}
+
+// What a directory holds on disk, name -> 1 for a directory, 2 for an audio file. NULL with errno set if it can't be read.
+GHashTable *listDirectoryEntries(const char *path)
+{
+        DIR *dir = opendir(path);
+
+        if (dir == NULL)
+                return NULL;
+
+        regex_t regex;
+        regcomp(&regex, AUDIO_EXTENSIONS, REG_EXTENDED);
+
+        GHashTable *onDisk = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+        struct dirent *entry;
+
+        while ((entry = readdir(dir)) != NULL)
         {
-                int id, parentId, isDirectory;
-                char name[256];
+                if (entry->d_name[0] == '.')
+                        continue;
 
-                if (sscanf(line, "%d\t%255[^\t]\t%d\t%d", &id, name, &isDirectory, &parentId) == 4)
+                int type = getEntryType(dirfd(dir), entry);
+
+                if (type < 0)
+                        continue;
+
+                if (type == 0)
                 {
-                        if (id >= nodesCapacity)
-                        {
-                                oldCapacity = nodesCapacity;
-                                nodesCapacity = id + 100;
-                                FileSystemEntry **tempNodes = resizeNodesArray(nodes, oldCapacity, nodesCapacity);
-                                if (!tempNodes)
-                                {
-                                        perror("Failed to resize nodes array");
-
-                                        for (int i = 0; i < nodesCount; i++)
-                                        {
-                                                if (nodes[i])
-                                                {
-                                                        free(nodes[i]->name);
-                                                        free(nodes[i]->fullPath);
-                                                        free(nodes[i]);
-                                                }
-                                        }
-                                        free(nodes);
-                                        fclose(file);
-                                        exit(EXIT_FAILURE);
-                                }
-                                nodes = tempNodes;
-                        }
+                        char exto[6];
+                        extractExtension(entry->d_name, sizeof(exto) - 1, exto);
 
-                        FileSystemEntry *node = malloc(sizeof(FileSystemEntry));
-                        if (!node)
-                        {
-                                perror("Failed to allocate node");
+                        if (match_regex(&regex, exto) != 0)
+                                continue;
+                }
 
-                                fclose(file);
-                                exit(EXIT_FAILURE);
-                        }
-                        node->id = id;
-                        node->name = strdup(name);
-                        node->isDirectory = isDirectory;
-                        node->isEnqueued = 0;
-                        node->children = node->next = node->parent = NULL;
-                        nodes[id] = node;
-                        nodesCount++;
-
-                        if (parentId >= 0 && nodes[parentId])
-                        {
-                                node->parent = nodes[parentId];
-                                if (nodes[parentId]->children)
-                                {
-                                        FileSystemEntry *child = nodes[parentId]->children;
-                                        while (child->next)
-                                        {
-                                                child = child->next;
-                                        }
-                                        child->next = node;
-                                }
-                                else
-                                {
-                                        nodes[parentId]->children = node;
-                                }
+                g_hash_table_insert(onDisk, strdup(entry->d_name), GINT_TO_POINTER(type == 1 ? 1 : 2));
+        }
+
+        closedir(dir);
+        regfree(&regex);
 
-                                setFullPath(node, nodes[parentId]->fullPath, node->name);
+        return onDisk;
+}
+
+// Unlinks the children of a directory that are no longer on disk and takes the rest out of onDisk, which leaves
+// the new ones there. A NULL onDisk means the directory itself is gone or can't be read. Returns the number of entries removed.
+int removeMissingEntries(FileSystemEntry *root, FileSystemEntry *directory, GHashTable *onDisk, int *numDirectories)
+{
+        EntryArena *arena = findArena(root);
+
+        if (arena == NULL || directory == NULL)
+                return 0;
+
+        int numChanges = 0;
+
+        if (onDisk == NULL)
+        {
+                if (directory == root || directory->parent == NULL)
+                        return 0;
 
-                                if (isDirectory)
-                                        *numDirectoryEntries = *numDirectoryEntries + 1;
+                *numDirectories -= countDirectories(directory);
+                unlinkEntry(directory->parent, directory);
+                numChanges++;
+        }
+        else
+        {
+                FileSystemEntry *child = directory->children;
+
+                while (child != NULL)
+                {
+                        FileSystemEntry *next = child->next;
+                        int type = GPOINTER_TO_INT(g_hash_table_lookup(onDisk, child->name));
+
+                        if (type == (child->isDirectory ? 1 : 2))
+                        {
+                                g_hash_table_remove(onDisk, child->name);
                         }
                         else
                         {
-                                root = node;
-                                setFullPath(node, startMusicPath, "");
+                                *numDirectories -= countDirectories(child);
+                                unlinkEntry(directory, child);
+                                numChanges++;
                         }
+
+                        child = next;
                 }
         }
-        fclose(file);
-        free(nodes);
 
-        return root;
+        if (numChanges > 0)
+                bumpTreeVersion(arena);
+
+        return numChanges;
 }
 
-int min(int a, int b, int c)
+// Scans the entries named in newEntries into an arena of their own, outside of any tree. Directories are read
+// in full and left out if they have no audio, like in a full scan.
+FileSystemEntry *scanNewEntries(const char *path, GHashTable *newEntries, EntryArena **arena)
 {
-        if (a <= b && a <= c)
-                return a;
-        if (b <= a && b <= c)
-                return b;
-        return c;
-}
+        *arena = createArena();
 
-#ifdef __GNUC__
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
-#endif
-// Calculates the Levenshtein distance.
-// The Levenshtein distance between two strings is the minimum number of single-character edits
-// (insertions, deletions, or substitutions) required to change one string into the other.
-int levenshteinDistance(const char *s1, const char *s2)
-{
-        int len1 = strlen(s1);
-        int len2 = strlen(s2);
-        int **d = (int **)malloc((len1 + 1) * sizeof(int *));
-        for (int i = 0; i <= len1; i++)
-        {
-                d[i] = (int *)malloc((len2 + 1) * sizeof(int));
-                for (int j = 0; j <= len2; j++)
+        if (*arena == NULL)
+                return NULL;
+
+        FileSystemEntry *entries = NULL;
+        GHashTableIter iter;
+        gpointer key, value;
+        g_hash_table_iter_init(&iter, newEntries);
+
+        while (g_hash_table_iter_next(&iter, &key, &value))
+        {
+                const char *name = (const char *)key;
+                int isDirectory = (GPOINTER_TO_INT(value) == 1);
+                FileSystemEntry *newEntry = arenaAlloc(*arena, sizeof(FileSystemEntry));
+                char *fullPath = arenaAlloc(*arena, strlen(path) + 1 + strlen(name) + 1);
+
+                if (newEntry == NULL || fullPath == NULL)
+                        break;
+
+                initEntry(newEntry, fullPath, path, name, isDirectory, NULL);
+
+                if (isDirectory)
                 {
-                        d[i][j] = 0;
+                        readDirectory(newEntry->fullPath, newEntry, *arena);
+                        removeEmptyDirectories(newEntry);
+
+                        if (newEntry->children == NULL)
+                                continue;
                 }
+
+                newEntry->next = entries;
+                entries = newEntry;
         }
 
-        for (int i = 0; i <= len1; i++)
+        return entries;
+}
+
+bool hasChildNamed(FileSystemEntry *directory, const char *name)
+{
+        for (FileSystemEntry *child = directory->children; child != NULL; child = child->next)
         {
-                d[i][0] = i;
+                if (strcmp(child->name, name) == 0)
+                        return true;
         }
-        for (int j = 0; j <= len2; j++)
+
+        return false;
+}
+
+// Links entries from scanNewEntries into the directory and merges their arena into the tree's. A directory left
+// without children is removed. Returns the number of entries added or removed.
+int addScannedEntries(FileSystemEntry *root, FileSystemEntry *directory, FileSystemEntry *entries, EntryArena *arena, int *numDirectories)
+{
+        EntryArena *treeArena = findArena(root);
+
+        if (treeArena == NULL || directory == NULL)
         {
-                d[0][j] = j;
+                if (arena != NULL)
+                        freeArena(arena);
+
+                return 0;
         }
 
-        for (int i = 1; i <= len1; i++)
+        int numChanges = 0;
+        FileSystemEntry *entry = entries;
+
+        while (entry != NULL)
         {
-                for (int j = 1; j <= len2; j++)
+                FileSystemEntry *next = entry->next;
+
+                // Skip names the directory has got in the meantime
+                if (!hasChildNamed(directory, entry->name))
                 {
-                        int cost = (s1[i - 1] == s2[j - 1]) ? 0 : 1;
-                        d[i][j] = min(d[i - 1][j] + 1,         // deletion
-                                      d[i][j - 1] + 1,         // insertion
-                                      d[i - 1][j - 1] + cost); // substitution
+                        entry->parent = directory;
+                        entry->id = ++treeArena->lastId;
+                        entry->parentId = directory->id;
+
+                        if (entry->isDirectory)
+                                *numDirectories += assignIds(entry, &treeArena->lastId) + 1;
+
+                        insertChildSorted(directory, entry);
+                        numChanges++;
                 }
+
+                entry = next;
         }
 
-        int distance = d[len1][len2];
-        for (int i = 0; i <= len1; i++)
+        if (arena != NULL)
+                mergeArena(treeArena, arena);
+
+        if (directory->children == NULL && directory != root && directory->parent != NULL)
         {
-                free(d[i]);
+                *numDirectories -= 1;
+                unlinkEntry(directory->parent, directory);
+                numChanges++;
         }
-        free(d);
-        return distance;
+
+        if (numChanges > 0)
+                bumpTreeVersion(treeArena);
+
+        return numChanges;
 }
-#ifdef __GNUC__
-#pragma GCC diagnostic pop
-#endif
 
-// Returns a new string that is lowercase of str
-char *strLower(char *str)
+// Checks that every index and offset stays inside the file, and that parents come before their children
+bool isValidLibraryCache(const LibraryCacheHeader *header, const CachedNode *nodes, const char *strings, size_t mapSize)
 {
-        char *lowerStr = strdup(str);
-        for (char *p = lowerStr; *p; ++p)
+        if (memcmp(header->magic, LIBRARY_CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+            header->version != LIBRARY_CACHE_VERSION ||
+            header->numNodes == 0 || header->stringsSize == 0)
+                return false;
+
+        if (mapSize != sizeof(LibraryCacheHeader) + (size_t)header->numNodes * sizeof(CachedNode) + header->stringsSize)
+                return false;
+
+        if (strings[header->stringsSize - 1] != '\0')
+                return false;
+
+        int numNodes = (int)header->numNodes;
+
+        for (int i = 0; i < numNodes; i++)
         {
-                *p = tolower(*p);
+                const CachedNode *node = &nodes[i];
+
+                if (node->nameOffset >= header->stringsSize)
+                        return false;
+
+                if ((i == 0) != (node->parent < 0) || node->parent >= i)
+                        return false;
+
+                if (node->firstChild >= numNodes || node->nextSibling >= numNodes ||
+                    (node->firstChild >= 0 && node->firstChild <= i) ||
+                    (node->nextSibling >= 0 && node->nextSibling <= i))
+                        return false;
         }
-        return lowerStr;
+
+        return true;
 }
 
-// Traverses the tree and applies fuzzy search on each node
-void fuzzySearchRecursive(FileSystemEntry *node, const char *searchTerm, int threshold, void (*callback)(FileSystemEntry *, int))
+FileSystemEntry *reconstructTreeFromFile(const char *filename, const char *startMusicPath, int *numDirectoryEntries)
 {
-        if (node == NULL)
+        int fd = open(filename, O_RDONLY);
+        if (fd < 0)
         {
-                return;
+                return NULL;
         }
 
-        // Convert search term, name, and fullPath to lowercase
-        char *lowerSearchTerm = strLower((char *)searchTerm);
-        char *lowerName = strLower(node->name);
+        struct stat fileStats;
+        if (fstat(fd, &fileStats) != 0 || (size_t)fileStats.st_size < sizeof(LibraryCacheHeader))
+        {
+                close(fd);
+                return NULL;
+        }
 
-        int nameDistance = levenshteinDistance(lowerName, lowerSearchTerm);
+        size_t mapSize = fileStats.st_size;
+        void *map = mmap(NULL, mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
 
-        // Partial matching with lowercase strings
-        if (strstr(lowerName, lowerSearchTerm) != NULL)
+        if (map == MAP_FAILED)
         {
-                callback(node, 0);
+                return NULL;
         }
-        else if (nameDistance <= threshold)
+
+        const LibraryCacheHeader *header = (const LibraryCacheHeader *)map;
+        const CachedNode *nodes = (const CachedNode *)((const char *)map + sizeof(LibraryCacheHeader));
+        const char *strings = (const char *)(nodes + header->numNodes);
+
+        // Older text caches fail here and the library gets scanned instead
+        if (!isValidLibraryCache(header, nodes, strings, mapSize))
         {
-                callback(node, nameDistance);
+                munmap(map, mapSize);
+                return NULL;
         }
 
-        // Free the allocated memory for lowercase strings
-        free(lowerSearchTerm);
-        free(lowerName);
+        int numNodes = (int)header->numNodes;
+
+        EntryArena *arena = createArena();
+
+        if (arena == NULL)
+        {
+                munmap(map, mapSize);
+                return NULL;
+        }
+
+        // Freed together with the arena
+        arena->map = map;
+        arena->mapSize = mapSize;
+
+        FileSystemEntry *entries = arenaAlloc(arena, numNodes * sizeof(FileSystemEntry));
+
+        // Parents come first, so each path length can be worked out from the parent's
+        size_t *pathLengths = malloc(numNodes * sizeof(size_t));
+        size_t pathsSize = 0;
+
+        if (entries == NULL || pathLengths == NULL)
+        {
+                free(pathLengths);
+                freeArena(arena);
+                return NULL;
+        }
+
+        for (int i = 0; i < numNodes; i++)
+        {
+                // The root's path is the music folder followed by a slash
+                if (i == 0)
+                        pathLengths[i] = strlen(startMusicPath) + 1;
+                else
+                        pathLengths[i] = pathLengths[nodes[i].parent] + 1 + strlen(strings + nodes[i].nameOffset);
+
+                pathsSize += pathLengths[i] + 1;
+        }
+
+        char *path = arenaAlloc(arena, pathsSize);
+
+        if (path == NULL)
+        {
+                free(pathLengths);
+                freeArena(arena);
+                return NULL;
+        }
+
+        for (int i = 0; i < numNodes; i++)
+        {
+                const CachedNode *node = &nodes[i];
+                FileSystemEntry *entry = &entries[i];
+                const char *parentPath = (i == 0) ? startMusicPath : entries[node->parent].fullPath;
+
+                // Names are used in place from the mapping
+                entry->id = node->id;
+                entry->name = (char *)(strings + node->nameOffset);
+                entry->isDirectory = node->isDirectory;
+                entry->isEnqueued = 0;
+                entry->parent = (node->parent >= 0) ? &entries[node->parent] : NULL;
+                entry->parentId = (entry->parent != NULL) ? entry->parent->id : -1;
+                entry->children = (node->firstChild >= 0) ? &entries[node->firstChild] : NULL;
+                entry->next = (node->nextSibling >= 0) ? &entries[node->nextSibling] : NULL;
+
+                snprintf(path, pathLengths[i] + 1, "%s/%s", parentPath, (i == 0) ? "" : entry->name);
+                entry->fullPath = path;
+                path += pathLengths[i] + 1;
+
+                if (entry->parent != NULL && entry->isDirectory)
+                        *numDirectoryEntries = *numDirectoryEntries + 1;
+
+                if (entry->id > arena->lastId)
+                        arena->lastId = entry->id;
+        }
+
+        free(pathLengths);
+
+        setArenaRoot(arena, &entries[0]);
+
+        return &entries[0];
+}
+
+void prepareEditPattern(EditPattern *pattern, const char *str)
+{
+        size_t length = strlen(str);
+
+        if (length > EDIT_PATTERN_WORDS * 64)
+                length = EDIT_PATTERN_WORDS * 64;
+
+        memset(pattern->peq, 0, sizeof(pattern->peq));
+
+        pattern->length = (int)length;
+        pattern->numWords = (int)((length + 63) / 64);
+
+        for (size_t i = 0; i < length; i++)
+                pattern->peq[(unsigned char)str[i]][i / 64] |= (uint64_t)1 << (i % 64);
+}
+
+// Levenshtein distance with Myers' bit-vector algorithm, in Hyyrö's form for patterns longer than a word.
+// Each column of the distance matrix is kept as bit vectors of +1/-1 steps, so a text character costs one pass over the pattern words.
+// Returns threshold + 1 as soon as the distance can't be threshold or less.
+int boundedEditDistance(const EditPattern *pattern, const char *text, int textLength, int threshold)
+{
+        int m = pattern->length;
+
+        if (m == 0)
+                return (textLength <= threshold) ? textLength : threshold + 1;
+
+        // The distance is at least the difference in length
+        if (textLength - m > threshold || m - textLength > threshold)
+                return threshold + 1;
+
+        uint64_t pv[EDIT_PATTERN_WORDS];
+        uint64_t mv[EDIT_PATTERN_WORDS];
+        int lastWord = pattern->numWords - 1;
+        uint64_t lastBit = (uint64_t)1 << ((m - 1) % 64);
+        int score = m;
+
+        for (int w = 0; w <= lastWord; w++)
+        {
+                pv[w] = ~(uint64_t)0;
+                mv[w] = 0;
+        }
+
+        for (int j = 0; j < textLength; j++)
+        {
+                const uint64_t *peq = pattern->peq[(unsigned char)text[j]];
+                int hin = 1; // The top row of the matrix goes up by one per column
+
+                for (int w = 0; w <= lastWord; w++)
+                {
+                        uint64_t eq = peq[w];
+                        uint64_t xv = eq | mv[w];
+
+                        if (hin < 0)
+                                eq |= 1;
+
+                        uint64_t xh = (((eq & pv[w]) + pv[w]) ^ pv[w]) | eq;
+                        uint64_t ph = mv[w] | ~(xh | pv[w]);
+                        uint64_t mh = pv[w] & xh;
+                        uint64_t outBit = (w == lastWord) ? lastBit : (uint64_t)1 << 63;
+                        int hout = ((ph & outBit) ? 1 : 0) - ((mh & outBit) ? 1 : 0);
+
+                        ph <<= 1;
+                        mh <<= 1;
+
+                        if (hin < 0)
+                                mh |= 1;
+                        else if (hin > 0)
+                                ph |= 1;
+
+                        pv[w] = mh | ~(xv | ph);
+                        mv[w] = ph & xv;
+
+                        hin = hout;
+                }
+
+                score += hin;
+
+                // Each remaining column can lower the score by at most one
+                if (score - (textLength - j - 1) > threshold)
+                        return threshold + 1;
+        }
 
-        fuzzySearchRecursive(node->children, searchTerm, threshold, callback);
-        fuzzySearchRecursive(node->next, searchTerm, threshold, callback);
+        return (score <= threshold) ? score : threshold + 1;
 }
 
 FileSystemEntry *findCorrespondingEntry(FileSystemEntry *temp, const char *fullPath)
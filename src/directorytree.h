@@ -3,12 +3,21 @@
 
 #include <ctype.h>
 #include <dirent.h>
+#include <errno.h>
+#include <glib.h>
+#include <limits.h>
+#include <pthread.h>
 #include <regex.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 #include "file.h"
 #include "utils.h"
 
@@ -28,6 +37,21 @@ typedef struct FileSystemEntry
 } FileSystemEntry;
 #endif
 
+#ifndef EDITPATTERN_STRUCT
+#define EDITPATTERN_STRUCT
+
+#define EDIT_PATTERN_WORDS 4 // Longer patterns are cut at 256 bytes
+
+typedef struct
+{
+        uint64_t peq[256][EDIT_PATTERN_WORDS]; // Per byte value, where it occurs in the pattern
+        int length;
+        int numWords;
+} EditPattern;
+#endif
+
+typedef struct EntryArena EntryArena;
+
 #ifndef SLOWLOADING_CALLBACK
 #define SLOWLOADING_CALLBACK
 typedef void (*SlowloadingCallback)(void);
@@ -37,6 +61,13 @@ FileSystemEntry *createDirectoryTree(const char *startPath, int *numEntries);
 void freeTree(FileSystemEntry *root);
 void freeAndWriteTree(FileSystemEntry *root, const char *filename);
 FileSystemEntry *reconstructTreeFromFile(const char *filename, const char *startMusicPath, int *numDirectoryEntries);
-void fuzzySearchRecursive(FileSystemEntry *node, const char *searchTerm, int threshold, void (*callback)(FileSystemEntry *, int));
+void prepareEditPattern(EditPattern *pattern, const char *str);
+int boundedEditDistance(const EditPattern *pattern, const char *text, int textLength, int threshold);
 void copyIsEnqueued(FileSystemEntry *library, FileSystemEntry *temp);
+FileSystemEntry *findEntryByPath(FileSystemEntry *root, const char *rootPath, const char *path);
+GHashTable *listDirectoryEntries(const char *path);
+int removeMissingEntries(FileSystemEntry *root, FileSystemEntry *directory, GHashTable *onDisk, int *numDirectories);
+FileSystemEntry *scanNewEntries(const char *path, GHashTable *newEntries, EntryArena **arena);
+int addScannedEntries(FileSystemEntry *root, FileSystemEntry *directory, FileSystemEntry *entries, EntryArena *arena, int *numDirectories);
+unsigned int getTreeVersion(FileSystemEntry *root);
 #endif
@@ -56,49 +56,46 @@ int isDirectory(const char *path)
         }
 }
 
-// Traverse a directory tree and search for a given file or directory
-int walker(const char *startPath, const char *searching, char *result,
-           const char *allowedExtensions, enum SearchType searchType, bool exactSearch)
+int getEntryType(int dirFd, const struct dirent *entry)
 {
-        DIR *d;
-        struct dirent *dir;
-        struct stat file_stat;
-        char ext[6]; // +1 for null-terminator
-        regex_t regex;
-        int ret = regcomp(&regex, allowedExtensions, REG_EXTENDED);
-        if (ret != 0)
-        {
+#ifdef _DIRENT_HAVE_D_TYPE
+        // Most file systems report the type, then no stat is needed
+        if (entry->d_type == DT_DIR)
+                return 1;
+        if (entry->d_type == DT_REG)
+                return 0;
+        if (entry->d_type != DT_UNKNOWN && entry->d_type != DT_LNK)
                 return -1;
-        }
+#endif
+        struct stat fileStats;
 
-        bool copyresult = false;
+        // Follows symlinks, like stat
+        if (fstatat(dirFd, entry->d_name, &fileStats, 0) != 0)
+                return -1;
 
-        if (startPath != NULL)
-        {
-                d = opendir(startPath);
-                if (d == NULL)
-                {
-                        fprintf(stderr, "Failed to open directory.\n");
-                        return 0;
-                }
-                int chdirResult = chdir(startPath);
+        if (S_ISDIR(fileStats.st_mode))
+                return 1;
+        if (S_ISREG(fileStats.st_mode))
+                return 0;
 
-                if (chdirResult != 0)
-                {
-                        fprintf(stderr, "Failed to change directory: %s\n", startPath);
-                        return 0;
-                }
-        }
-        else
+        return -1;
+}
+
+int walkDirectory(int dirFd, const char *dirPath, const char *searching, char *result,
+                  regex_t *regex, enum SearchType searchType, bool exactSearch)
+{
+        DIR *d = fdopendir(dirFd);
+        struct dirent *dir;
+        char ext[6]; // +1 for null-terminator
+
+        if (d == NULL)
         {
-                d = opendir(".");
-                if (d == NULL)
-                {
-                        fprintf(stderr, "Failed to open current directory.\n");
-                        return 0;
-                }
+                close(dirFd);
+                return 1;
         }
 
+        bool copyresult = false;
+
         while ((dir = readdir(d)))
         {
                 if (strcmp(dir->d_name, ".") == 0 || strcmp(dir->d_name, "..") == 0)
@@ -106,47 +103,37 @@ int walker(const char *startPath, const char *searching, char *result,
                         continue;
                 }
 
-                char entryPath[MAXPATHLEN];
-                char *currentDir = getcwd(NULL, 0);                
-                snprintf(entryPath, sizeof(entryPath), "%s/%s", currentDir, dir->d_name);
-                free(currentDir);
-
-                if (stat(entryPath, &file_stat) != 0)
-                {
-                        continue;
-                }
+                int type = getEntryType(dirfd(d), dir);
 
-                if (S_ISDIR(file_stat.st_mode))
+                if (type == 1)
                 {
                         if (((exactSearch && (strcasecmp(dir->d_name, searching) == 0)) || (!exactSearch && c_strcasestr(dir->d_name, searching) != NULL)) &&
                             (searchType != FileOnly) && (searchType != SearchPlayList))
                         {
-                                char *curDir = getcwd(NULL, 0);
-                                snprintf(result, MAXPATHLEN, "%s/%s", curDir, dir->d_name);
-                                free(curDir);
+                                snprintf(result, MAXPATHLEN, "%s/%s", dirPath, dir->d_name);
                                 copyresult = true;
                                 break;
                         }
                         else
                         {
-                                if (chdir(dir->d_name) == -1)
+                                int childFd = openat(dirfd(d), dir->d_name, O_RDONLY | O_DIRECTORY);
+                                if (childFd < 0)
                                 {
-                                        fprintf(stderr, "Failed to change directory: %s\n", dir->d_name);
+                                        fprintf(stderr, "Failed to open directory: %s\n", dir->d_name);
                                         continue;
                                 }
-                                if (walker(NULL, searching, result, allowedExtensions, searchType, exactSearch) == 0)
+
+                                char childPath[MAXPATHLEN];
+                                snprintf(childPath, sizeof(childPath), "%s/%s", dirPath, dir->d_name);
+
+                                if (walkDirectory(childFd, childPath, searching, result, regex, searchType, exactSearch) == 0)
                                 {
                                         copyresult = true;
                                         break;
                                 }
-                                if (chdir("..") == -1)
-                                {
-                                        fprintf(stderr, "Failed to change directory to parent.\n");
-                                        break;
-                                }
                         }
                 }
-                else
+                else if (type == 0)
                 {
                         if (searchType == DirOnly)
                         {
@@ -160,27 +147,64 @@ int walker(const char *startPath, const char *searching, char *result,
                         }
 
                         extractExtension(filename, sizeof(ext) - 1, ext);
-                        if (match_regex(&regex, ext) != 0)
+                        if (match_regex(regex, ext) != 0)
                         {
                                 continue;
                         }
 
                         if ((exactSearch && (strcasecmp(dir->d_name, searching) == 0)) || (!exactSearch && c_strcasestr(dir->d_name, searching) != NULL))
                         {
-                                char *curDir = getcwd(NULL, 0);
-                                snprintf(result, MAXPATHLEN, "%s/%s", curDir, dir->d_name);
+                                snprintf(result, MAXPATHLEN, "%s/%s", dirPath, dir->d_name);
                                 copyresult = true;
-                                free(curDir);
                                 break;
                         }
                 }
         }
         closedir(d);
-        regfree(&regex);
 
         return copyresult ? 0 : 1;
 }
 
+// Traverse a directory tree and search for a given file or directory
+int walker(const char *startPath, const char *searching, char *result,
+           const char *allowedExtensions, enum SearchType searchType, bool exactSearch)
+{
+        regex_t regex;
+        int ret = regcomp(&regex, allowedExtensions, REG_EXTENDED);
+        if (ret != 0)
+        {
+                return -1;
+        }
+
+        char startDir[MAXPATHLEN];
+
+        if (startPath != NULL)
+        {
+                snprintf(startDir, sizeof(startDir), "%s", startPath);
+        }
+        else if (getcwd(startDir, sizeof(startDir)) == NULL)
+        {
+                fprintf(stderr, "Failed to open current directory.\n");
+                regfree(&regex);
+                return 0;
+        }
+
+        int dirFd = open(startDir, O_RDONLY | O_DIRECTORY);
+        if (dirFd < 0)
+        {
+                fprintf(stderr, "Failed to open directory.\n");
+                regfree(&regex);
+                return 0;
+        }
+
+        // Walks with directory descriptors instead of changing the working directory, which would affect every thread
+        int result_code = walkDirectory(dirFd, startDir, searching, result, &regex, searchType, exactSearch);
+
+        regfree(&regex);
+
+        return result_code;
+}
+
 int expandPath(const char *inputPath, char *expandedPath)
 {
         if (inputPath[0] == '\0' || inputPath[0] == '\r')
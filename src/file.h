@@ -3,6 +3,7 @@
 
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <libgen.h>
 #include <pwd.h>
 #include <regex.h>
@@ -39,6 +40,9 @@ void getDirectoryFromPath(const char *path, char *directory);
 
 int isDirectory(const char *path);
 
+/* Returns 1 for a directory, 0 for a regular file and -1 otherwise, using d_type when the file system provides it */
+int getEntryType(int dirFd, const struct dirent *entry);
+
 /* Traverse a directory tree and search for a given file or directory */
 int walker(const char *startPath, const char *searching, char *result,
            const char *allowedExtensions, enum SearchType searchType, bool exactSearch);
@@ -84,6 +84,7 @@ bool startFromTop = false;
 bool exactSearch = false;
 AppSettings settings;
 int fuzzySearchThreshold = 2;
+bool searchPending = false; // Searching waits until typing pauses
 int lastNotifiedId = -1;
 bool songWasRemoved = false;
 bool noPlaylist = false;
@@ -171,14 +172,14 @@ struct Event processInput()
                 {
                         removeFromSearchText();
                         chosenSearchResultRow = 0;
-                        fuzzySearch(getLibrary(), fuzzySearchThreshold);
+                        searchPending = true;
                         event.type = EVENT_SEARCH;
                 }
                 else if (((strlen(event.key) == 1 && event.key[0] != '\033' && event.key[0] != '\n' && event.key[0] != '\t' && event.key[0] != '\r') || strcmp(event.key, " ") == 0 || (unsigned char)event.key[0] >= 0xC0))
                 {
                         addToSearchText(event.key);
                         chosenSearchResultRow = 0;
-                        fuzzySearch(getLibrary(), fuzzySearchThreshold);
+                        searchPending = true;
                         event.type = EVENT_SEARCH;
                 }
         }
@@ -479,6 +480,39 @@ void resetListAfterDequeuingPlayingSong()
         }
 }
 
+// Called with switchMutex held, which is let go before the playing song may be reset, since the decode thread
+// takes it while holding dataSourceMutex
+void enqueueSearchResult(FileSystemEntry *entry)
+{
+        pthread_mutex_lock(&(playlist.mutex));
+
+        setChosenDir(entry);
+
+        enqueueSongs(entry);
+
+        pthread_mutex_unlock(&switchMutex);
+
+        resetListAfterDequeuingPlayingSong();
+
+        pthread_mutex_unlock(&(playlist.mutex));
+}
+
+// Enter pressed while the search of the text as typed was running acts once its results are in
+void handlePendingSearchResult()
+{
+        if (!hasPendingSearchResult())
+                return;
+
+        pthread_mutex_lock(&switchMutex);
+
+        FileSystemEntry *entry = takePendingSearchResult();
+
+        if (entry != NULL && appState.currentView == SEARCH_VIEW)
+                enqueueSearchResult(entry);
+        else
+                pthread_mutex_unlock(&switchMutex);
+}
+
 void handleGoToSong()
 {
         if (goingToSong)
@@ -505,23 +539,30 @@ void handleGoToSong()
                         }
                 }
 
+                // The library watcher changes the tree under switchMutex. It is let go before the device may be
+                // stopped, since the decode thread takes it while holding dataSourceMutex.
+                pthread_mutex_lock(&switchMutex);
                 pthread_mutex_lock(&(playlist.mutex));
 
                 enqueueSongs(getCurrentLibEntry());
+
+                pthread_mutex_unlock(&switchMutex);
+
                 resetListAfterDequeuingPlayingSong();
 
                 pthread_mutex_unlock(&(playlist.mutex));
         }
         else if (appState.currentView == SEARCH_VIEW)
         {
-                pthread_mutex_lock(&(playlist.mutex));
+                pthread_mutex_lock(&switchMutex);
 
-                setChosenDir(getCurrentSearchEntry());
+                // The row drawn last may belong to an earlier search, so the entry is taken from the results
+                FileSystemEntry *entry = chooseSearchResult(chosenSearchResultRow);
 
-                enqueueSongs(getCurrentSearchEntry());
-                resetListAfterDequeuingPlayingSong();
-
-                pthread_mutex_unlock(&(playlist.mutex));
+                if (entry != NULL)
+                        enqueueSearchResult(entry);
+                else
+                        pthread_mutex_unlock(&switchMutex);
         }
         else
         {
@@ -604,6 +645,17 @@ void handleInput()
 {
         struct Event event = processInput();
 
+        // Search on the first tick without a new letter, so fast typing doesn't search for every one
+        if (searchPending && event.type != EVENT_SEARCH)
+        {
+                searchPending = false;
+                fuzzySearch(fuzzySearchThreshold);
+
+                // A key that acts on the results gets the top one of the text as typed
+                if (event.type == EVENT_GOTOSONG)
+                        chosenSearchResultRow = 0;
+        }
+
         switch (event.type)
         {
         case EVENT_GOTOBEGINNINGOFPLAYLIST:
@@ -911,6 +963,8 @@ gboolean mainloop_callback(gpointer data)
 
         handleInput();
 
+        handlePendingSearchResult();
+
         updateCounter++;
 
         // Update every other time or if searching (search needs to update often to detect keypresses)
@@ -1027,11 +1081,9 @@ void initFirstPlay(Node *song)
 
 void cleanupOnExit()
 {
+        stopDecodeThread();
         pthread_mutex_lock(&dataSourceMutex);
         resetDecoders();
-        resetVorbisDecoders();
-        resetOpusDecoders();
-        resetM4aDecoders();
         if (isContextInitialized)
         {
                 cleanupPlaybackDevice();
@@ -1057,13 +1109,20 @@ void cleanupOnExit()
                 unloadSongData(&loadingdata.songdataB);
         }
 
+        stopSearchThread();
         freeSearchResults();
+        freeSearchIndex();
         cleanupMpris();
         restoreTerminalMode();
         enableInputBuffering();
         setConfig(&settings);
         saveSpecialPlaylist(settings.path);
-        freeAudioBuffer();
+        freeVisuals();
+        freeCoverRenders();
+        stopLibraryWatcher();
+        stopMetadataScan();
+        saveMetadataStore();
+        freeMetadataStore();
         deleteCache(tempCache);
         deleteTempDir();
         freeMainDirectoryTree();
@@ -1142,14 +1201,16 @@ void init()
         audioData.restart = true;
         userData.songdataADeleted = true;
         userData.songdataBDeleted = true;
-        initAudioBuffer();
         initVisuals();
         pthread_mutex_init(&dataSourceMutex, NULL);
         pthread_mutex_init(&switchMutex, NULL);
         pthread_mutex_init(&(loadingdata.mutex), NULL);
         pthread_mutex_init(&(playlist.mutex), NULL);
+        startDecodeThread();
         nerdFontsEnabled = true;
+        initMetadataStore();
         createLibrary(&settings);
+        startMetadataScan(library);
         setlocale(LC_ALL, "");
         fflush(stdout);
 #ifdef USE_LIBNOTIFY
@@ -1405,6 +1466,7 @@ void setMusicPath()
                         found = 1;
                         printf("Do you want to use %s as your music library folder?\n", path);
                         printf("y = Yes\nn = Enter a path\n");
+                        fflush(stdout);
 
                         result = scanf(" %c", &choice);
 
@@ -1429,6 +1491,7 @@ void setMusicPath()
         if (!found || (found && (choice == 'n' || choice == 'N')))
         {
                 printf("Please enter the path to your music library (/path/to/Music):\n");
+                fflush(stdout);
                 result = scanf("%s", path);
 
                 if (directoryExists(path))
@@ -1448,6 +1511,8 @@ void setMusicPath()
 
 int main(int argc, char *argv[])
 {
+        initFrameBuffer();
+
         exitIfAlreadyRunning();
 
         if ((argc == 2 && ((strcmp(argv[1], "--help") == 0) || (strcmp(argv[1], "-h") == 0) || (strcmp(argv[1], "-?") == 0))))
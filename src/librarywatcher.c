@@ -0,0 +1,526 @@
+#include "librarywatcher.h"
+
+/*
+
+librarywatcher.c
+
+ Applies changes in the music folder to the library while kew is running, with inotify
+ where it works and by comparing directory mtimes where it doesn't, like on network mounts.
+
+*/
+
+#define LIBRARY_WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_CLOSE_WRITE | IN_ONLYDIR)
+#define LIBRARY_WATCH_DELAY_MS 1000 // Changes come in bursts, like when an album is copied
+#define LIBRARY_WATCH_MAX_DELAY_SECONDS 5
+#define LIBRARY_POLL_INTERVAL_SECONDS 60
+#define LIBRARY_WATCH_WAKEUP_MS 500
+
+char *watchedLibraryPath = NULL;
+int inotifyFd = -1;
+GHashTable *watchedDirectories = NULL; // Watch descriptor -> directory path
+GHashTable *knownDirectories = NULL;   // Paths of all directories on disk, also those left out of the tree
+GHashTable *dirtyDirectories = NULL;   // Paths of directories to sync
+bool pollLibrary = false;
+regex_t audioExtensionRegex;
+time_t modifiedSinceLastRun = 0;
+time_t lastAppliedTime = 0; // When the last sync that ran to the end started, no event before it is pending
+
+pthread_t libraryWatcherThread;
+bool libraryWatcherRunning = false;
+_Atomic bool stopLibraryWatcherRequested = false;
+
+bool isNetworkFileSystem(const char *path)
+{
+        struct statfs fsStats;
+
+        if (statfs(path, &fsStats) != 0)
+                return false;
+
+        switch ((unsigned long)fsStats.f_type)
+        {
+        case 0x6969:     // NFS
+        case 0x517B:     // SMB
+        case 0xFF534D42: // CIFS
+        case 0xFE534D42: // SMB2
+        case 0x65735546: // FUSE, like sshfs
+                return true;
+        default:
+                return false;
+        }
+}
+
+// Folders without audio aren't in the tree, but are watched all the same so audio copied into them shows up
+void addWatch(const char *path)
+{
+        g_hash_table_add(knownDirectories, strdup(path));
+
+        if (inotifyFd < 0)
+                return;
+
+        int wd = inotify_add_watch(inotifyFd, path, LIBRARY_WATCH_EVENTS);
+
+        if (wd < 0)
+        {
+                // Out of watches, the rest of the library gets polled
+                if (errno == ENOSPC || errno == ENOMEM)
+                        pollLibrary = true;
+
+                return;
+        }
+
+        g_hash_table_replace(watchedDirectories, GINT_TO_POINTER(wd), strdup(path));
+}
+
+void watchDirectoryRecursive(const char *path)
+{
+        addWatch(path);
+
+        DIR *dir = opendir(path);
+
+        if (dir == NULL)
+                return;
+
+        struct dirent *entry;
+
+        while ((entry = readdir(dir)) != NULL && !atomic_load(&stopLibraryWatcherRequested))
+        {
+                if (entry->d_name[0] == '.' || getEntryType(dirfd(dir), entry) != 1)
+                        continue;
+
+                char childPath[MAXPATHLEN];
+                snprintf(childPath, sizeof(childPath), "%s/%s", path, entry->d_name);
+
+                watchDirectoryRecursive(childPath);
+        }
+
+        closedir(dir);
+}
+
+// For a directory moved out of the library, or elsewhere in it where it gets watched again under its new path
+void unwatchDirectoryRecursive(const char *path)
+{
+        size_t length = strlen(path);
+        GHashTableIter iter;
+        gpointer key, value;
+
+        g_hash_table_iter_init(&iter, watchedDirectories);
+
+        while (g_hash_table_iter_next(&iter, &key, &value))
+        {
+                const char *watchedPath = (const char *)value;
+
+                if (strncmp(watchedPath, path, length) == 0 && (watchedPath[length] == '\0' || watchedPath[length] == '/'))
+                {
+                        inotify_rm_watch(inotifyFd, GPOINTER_TO_INT(key));
+                        g_hash_table_iter_remove(&iter);
+                }
+        }
+
+        g_hash_table_iter_init(&iter, knownDirectories);
+
+        while (g_hash_table_iter_next(&iter, &key, NULL))
+        {
+                const char *knownPath = (const char *)key;
+
+                if (strncmp(knownPath, path, length) == 0 && (knownPath[length] == '\0' || knownPath[length] == '/'))
+                        g_hash_table_iter_remove(&iter);
+        }
+}
+
+// Picks up directories created where no event or poll would have noticed them, like inside a new folder
+void watchNewSubdirectories(const char *path)
+{
+        DIR *dir = opendir(path);
+
+        if (dir == NULL)
+                return;
+
+        struct dirent *entry;
+
+        while ((entry = readdir(dir)) != NULL)
+        {
+                if (entry->d_name[0] == '.' || getEntryType(dirfd(dir), entry) != 1)
+                        continue;
+
+                char childPath[MAXPATHLEN];
+                snprintf(childPath, sizeof(childPath), "%s/%s", path, entry->d_name);
+
+                if (!g_hash_table_contains(knownDirectories, childPath))
+                        watchDirectoryRecursive(childPath);
+        }
+
+        closedir(dir);
+}
+
+void markDirty(const char *path)
+{
+        g_hash_table_add(dirtyDirectories, strdup(path));
+}
+
+void markModifiedDirectories(time_t since)
+{
+        GPtrArray *removed = g_ptr_array_new_with_free_func(free);
+        GHashTableIter iter;
+        gpointer key;
+        g_hash_table_iter_init(&iter, knownDirectories);
+
+        while (g_hash_table_iter_next(&iter, &key, NULL) && !atomic_load(&stopLibraryWatcherRequested))
+        {
+                const char *path = (const char *)key;
+                struct stat dirStats;
+
+                if (stat(path, &dirStats) != 0)
+                {
+                        markDirty(path);
+                        g_ptr_array_add(removed, strdup(path));
+                }
+                else if (dirStats.st_mtime >= since)
+                {
+                        markDirty(path);
+                }
+        }
+
+        for (guint i = 0; i < removed->len; i++)
+                g_hash_table_remove(knownDirectories, g_ptr_array_index(removed, i));
+
+        g_ptr_array_free(removed, TRUE);
+}
+
+int getEntryDepth(FileSystemEntry *entry)
+{
+        int depth = 0;
+
+        for (; entry != NULL && entry->parent != NULL; entry = entry->parent)
+                depth++;
+
+        return depth;
+}
+
+// Looks the directory up again after switchMutex was let go, NULL if the tree no longer has it
+FileSystemEntry *findSyncDirectory(const char *syncPath, int depth)
+{
+        FileSystemEntry *entry = findEntryByPath(library, watchedLibraryPath, syncPath);
+
+        return (entry != NULL && getEntryDepth(entry) == depth) ? entry : NULL;
+}
+
+// The disk is read without holding switchMutex, so the UI keeps drawing. Only changing the tree happens under it.
+int syncDirtyDirectory(const char *dirtyPath)
+{
+        char syncPath[MAXPATHLEN];
+        int depth = 0;
+
+        pthread_mutex_lock(&switchMutex);
+
+        // A directory that isn't in the tree yet gets added by syncing its nearest ancestor that is
+        FileSystemEntry *directory = findEntryByPath(library, watchedLibraryPath, dirtyPath);
+
+        if (directory != NULL)
+        {
+                depth = getEntryDepth(directory);
+
+                // The same number of components of the dirty path
+                const char *rest = dirtyPath + strlen(watchedLibraryPath);
+
+                for (int i = 0; i < depth; i++)
+                {
+                        while (*rest == '/')
+                                rest++;
+
+                        rest += strcspn(rest, "/");
+                }
+
+                snprintf(syncPath, sizeof(syncPath), "%.*s", (int)(rest - dirtyPath), dirtyPath);
+        }
+
+        pthread_mutex_unlock(&switchMutex);
+
+        if (directory == NULL)
+                return 0;
+
+        // Gone, replaced by a file or unreadable, either way its entries are out of reach until it can be read again
+        GHashTable *onDisk = listDirectoryEntries(syncPath);
+
+        // The music folder itself stays watched, it may only be unmounted for a while
+        if (onDisk == NULL && depth > 0)
+                unwatchDirectoryRecursive(syncPath);
+
+        pthread_mutex_lock(&switchMutex);
+
+        directory = findSyncDirectory(syncPath, depth);
+        int numChanges = removeMissingEntries(library, directory, onDisk, &numDirectoryTreeEntries);
+
+        pthread_mutex_unlock(&switchMutex);
+
+        if (onDisk == NULL)
+                return numChanges;
+
+        EntryArena *arena = NULL;
+        FileSystemEntry *entries = NULL;
+
+        if (g_hash_table_size(onDisk) > 0)
+                entries = scanNewEntries(syncPath, onDisk, &arena);
+
+        g_hash_table_destroy(onDisk);
+
+        // Only the new tracks get probed, not the whole library
+        queueMetadataScan(entries);
+
+        pthread_mutex_lock(&switchMutex);
+
+        directory = findSyncDirectory(syncPath, depth);
+        numChanges += addScannedEntries(library, directory, entries, arena, &numDirectoryTreeEntries);
+
+        pthread_mutex_unlock(&switchMutex);
+
+        return numChanges;
+}
+
+void applyDirtyDirectories()
+{
+        time_t startTime = time(NULL);
+
+        if (g_hash_table_size(dirtyDirectories) == 0)
+        {
+                lastAppliedTime = startTime;
+                return;
+        }
+
+        int numChanges = 0;
+
+        GHashTableIter iter;
+        gpointer key;
+        g_hash_table_iter_init(&iter, dirtyDirectories);
+
+        while (g_hash_table_iter_next(&iter, &key, NULL) && !atomic_load(&stopLibraryWatcherRequested))
+        {
+                watchNewSubdirectories((const char *)key);
+                numChanges += syncDirtyDirectory((const char *)key);
+        }
+
+        if (!atomic_load(&stopLibraryWatcherRequested))
+                lastAppliedTime = startTime;
+
+        g_hash_table_remove_all(dirtyDirectories);
+
+        if (numChanges > 0)
+                refresh = true;
+}
+
+void readWatchEvents()
+{
+        char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t length;
+
+        while ((length = read(inotifyFd, buffer, sizeof(buffer))) > 0)
+        {
+                for (char *ptr = buffer; ptr < buffer + length;)
+                {
+                        const struct inotify_event *event = (const struct inotify_event *)ptr;
+                        ptr += sizeof(struct inotify_event) + event->len;
+
+                        if (event->mask & IN_Q_OVERFLOW)
+                        {
+                                // Events were lost, fall back to the mtimes. A long sync may have kept them queued for a while.
+                                markModifiedDirectories(lastAppliedTime);
+                                continue;
+                        }
+
+                        if (event->mask & IN_IGNORED)
+                        {
+                                const char *path = g_hash_table_lookup(watchedDirectories, GINT_TO_POINTER(event->wd));
+
+                                // The directory is gone, or no longer in the library
+                                if (path != NULL)
+                                        g_hash_table_remove(knownDirectories, path);
+
+                                g_hash_table_remove(watchedDirectories, GINT_TO_POINTER(event->wd));
+                                continue;
+                        }
+
+                        const char *dirPath = g_hash_table_lookup(watchedDirectories, GINT_TO_POINTER(event->wd));
+
+                        if (dirPath == NULL)
+                                continue;
+
+                        char childPath[MAXPATHLEN];
+                        snprintf(childPath, sizeof(childPath), "%s/%s", dirPath, event->len > 0 ? event->name : "");
+
+                        if (event->mask & IN_CLOSE_WRITE)
+                        {
+                                // The file was added on IN_CREATE and may have been probed half-written
+                                char exto[6] = "";
+
+                                if (event->len > 0)
+                                        extractExtension(event->name, sizeof(exto) - 1, exto);
+
+                                if (exto[0] != '\0' && match_regex(&audioExtensionRegex, exto) == 0)
+                                        queueMetadataProbe(childPath);
+
+                                continue;
+                        }
+
+                        if (event->len > 0 && (event->mask & IN_ISDIR))
+                        {
+                                if (event->mask & IN_MOVED_FROM)
+                                        unwatchDirectoryRecursive(childPath);
+                                else if (event->mask & (IN_CREATE | IN_MOVED_TO))
+                                        watchDirectoryRecursive(childPath);
+                        }
+
+                        markDirty(dirPath);
+                }
+        }
+}
+
+void *libraryWatcherThreadFunc(void *arg)
+{
+        (void)arg;
+
+        regcomp(&audioExtensionRegex, AUDIO_EXTENSIONS, REG_EXTENDED);
+
+        lastAppliedTime = time(NULL);
+
+        // Walks the disk rather than the tree, which leaves out folders without audio
+        watchDirectoryRecursive(watchedLibraryPath);
+
+        // Catch up with what changed while kew wasn't running
+        if (modifiedSinceLastRun > 0)
+        {
+                markModifiedDirectories(modifiedSinceLastRun);
+                applyDirtyDirectories();
+        }
+
+        time_t lastPoll = time(NULL);
+        time_t dirtySince = 0;
+
+        while (!atomic_load(&stopLibraryWatcherRequested))
+        {
+                bool gotEvents = false;
+
+                if (inotifyFd >= 0)
+                {
+                        struct pollfd pfd = {inotifyFd, POLLIN, 0};
+                        int timeout = (g_hash_table_size(dirtyDirectories) > 0) ? LIBRARY_WATCH_DELAY_MS : LIBRARY_WATCH_WAKEUP_MS;
+
+                        if (poll(&pfd, 1, timeout) > 0 && (pfd.revents & POLLIN))
+                        {
+                                readWatchEvents();
+                                gotEvents = true;
+                        }
+                }
+                else
+                {
+                        c_sleep(LIBRARY_WATCH_WAKEUP_MS);
+                }
+
+                time_t now = time(NULL);
+
+                if (pollLibrary && now - lastPoll >= LIBRARY_POLL_INTERVAL_SECONDS)
+                {
+                        markModifiedDirectories(lastPoll);
+                        lastPoll = now;
+                }
+
+                if (g_hash_table_size(dirtyDirectories) == 0)
+                {
+                        dirtySince = 0;
+                        continue;
+                }
+
+                if (dirtySince == 0)
+                        dirtySince = now;
+
+                // Wait for things to settle, but not forever
+                if (!gotEvents || now - dirtySince >= LIBRARY_WATCH_MAX_DELAY_SECONDS)
+                {
+                        applyDirtyDirectories();
+                        dirtySince = 0;
+                }
+        }
+
+        regfree(&audioExtensionRegex);
+
+        return NULL;
+}
+
+void freeLibraryWatcher()
+{
+        if (inotifyFd >= 0)
+        {
+                close(inotifyFd);
+                inotifyFd = -1;
+        }
+
+        if (watchedDirectories != NULL)
+        {
+                g_hash_table_destroy(watchedDirectories);
+                watchedDirectories = NULL;
+        }
+
+        if (knownDirectories != NULL)
+        {
+                g_hash_table_destroy(knownDirectories);
+                knownDirectories = NULL;
+        }
+
+        if (dirtyDirectories != NULL)
+        {
+                g_hash_table_destroy(dirtyDirectories);
+                dirtyDirectories = NULL;
+        }
+
+        free(watchedLibraryPath);
+        watchedLibraryPath = NULL;
+}
+
+void startLibraryWatcher(const char *path, time_t modifiedSince)
+{
+        stopLibraryWatcher();
+
+        if (path == NULL)
+                return;
+
+        watchedLibraryPath = strdup(path);
+
+        if (watchedLibraryPath == NULL)
+                return;
+
+        // Paths are matched against the tree by component
+        size_t length = strlen(watchedLibraryPath);
+
+        while (length > 0 && watchedLibraryPath[length - 1] == '/')
+                watchedLibraryPath[--length] = '\0';
+
+        watchedDirectories = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, free);
+        knownDirectories = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+        dirtyDirectories = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+
+        inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+        // Changes made on another machine don't show up in inotify
+        pollLibrary = (inotifyFd < 0 || isNetworkFileSystem(path));
+        modifiedSinceLastRun = modifiedSince;
+
+        atomic_store(&stopLibraryWatcherRequested, false);
+
+        if (pthread_create(&libraryWatcherThread, NULL, libraryWatcherThreadFunc, NULL) != 0)
+        {
+                freeLibraryWatcher();
+                return;
+        }
+
+        libraryWatcherRunning = true;
+}
+
+void stopLibraryWatcher()
+{
+        if (!libraryWatcherRunning)
+                return;
+
+        atomic_store(&stopLibraryWatcherRequested, true);
+        pthread_join(libraryWatcherThread, NULL);
+        libraryWatcherRunning = false;
+
+        freeLibraryWatcher();
+}
@@ -0,0 +1,28 @@
+#ifndef LIBRARYWATCHER_H
+#define LIBRARYWATCHER_H
+
+#include <glib.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <time.h>
+#include <unistd.h>
+#include "directorytree.h"
+#include "file.h"
+#include "metadatastore.h"
+#include "player.h"
+#include "soundcommon.h"
+#include "utils.h"
+
+void startLibraryWatcher(const char *path, time_t modifiedSince);
+
+void stopLibraryWatcher(void);
+
+#endif
@@ -26,6 +26,8 @@ extern "C"
 #include <stdint.h>
 #include <string.h>
 
+#define M4A_MAX_CHANNELS 8
+
         typedef struct
         {
                 ma_data_source_base ds; /* The m4a decoder can be used independently as a data source. */
@@ -39,6 +41,14 @@ extern "C"
                 AVCodecContext *codec_context;
                 SwrContext *swr_ctx;
                 AVFormatContext *format_context;
+                AVFrame *frame; // Last decoded frame, kept between reads
+                AVPacket *packet;
+                int streamIndex;
+                int frameOffset; // Frames of the last decoded frame already returned
+                ma_bool32 draining;
+                ma_uint32 channels;       // Channels in the file
+                ma_uint32 outputChannels; // Channels returned, anything above stereo is downmixed
+                float downmix[M4A_MAX_CHANNELS][2];
                 ma_uint64 cursor;
                 ma_uint32 sampleSize;
                 int bitDepth;
@@ -59,12 +69,7 @@ extern "C"
 
 #if defined(MINIAUDIO_IMPLEMENTATION) || defined(MA_IMPLEMENTATION)
 
-#define MAX_CHANNELS 2
-#define MAX_SAMPLES 4800 // Maximum expected frame size
-#define MAX_SAMPLE_SIZE 4
-static uint8_t leftoverBuffer[MAX_SAMPLES * MAX_CHANNELS * MAX_SAMPLE_SIZE];
-
-static ma_uint64 leftoverSampleCount = 0;
+static void m4a_init_downmix(m4a_decoder *pM4a);
 
 extern ma_result m4a_decoder_ds_get_data_format(ma_data_source *pDataSource, ma_format *pFormat, ma_uint32 *pChannels, ma_uint32 *pSampleRate, ma_channel *pChannelMap, size_t channelMapCap);
 
@@ -228,6 +233,9 @@ ma_format ffmpeg_to_mini_al_format(enum AVSampleFormat ffmpeg_sample_fmt)
         case AV_SAMPLE_FMT_S16:
         case AV_SAMPLE_FMT_S16P:
                 return ma_format_s16;
+        case AV_SAMPLE_FMT_S32:
+        case AV_SAMPLE_FMT_S32P:
+                return ma_format_s32;
         default:
                 return ma_format_unknown;
         }
@@ -373,14 +381,50 @@ MA_API ma_result m4a_decoder_init_file(const char *pFilePath, const ma_decoding_
         case AV_SAMPLE_FMT_FLT:
                 pM4a->sampleSize = sizeof(float); // 32-bit float samples
                 break;
+        case AV_SAMPLE_FMT_S32:
+        case AV_SAMPLE_FMT_S32P:
+                pM4a->sampleSize = sizeof(int32_t); // 32-bit samples, ALAC above 16 bits
+                break;
         default:
                 pM4a->sampleSize = 0;
                 break;
         }
 
+        pM4a->frame = av_frame_alloc();
+        pM4a->packet = av_packet_alloc();
+
+        if (pM4a->frame == NULL || pM4a->packet == NULL)
+        {
+                av_frame_free(&pM4a->frame);
+                av_packet_free(&pM4a->packet);
+                avcodec_free_context(&pM4a->codec_context);
+                avformat_close_input(&format_context);
+                return MA_OUT_OF_MEMORY;
+        }
+
+#if (LIBAVCODEC_VERSION_MAJOR > 59) || ((LIBAVCODEC_VERSION_MAJOR == 59) && (LIBAVCODEC_VERSION_MINOR > 24))
+        pM4a->channels = codec_context->ch_layout.nb_channels;
+#else
+        pM4a->channels = codec_context->channels;
+#endif
+
+        if (pM4a->channels == 0 || pM4a->channels > M4A_MAX_CHANNELS)
+        {
+                av_frame_free(&pM4a->frame);
+                av_packet_free(&pM4a->packet);
+                avcodec_free_context(&pM4a->codec_context);
+                avformat_close_input(&format_context);
+                return MA_INVALID_DATA;
+        }
+
+        pM4a->streamIndex = stream_index;
         pM4a->format_context = format_context;
         pM4a->mf = NULL;
         pM4a->format = ffmpeg_to_mini_al_format(pM4a->codec_context->sample_fmt);
+        pM4a->outputChannels = (pM4a->channels > 2) ? 2 : pM4a->channels;
+
+        if (pM4a->channels > pM4a->outputChannels)
+                m4a_init_downmix(pM4a);
 
         return MA_SUCCESS;
 }
@@ -399,6 +443,9 @@ MA_API void m4a_decoder_uninit(m4a_decoder *pM4a, const ma_allocation_callbacks
                 swr_free(&pM4a->swr_ctx);
         }
 
+        av_frame_free(&pM4a->frame);
+        av_packet_free(&pM4a->packet);
+
         if (pM4a->codec_context != NULL)
         {
                 avcodec_free_context(&pM4a->codec_context);
@@ -418,145 +465,329 @@ MA_API void m4a_decoder_uninit(m4a_decoder *pM4a, const ma_allocation_callbacks
         ma_data_source_uninit(&pM4a->ds);
 }
 
-ma_result m4a_decoder_read_pcm_frames(m4a_decoder *pM4a, void *pFramesOut, ma_uint64 frameCount, ma_uint64 *pFramesRead)
+#if defined(__GNUC__)
+typedef uint32_t m4a_u32x4 __attribute__((vector_size(16)));
+typedef uint16_t m4a_u16x8 __attribute__((vector_size(16)));
+
+#if defined(__clang__)
+#define M4A_ZIP_LO_32(a, b) __builtin_shufflevector(a, b, 0, 4, 1, 5)
+#define M4A_ZIP_HI_32(a, b) __builtin_shufflevector(a, b, 2, 6, 3, 7)
+#define M4A_ZIP_LO_16(a, b) __builtin_shufflevector(a, b, 0, 8, 1, 9, 2, 10, 3, 11)
+#define M4A_ZIP_HI_16(a, b) __builtin_shufflevector(a, b, 4, 12, 5, 13, 6, 14, 7, 15)
+#else
+#define M4A_ZIP_LO_32(a, b) __builtin_shuffle(a, b, (m4a_u32x4){0, 4, 1, 5})
+#define M4A_ZIP_HI_32(a, b) __builtin_shuffle(a, b, (m4a_u32x4){2, 6, 3, 7})
+#define M4A_ZIP_LO_16(a, b) __builtin_shuffle(a, b, (m4a_u16x8){0, 8, 1, 9, 2, 10, 3, 11})
+#define M4A_ZIP_HI_16(a, b) __builtin_shuffle(a, b, (m4a_u16x8){4, 12, 5, 13, 6, 14, 7, 15})
+#endif
+#endif
+
+// Interleaves two planes of 32-bit samples. The vector path compiles to unpck on SSE2 and zip on NEON.
+static void m4a_interleave_stereo_32(uint32_t *out, const uint32_t *left, const uint32_t *right, int frameCount)
 {
-        if (pM4a == NULL || pM4a->onRead == NULL || pM4a->onSeek == NULL || pM4a->sampleSize == 0 || pFramesOut == NULL || frameCount == 0)
+        int i = 0;
+
+#if defined(__GNUC__)
+        for (; i + 4 <= frameCount; i += 4)
         {
-                return MA_INVALID_ARGS;
+                m4a_u32x4 l, r, lo, hi;
+                memcpy(&l, left + i, sizeof(l));
+                memcpy(&r, right + i, sizeof(r));
+                lo = M4A_ZIP_LO_32(l, r);
+                hi = M4A_ZIP_HI_32(l, r);
+                memcpy(out + i * 2, &lo, sizeof(lo));
+                memcpy(out + i * 2 + 4, &hi, sizeof(hi));
         }
+#endif
 
-        ma_result result = MA_SUCCESS;
-        ma_format format;
-        ma_uint32 channels;
-        ma_uint32 sampleRate;
+        for (; i < frameCount; i++)
+        {
+                out[i * 2] = left[i];
+                out[i * 2 + 1] = right[i];
+        }
+}
 
-        m4a_decoder_get_data_format(pM4a, &format, &channels, &sampleRate, NULL, 0);
+static void m4a_interleave_stereo_16(uint16_t *out, const uint16_t *left, const uint16_t *right, int frameCount)
+{
+        int i = 0;
 
-        // only two channels supported for now
-        if (channels > 2)
+#if defined(__GNUC__)
+        for (; i + 8 <= frameCount; i += 8)
         {
-                return MA_ERROR;
+                m4a_u16x8 l, r, lo, hi;
+                memcpy(&l, left + i, sizeof(l));
+                memcpy(&r, right + i, sizeof(r));
+                lo = M4A_ZIP_LO_16(l, r);
+                hi = M4A_ZIP_HI_16(l, r);
+                memcpy(out + i * 2, &lo, sizeof(lo));
+                memcpy(out + i * 2 + 8, &hi, sizeof(hi));
         }
+#endif
 
-        int stream_index = av_find_best_stream(pM4a->format_context, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
-        if (stream_index < 0)
+        for (; i < frameCount; i++)
         {
-                return MA_ERROR;
+                out[i * 2] = left[i];
+                out[i * 2 + 1] = right[i];
         }
+}
 
-        AVFrame *frame = av_frame_alloc();
-        if (!frame)
+// Returns the mask (AV_CH_*) of the channel at the given index, or 0 if the layout doesn't say
+static uint64_t m4a_channel_mask(m4a_decoder *pM4a, int index)
+{
+#if (LIBAVCODEC_VERSION_MAJOR > 59) || ((LIBAVCODEC_VERSION_MAJOR == 59) && (LIBAVCODEC_VERSION_MINOR > 24))
+        enum AVChannel channel = av_channel_layout_channel_from_index(&pM4a->codec_context->ch_layout, index);
+
+        if (channel < 0 || channel >= 64)
+                return 0;
+
+        return 1ULL << channel;
+#else
+        if (pM4a->codec_context->channel_layout == 0)
+                return 0;
+
+        return av_channel_layout_extract_channel(pM4a->codec_context->channel_layout, index);
+#endif
+}
+
+// Sets up the coefficients for folding the source channels down to stereo
+static void m4a_init_downmix(m4a_decoder *pM4a)
+{
+        const float center = 0.7071f;
+        float leftSum = 0.0f;
+        float rightSum = 0.0f;
+
+        for (ma_uint32 c = 0; c < pM4a->channels; c++)
+        {
+                uint64_t mask = m4a_channel_mask(pM4a, c);
+                float left = 0.0f;
+                float right = 0.0f;
+
+                if (mask & (AV_CH_FRONT_LEFT | AV_CH_FRONT_LEFT_OF_CENTER | AV_CH_TOP_FRONT_LEFT))
+                        left = 1.0f;
+                else if (mask & (AV_CH_FRONT_RIGHT | AV_CH_FRONT_RIGHT_OF_CENTER | AV_CH_TOP_FRONT_RIGHT))
+                        right = 1.0f;
+                else if (mask & (AV_CH_FRONT_CENTER | AV_CH_TOP_CENTER | AV_CH_TOP_FRONT_CENTER))
+                        left = right = center;
+                else if (mask & (AV_CH_BACK_LEFT | AV_CH_SIDE_LEFT | AV_CH_TOP_BACK_LEFT))
+                        left = center;
+                else if (mask & (AV_CH_BACK_RIGHT | AV_CH_SIDE_RIGHT | AV_CH_TOP_BACK_RIGHT))
+                        right = center;
+                else if (mask & (AV_CH_BACK_CENTER | AV_CH_TOP_BACK_CENTER))
+                        left = right = 0.5f;
+                else if (mask & AV_CH_LOW_FREQUENCY)
+                        left = right = 0.0f;
+                else if (c == 0)
+                        left = 1.0f; // Unknown layout, assume the first two are left and right
+                else if (c == 1)
+                        right = 1.0f;
+                else
+                        left = right = 0.5f;
+
+                pM4a->downmix[c][0] = left;
+                pM4a->downmix[c][1] = right;
+                leftSum += left;
+                rightSum += right;
+        }
+
+        // Normalize so that the folded signal can't clip
+        for (ma_uint32 c = 0; c < pM4a->channels; c++)
         {
-                return MA_ERROR;
+                if (leftSum > 1.0f)
+                        pM4a->downmix[c][0] /= leftSum;
+                if (rightSum > 1.0f)
+                        pM4a->downmix[c][1] /= rightSum;
         }
+}
 
-        AVPacket packet;
-        ma_uint64 totalFramesProcessed = 0;
+static float m4a_sample_to_float(const uint8_t *pSample, ma_format format)
+{
+        switch (format)
+        {
+        case ma_format_s16:
+                return *(const int16_t *)pSample / 32768.0f;
+        case ma_format_s32:
+                return *(const int32_t *)pSample / 2147483648.0f;
+        default:
+                return *(const float *)pSample;
+        }
+}
+
+static void m4a_float_to_sample(float value, uint8_t *pSample, ma_format format)
+{
+        if (format == ma_format_f32)
+        {
+                *(float *)pSample = value;
+                return;
+        }
+
+        if (value > 1.0f)
+                value = 1.0f;
+        else if (value < -1.0f)
+                value = -1.0f;
+
+        if (format == ma_format_s16)
+                *(int16_t *)pSample = (int16_t)(value * 32767.0f);
+        else
+                *(int32_t *)pSample = (int32_t)(value * 2147483647.0);
+}
+
+// Folds a multichannel frame down to stereo
+static void m4a_downmix_frame_data(m4a_decoder *pM4a, AVFrame *frame, int frameOffset, int frameCount, void *pFramesOut)
+{
+        ma_uint32 channels = pM4a->channels;
+        ma_uint32 sampleSize = pM4a->sampleSize;
+        ma_bool32 planar = av_sample_fmt_is_planar(pM4a->codec_context->sample_fmt);
+        uint8_t *out = (uint8_t *)pFramesOut;
+
+        for (int i = 0; i < frameCount; i++)
+        {
+                size_t frameIndex = (size_t)(frameOffset + i);
+                float left = 0.0f;
+                float right = 0.0f;
+
+                for (ma_uint32 c = 0; c < channels; c++)
+                {
+                        const uint8_t *pSample = planar ? frame->extended_data[c] + frameIndex * sampleSize
+                                                        : frame->extended_data[0] + (frameIndex * channels + c) * sampleSize;
+                        float value = m4a_sample_to_float(pSample, pM4a->format);
+
+                        left += value * pM4a->downmix[c][0];
+                        right += value * pM4a->downmix[c][1];
+                }
+
+                m4a_float_to_sample(left, out, pM4a->format);
+                m4a_float_to_sample(right, out + sampleSize, pM4a->format);
+                out += 2 * sampleSize;
+        }
+}
+
+// Copies frameCount frames starting at frameOffset out of a decoded frame, interleaving planar data
+static void m4a_copy_frame_data(m4a_decoder *pM4a, AVFrame *frame, int frameOffset, int frameCount, void *pFramesOut)
+{
+        ma_uint32 channels = pM4a->channels;
+        ma_uint32 sampleSize = pM4a->sampleSize;
 
-        if (leftoverSampleCount > 0)
+        if (channels != pM4a->outputChannels)
         {
-                int leftoverToProcess = (leftoverSampleCount < frameCount) ? leftoverSampleCount : frameCount;
+                m4a_downmix_frame_data(pM4a, frame, frameOffset, frameCount, pFramesOut);
+                return;
+        }
 
-                int leftoverBytes = leftoverToProcess * channels * pM4a->sampleSize;
-                memcpy(pFramesOut, leftoverBuffer, leftoverBytes);
-                totalFramesProcessed += leftoverToProcess;
+        if (!av_sample_fmt_is_planar(pM4a->codec_context->sample_fmt))
+        {
+                memcpy(pFramesOut, frame->extended_data[0] + (size_t)frameOffset * channels * sampleSize, (size_t)frameCount * channels * sampleSize);
+                return;
+        }
 
-                int bytesToShift = (leftoverSampleCount - leftoverToProcess) * channels * pM4a->sampleSize;
-                uint8_t *shiftSource = leftoverBuffer + leftoverToProcess * channels * pM4a->sampleSize;
-                memmove(leftoverBuffer, shiftSource, bytesToShift);
-                leftoverSampleCount -= leftoverToProcess;
+        if (channels == 2 && sampleSize == sizeof(uint32_t))
+        {
+                m4a_interleave_stereo_32((uint32_t *)pFramesOut, (const uint32_t *)frame->extended_data[0] + frameOffset,
+                                         (const uint32_t *)frame->extended_data[1] + frameOffset, frameCount);
+                return;
         }
 
+        if (channels == 2 && sampleSize == sizeof(uint16_t))
+        {
+                m4a_interleave_stereo_16((uint16_t *)pFramesOut, (const uint16_t *)frame->extended_data[0] + frameOffset,
+                                         (const uint16_t *)frame->extended_data[1] + frameOffset, frameCount);
+                return;
+        }
+
+        for (ma_uint32 c = 0; c < channels; c++)
+        {
+                const uint8_t *plane = frame->extended_data[c] + (size_t)frameOffset * sampleSize;
+                uint8_t *out = (uint8_t *)pFramesOut + c * sampleSize;
+
+                if (sampleSize == sizeof(uint32_t))
+                {
+                        for (int i = 0; i < frameCount; i++)
+                                ((uint32_t *)out)[(size_t)i * channels] = ((const uint32_t *)plane)[i];
+                }
+                else
+                {
+                        for (int i = 0; i < frameCount; i++)
+                                ((uint16_t *)out)[(size_t)i * channels] = ((const uint16_t *)plane)[i];
+                }
+        }
+}
+
+ma_result m4a_decoder_read_pcm_frames(m4a_decoder *pM4a, void *pFramesOut, ma_uint64 frameCount, ma_uint64 *pFramesRead)
+{
+        if (pFramesRead != NULL)
+        {
+                *pFramesRead = 0;
+        }
+
+        if (pM4a == NULL || pM4a->sampleSize == 0 || pFramesOut == NULL || frameCount == 0)
+        {
+                return MA_INVALID_ARGS;
+        }
+
+        if (pM4a->frame == NULL || pM4a->packet == NULL || pM4a->codec_context == NULL)
+        {
+                return MA_INVALID_OPERATION;
+        }
+
+        if (pM4a->channels == 0 || pM4a->channels > M4A_MAX_CHANNELS)
+        {
+                return MA_ERROR;
+        }
+
+        ma_result result = MA_SUCCESS;
+        ma_uint64 totalFramesProcessed = 0;
+        ma_uint32 bytesPerFrame = pM4a->outputChannels * pM4a->sampleSize;
+
         while (totalFramesProcessed < frameCount)
         {
-                if (av_read_frame(pM4a->format_context, &packet) < 0)
+                // Drain what is left of the last decoded frame first
+                if (pM4a->frameOffset < pM4a->frame->nb_samples)
+                {
+                        int available = pM4a->frame->nb_samples - pM4a->frameOffset;
+                        int framesToCopy = (available < (int)(frameCount - totalFramesProcessed)) ? available : (int)(frameCount - totalFramesProcessed);
+
+                        m4a_copy_frame_data(pM4a, pM4a->frame, pM4a->frameOffset, framesToCopy, (uint8_t *)pFramesOut + totalFramesProcessed * bytesPerFrame);
+
+                        pM4a->frameOffset += framesToCopy;
+                        totalFramesProcessed += framesToCopy;
+                        continue;
+                }
+
+                int ret = avcodec_receive_frame(pM4a->codec_context, pM4a->frame);
+
+                if (ret == 0)
                 {
-                        // Error in reading frame or EOF
+                        pM4a->frameOffset = 0;
+                        continue;
+                }
+
+                if (ret != AVERROR(EAGAIN))
+                {
+                        // End of stream or decoding error
                         result = MA_AT_END;
                         break;
                 }
 
-                if (packet.stream_index == stream_index)
+                if (av_read_frame(pM4a->format_context, pM4a->packet) < 0)
                 {
-                        if (avcodec_send_packet(pM4a->codec_context, &packet) == 0)
+                        if (pM4a->draining)
                         {
-                                while (totalFramesProcessed < frameCount && avcodec_receive_frame(pM4a->codec_context, frame) == 0)
-                                {
-                                        int samplesToProcess = (frame->nb_samples < (int)(frameCount - totalFramesProcessed)) ? frame->nb_samples : (int)(frameCount - totalFramesProcessed);
-                                        int outputBufferLen = samplesToProcess * channels * pM4a->sampleSize;
-
-                                        uint8_t *output_buffer = (uint8_t *)malloc(outputBufferLen);
-                                        if (!output_buffer)
-                                        {
-                                                av_frame_free(&frame);
-                                                return MA_ERROR;
-                                        }
-
-                                        for (int i = 0; i < samplesToProcess; i++)
-                                        {
-                                                for (ma_uint32 c = 0; c < channels; c++)
-                                                {
-                                                        int byteOffset = (i * channels + c) * pM4a->sampleSize;
-
-                                                        if (frame->extended_data == NULL || frame->extended_data[c] == NULL)
-                                                        {
-                                                                continue;
-                                                        }
-
-                                                        if (pM4a->format == ma_format_s16)
-                                                        {
-                                                                if (pM4a->codec_context->sample_fmt != AV_SAMPLE_FMT_S16)
-                                                                {
-                                                                        continue;
-                                                                }
-
-                                                                int16_t sample = ((int16_t *)frame->extended_data[c])[i];
-                                                                memcpy(output_buffer + byteOffset, &sample, sizeof(int16_t));
-                                                        }
-                                                        else
-                                                        {
-                                                                float sample = ((float *)frame->extended_data[c])[i];
-                                                                memcpy(output_buffer + byteOffset, &sample, sizeof(float));
-                                                        }
-                                                }
-                                        }
-
-                                        int current_frame_buffer_size = samplesToProcess * channels * pM4a->sampleSize;
-                                        memcpy((uint8_t *)pFramesOut + totalFramesProcessed * channels * pM4a->sampleSize, output_buffer, current_frame_buffer_size);
-
-                                        totalFramesProcessed += samplesToProcess;
-
-                                        // Check if there are leftovers
-                                        if (samplesToProcess < frame->nb_samples)
-                                        {
-                                                int remainingSamples = frame->nb_samples - samplesToProcess;
-
-                                                for (int i = samplesToProcess; i < frame->nb_samples; i++)
-                                                {
-                                                        for (ma_uint32 c = 0; c < channels; c++)
-                                                        {
-                                                                int byteOffset = ((i - samplesToProcess) * channels + c) * pM4a->sampleSize;
-
-                                                                if (frame->extended_data[c] == NULL)
-                                                                {
-                                                                        return MA_ERROR;
-                                                                }
-
-                                                                memcpy(leftoverBuffer + byteOffset, (uint8_t *)frame->extended_data[c] + i * pM4a->sampleSize, pM4a->sampleSize);
-                                                        }
-                                                }
-                                                leftoverSampleCount = remainingSamples;
-                                        }
-
-                                        free(output_buffer);
-                                }
+                                result = MA_AT_END;
+                                break;
                         }
+
+                        // Flush the decoder so that the last frames come out
+                        avcodec_send_packet(pM4a->codec_context, NULL);
+                        pM4a->draining = MA_TRUE;
+                        continue;
                 }
 
-                av_packet_unref(&packet);
-        }
+                if (pM4a->packet->stream_index == pM4a->streamIndex)
+                {
+                        avcodec_send_packet(pM4a->codec_context, pM4a->packet);
+                }
 
-        av_frame_free(&frame);
+                av_packet_unref(pM4a->packet);
+        }
 
         pM4a->cursor += totalFramesProcessed;
 
@@ -575,21 +806,13 @@ MA_API ma_result m4a_decoder_seek_to_pcm_frame(m4a_decoder *pM4a, ma_uint64 fram
                 return MA_INVALID_ARGS;
         }
 
-        AVStream *stream = NULL;
-        for (unsigned int i = 0; i < pM4a->format_context->nb_streams; i++)
-        {
-                if (pM4a->format_context->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
-                {
-                        stream = pM4a->format_context->streams[i];
-                        break;
-                }
-        }
-
-        if (stream == NULL)
+        if (pM4a->streamIndex < 0 || (unsigned int)pM4a->streamIndex >= pM4a->format_context->nb_streams)
         {
                 return MA_ERROR;
         }
 
+        AVStream *stream = pM4a->format_context->streams[pM4a->streamIndex];
+
         // Convert frame index to the stream's time base.
         int64_t timestamp = av_rescale_q(frameIndex,
                                          (AVRational){1, pM4a->codec_context->sample_rate},
@@ -603,6 +826,15 @@ MA_API ma_result m4a_decoder_seek_to_pcm_frame(m4a_decoder *pM4a, ma_uint64 fram
         // After seeking, we must clear the codec's internal buffer.
         avcodec_flush_buffers(pM4a->codec_context);
 
+        if (pM4a->frame != NULL)
+        {
+                av_frame_unref(pM4a->frame);
+        }
+
+        pM4a->frameOffset = 0;
+        pM4a->draining = MA_FALSE;
+        pM4a->cursor = frameIndex;
+
         return MA_SUCCESS;
 }
 
@@ -643,19 +875,7 @@ MA_API ma_result m4a_decoder_get_data_format(
 
         if (pChannels != NULL)
         {
-
-                for (unsigned int i = 0; i < pM4a->format_context->nb_streams; i++)
-                {
-                        if (pM4a->format_context->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
-                        {
-
-#if (LIBAVCODEC_VERSION_MAJOR > 59) || ((LIBAVCODEC_VERSION_MAJOR == 59) && (LIBAVCODEC_VERSION_MINOR > 24))
-                                *pChannels = pM4a->format_context->streams[i]->codecpar->ch_layout.nb_channels;
-#else
-                                *pChannels = pM4a->format_context->streams[i]->codecpar->channels;
-#endif
-                        }
-                }
+                *pChannels = pM4a->outputChannels;
         }
 
         if (pSampleRate != NULL)
@@ -665,7 +885,7 @@ MA_API ma_result m4a_decoder_get_data_format(
 
         if (pChannelMap != NULL)
         {
-                ma_channel_map_init_standard(ma_standard_channel_map_microsoft, pChannelMap, channelMapCap, *pChannels);
+                ma_channel_map_init_standard(ma_standard_channel_map_microsoft, pChannelMap, channelMapCap, pM4a->outputChannels);
         }
 
         return MA_SUCCESS;
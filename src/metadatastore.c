@@ -0,0 +1,535 @@
+#include "metadatastore.h"
+#include "songloader.h"
+
+/*
+
+metadatastore.c
+
+ Persistent store of track metadata, so that known tracks don't have to be probed again.
+
+*/
+
+#define METADATA_FIELDS 12
+
+const char METADATA_FILE[] = "kewmetadata";
+
+GHashTable *metadataStore = NULL; // File path -> TrackMetadata
+pthread_mutex_t metadataMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t metadataSaveMutex = PTHREAD_MUTEX_INITIALIZER; // Keeps saves in order, taken before metadataMutex
+bool metadataChanged = false;
+_Atomic unsigned int metadataVersion = 0; // Bumped when a scan has found new tags
+
+// The scan thread probes paths from the end of pendingScanPaths until it is empty, then exits
+pthread_mutex_t metadataScanMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t metadataScanExited = PTHREAD_COND_INITIALIZER;
+GPtrArray *pendingScanPaths = NULL;
+bool metadataScanRunning = false;
+bool stopMetadataScanRequested = false;
+
+void freeTrackMetadata(gpointer data)
+{
+        TrackMetadata *track = (TrackMetadata *)data;
+
+        free(track->codec);
+        free(track->title);
+        free(track->artist);
+        free(track->albumArtist);
+        free(track->album);
+        free(track->date);
+        free(track);
+}
+
+char *getMetadataFilePath()
+{
+        char *configdir = getConfigPath();
+
+        if (configdir == NULL)
+                return NULL;
+
+        size_t filepath_length = strlen(configdir) + strlen("/") + strlen(METADATA_FILE) + 1;
+        char *filepath = (char *)malloc(filepath_length);
+
+        if (filepath != NULL)
+                snprintf(filepath, filepath_length, "%s/%s", configdir, METADATA_FILE);
+
+        free(configdir);
+        return filepath;
+}
+
+// Tabs and newlines separate fields and records in the file
+char *dupField(const char *value)
+{
+        char *field = strdup(value != NULL ? value : "");
+
+        if (field == NULL)
+                return NULL;
+
+        for (char *c = field; *c != '\0'; c++)
+        {
+                if (*c == '\t' || *c == '\n' || *c == '\r')
+                        *c = ' ';
+        }
+
+        return field;
+}
+
+void initMetadataStore()
+{
+        if (metadataStore != NULL)
+                return;
+
+        metadataStore = g_hash_table_new_full(g_str_hash, g_str_equal, free, freeTrackMetadata);
+
+        char *filepath = getMetadataFilePath();
+
+        if (filepath == NULL)
+                return;
+
+        FILE *file = fopen(filepath, "r");
+        free(filepath);
+
+        if (file == NULL)
+                return;
+
+        char *line = NULL;
+        size_t capacity = 0;
+        ssize_t length;
+
+        while ((length = getline(&line, &capacity, file)) != -1)
+        {
+                if (length > 0 && line[length - 1] == '\n')
+                        line[length - 1] = '\0';
+
+                gchar **fields = g_strsplit(line, "\t", METADATA_FIELDS);
+
+                if (g_strv_length(fields) == METADATA_FIELDS)
+                {
+                        TrackMetadata *track = malloc(sizeof(TrackMetadata));
+
+                        if (track != NULL)
+                        {
+                                track->mtime = (time_t)strtoll(fields[1], NULL, 10);
+                                track->size = (off_t)strtoll(fields[2], NULL, 10);
+                                track->duration = strtod(fields[3], NULL);
+                                track->sampleRate = atoi(fields[4]);
+                                track->codec = strdup(fields[5]);
+                                track->coverHash = g_ascii_strtoull(fields[6], NULL, 16);
+                                track->title = strdup(fields[7]);
+                                track->artist = strdup(fields[8]);
+                                track->albumArtist = strdup(fields[9]);
+                                track->album = strdup(fields[10]);
+                                track->date = strdup(fields[11]);
+
+                                g_hash_table_replace(metadataStore, strdup(fields[0]), track);
+                        }
+                }
+
+                g_strfreev(fields);
+        }
+
+        free(line);
+        fclose(file);
+}
+
+void writeTrackMetadata(gpointer key, gpointer value, gpointer userData)
+{
+        GString *records = (GString *)userData;
+        TrackMetadata *track = (TrackMetadata *)value;
+
+        // A path with a tab or newline can't be told apart from the fields, it gets probed again next time
+        if (strpbrk((const char *)key, "\t\n\r") != NULL)
+                return;
+
+        g_string_append_printf(records, "%s\t%lld\t%lld\t%.3f\t%d\t%s\t%llx\t%s\t%s\t%s\t%s\t%s\n",
+                               (const char *)key, (long long)track->mtime, (long long)track->size, track->duration, track->sampleRate,
+                               track->codec, (unsigned long long)track->coverHash, track->title, track->artist, track->albumArtist, track->album, track->date);
+}
+
+// The records are copied under metadataMutex and written after it is let go, so lookups don't wait for the disk
+void saveMetadataStore()
+{
+        if (metadataStore == NULL)
+                return;
+
+        char *filepath = getMetadataFilePath();
+
+        if (filepath == NULL)
+                return;
+
+        pthread_mutex_lock(&metadataSaveMutex);
+        pthread_mutex_lock(&metadataMutex);
+
+        GString *records = NULL;
+
+        if (metadataChanged && metadataStore != NULL)
+        {
+                records = g_string_new(NULL);
+                g_hash_table_foreach(metadataStore, writeTrackMetadata, records);
+                metadataChanged = false;
+        }
+
+        pthread_mutex_unlock(&metadataMutex);
+
+        if (records == NULL)
+        {
+                pthread_mutex_unlock(&metadataSaveMutex);
+                free(filepath);
+                return;
+        }
+
+        // Write next to the store and rename over it, so a failed write leaves the old one intact
+        char tmpFilepath[MAXPATHLEN];
+        snprintf(tmpFilepath, sizeof(tmpFilepath), "%s.tmp", filepath);
+
+        bool saved = false;
+        FILE *file = fopen(tmpFilepath, "w");
+
+        if (file != NULL)
+        {
+                bool written = fwrite(records->str, 1, records->len, file) == records->len;
+
+                if (fclose(file) != 0)
+                        written = false;
+
+                if (written && rename(tmpFilepath, filepath) == 0)
+                        saved = true;
+                else
+                        unlink(tmpFilepath);
+        }
+
+        // Saved again next time
+        if (!saved)
+        {
+                pthread_mutex_lock(&metadataMutex);
+                metadataChanged = true;
+                pthread_mutex_unlock(&metadataMutex);
+        }
+
+        pthread_mutex_unlock(&metadataSaveMutex);
+
+        g_string_free(records, TRUE);
+        free(filepath);
+}
+
+void freeMetadataStore()
+{
+        stopMetadataScan();
+
+        pthread_mutex_lock(&metadataMutex);
+
+        if (metadataStore != NULL)
+        {
+                g_hash_table_destroy(metadataStore);
+                metadataStore = NULL;
+        }
+
+        pthread_mutex_unlock(&metadataMutex);
+}
+
+// Returns the stored entry if the file hasn't changed since it was probed
+TrackMetadata *findFreshMetadata(const char *filePath)
+{
+        struct stat fileStats;
+
+        if (metadataStore == NULL || stat(filePath, &fileStats) != 0)
+                return NULL;
+
+        TrackMetadata *track = g_hash_table_lookup(metadataStore, filePath);
+
+        if (track == NULL || track->mtime != fileStats.st_mtime || track->size != fileStats.st_size)
+                return NULL;
+
+        return track;
+}
+
+bool lookupMetadata(const char *filePath, TagSettings *tags, double *duration, guint64 *coverHash)
+{
+        bool found = false;
+
+        pthread_mutex_lock(&metadataMutex);
+
+        TrackMetadata *track = findFreshMetadata(filePath);
+
+        if (track != NULL)
+        {
+                snprintf(tags->title, sizeof(tags->title), "%s", track->title);
+                snprintf(tags->artist, sizeof(tags->artist), "%s", track->artist);
+                snprintf(tags->album_artist, sizeof(tags->album_artist), "%s", track->albumArtist);
+                snprintf(tags->album, sizeof(tags->album), "%s", track->album);
+                snprintf(tags->date, sizeof(tags->date), "%s", track->date);
+                *duration = track->duration;
+                *coverHash = track->coverHash;
+                found = true;
+        }
+
+        pthread_mutex_unlock(&metadataMutex);
+
+        return found;
+}
+
+// The tags last stored for a file, without checking whether it has changed since
+bool lookupStoredTags(const char *filePath, TagSettings *tags)
+{
+        bool found = false;
+
+        pthread_mutex_lock(&metadataMutex);
+
+        TrackMetadata *track = (metadataStore != NULL) ? g_hash_table_lookup(metadataStore, filePath) : NULL;
+
+        if (track != NULL)
+        {
+                snprintf(tags->title, sizeof(tags->title), "%s", track->title);
+                snprintf(tags->artist, sizeof(tags->artist), "%s", track->artist);
+                snprintf(tags->album_artist, sizeof(tags->album_artist), "%s", track->albumArtist);
+                snprintf(tags->album, sizeof(tags->album), "%s", track->album);
+                snprintf(tags->date, sizeof(tags->date), "%s", track->date);
+                found = true;
+        }
+
+        pthread_mutex_unlock(&metadataMutex);
+
+        return found;
+}
+
+unsigned int getMetadataVersion()
+{
+        return atomic_load(&metadataVersion);
+}
+
+void storeMetadata(const char *filePath, const TagSettings *tags, double duration, const char *codec, int sampleRate, guint64 coverHash)
+{
+        struct stat fileStats;
+
+        if (stat(filePath, &fileStats) != 0)
+                return;
+
+        TrackMetadata *track = malloc(sizeof(TrackMetadata));
+
+        if (track == NULL)
+                return;
+
+        track->mtime = fileStats.st_mtime;
+        track->size = fileStats.st_size;
+        track->duration = duration;
+        track->sampleRate = sampleRate;
+        track->coverHash = coverHash;
+        track->codec = dupField(codec);
+        track->title = dupField(tags->title);
+        track->artist = dupField(tags->artist);
+        track->albumArtist = dupField(tags->album_artist);
+        track->album = dupField(tags->album);
+        track->date = dupField(tags->date);
+
+        char *key = strdup(filePath);
+
+        pthread_mutex_lock(&metadataMutex);
+
+        if (metadataStore != NULL && key != NULL)
+        {
+                g_hash_table_replace(metadataStore, key, track);
+                metadataChanged = true;
+        }
+        else
+        {
+                free(key);
+                freeTrackMetadata(track);
+        }
+
+        pthread_mutex_unlock(&metadataMutex);
+}
+
+void collectFilePaths(FileSystemEntry *entry, GPtrArray *paths)
+{
+        for (; entry != NULL; entry = entry->next)
+        {
+                if (entry->isDirectory)
+                        collectFilePaths(entry->children, paths);
+                else if (entry->fullPath != NULL)
+                        g_ptr_array_add(paths, strdup(entry->fullPath));
+        }
+}
+
+// Returns true if the file had to be probed
+bool probeIfUnknown(const char *filePath)
+{
+        pthread_mutex_lock(&metadataMutex);
+        bool known = findFreshMetadata(filePath) != NULL;
+        pthread_mutex_unlock(&metadataMutex);
+
+        if (known)
+                return false;
+
+        // Probing stores the result
+        TagSettings tags;
+        double duration = 0.0;
+
+        extractTags(filePath, &tags, &duration, NULL);
+
+        return true;
+}
+
+void *metadataScanThreadFunc(void *arg)
+{
+        (void)arg;
+
+        int numProbed = 0;
+
+        pthread_mutex_lock(&metadataScanMutex);
+
+        while (true)
+        {
+                char *filePath = NULL;
+
+                if (!stopMetadataScanRequested && pendingScanPaths != NULL && pendingScanPaths->len > 0)
+                {
+                        filePath = g_ptr_array_index(pendingScanPaths, pendingScanPaths->len - 1);
+                        g_ptr_array_set_size(pendingScanPaths, pendingScanPaths->len - 1);
+                }
+
+                if (filePath == NULL)
+                {
+                        if (numProbed == 0)
+                                break;
+
+                        // Searches pick up the new tags in one go rather than after every file
+                        pthread_mutex_unlock(&metadataScanMutex);
+
+                        atomic_fetch_add(&metadataVersion, 1);
+                        saveMetadataStore();
+                        numProbed = 0;
+
+                        // More paths may have been queued meanwhile
+                        pthread_mutex_lock(&metadataScanMutex);
+                        continue;
+                }
+
+                pthread_mutex_unlock(&metadataScanMutex);
+
+                if (probeIfUnknown(filePath))
+                        numProbed++;
+
+                free(filePath);
+
+                pthread_mutex_lock(&metadataScanMutex);
+        }
+
+        metadataScanRunning = false;
+        pthread_cond_broadcast(&metadataScanExited);
+
+        pthread_mutex_unlock(&metadataScanMutex);
+
+        return NULL;
+}
+
+void freeScanPaths(GPtrArray *paths)
+{
+        if (paths == NULL)
+                return;
+
+        for (guint i = 0; i < paths->len; i++)
+                free(g_ptr_array_index(paths, i));
+
+        g_ptr_array_free(paths, TRUE);
+}
+
+// Starts the scan thread if it isn't running, the caller holds metadataScanMutex
+void wakeMetadataScan()
+{
+        if (metadataScanRunning || stopMetadataScanRequested || pendingScanPaths == NULL || pendingScanPaths->len == 0)
+                return;
+
+        pthread_t thread;
+
+        if (pthread_create(&thread, NULL, metadataScanThreadFunc, NULL) != 0)
+                return;
+
+        pthread_detach(thread);
+        metadataScanRunning = true;
+}
+
+// Probes every track in the tree that isn't known yet. A scan already running carries on with the new paths.
+void startMetadataScan(FileSystemEntry *root)
+{
+        if (root == NULL || metadataStore == NULL)
+                return;
+
+        // Copy the paths so the scan doesn't depend on the tree staying alive
+        GPtrArray *paths = g_ptr_array_new();
+        collectFilePaths(root->children, paths);
+
+        pthread_mutex_lock(&metadataScanMutex);
+
+        GPtrArray *previous = pendingScanPaths;
+        pendingScanPaths = paths;
+        wakeMetadataScan();
+
+        pthread_mutex_unlock(&metadataScanMutex);
+
+        freeScanPaths(previous);
+}
+
+void queueScanPaths(GPtrArray *paths)
+{
+        pthread_mutex_lock(&metadataScanMutex);
+
+        if (pendingScanPaths == NULL)
+        {
+                pendingScanPaths = paths;
+                paths = NULL;
+        }
+        else
+        {
+                for (guint i = 0; i < paths->len; i++)
+                        g_ptr_array_add(pendingScanPaths, g_ptr_array_index(paths, i));
+        }
+
+        wakeMetadataScan();
+
+        pthread_mutex_unlock(&metadataScanMutex);
+
+        if (paths != NULL)
+                g_ptr_array_free(paths, TRUE);
+}
+
+// Probes the tracks in entries and below them, for when they have just been added to the library
+void queueMetadataScan(FileSystemEntry *entries)
+{
+        if (entries == NULL || metadataStore == NULL)
+                return;
+
+        GPtrArray *paths = g_ptr_array_new();
+        collectFilePaths(entries, paths);
+
+        queueScanPaths(paths);
+}
+
+// Probes a track again if it has changed since, like when it was still being copied the first time
+void queueMetadataProbe(const char *filePath)
+{
+        if (metadataStore == NULL)
+                return;
+
+        GPtrArray *paths = g_ptr_array_new();
+        g_ptr_array_add(paths, strdup(filePath));
+
+        queueScanPaths(paths);
+}
+
+void stopMetadataScan()
+{
+        pthread_mutex_lock(&metadataScanMutex);
+
+        stopMetadataScanRequested = true;
+
+        while (metadataScanRunning)
+                pthread_cond_wait(&metadataScanExited, &metadataScanMutex);
+
+        stopMetadataScanRequested = false;
+
+        GPtrArray *previous = pendingScanPaths;
+        pendingScanPaths = NULL;
+
+        pthread_mutex_unlock(&metadataScanMutex);
+
+        freeScanPaths(previous);
+}
@@ -0,0 +1,71 @@
+#ifndef METADATASTORE_H
+#define METADATASTORE_H
+
+#include <glib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "directorytree.h"
+#include "utils.h"
+
+#ifndef TAGSETTINGS_STRUCT
+#define TAGSETTINGS_STRUCT
+
+typedef struct
+{
+        char title[256];
+        char artist[256];
+        char album_artist[256];
+        char album[256];
+        char date[256];
+} TagSettings;
+
+#endif
+
+#ifndef TRACKMETADATA_STRUCT
+#define TRACKMETADATA_STRUCT
+
+typedef struct
+{
+        time_t mtime;
+        off_t size;
+        double duration;
+        int sampleRate;
+        guint64 coverHash; // 0 if there is no embedded cover
+        char *codec;
+        char *title;
+        char *artist;
+        char *albumArtist;
+        char *album;
+        char *date;
+} TrackMetadata;
+
+#endif
+
+void initMetadataStore(void);
+
+void saveMetadataStore(void);
+
+void freeMetadataStore(void);
+
+bool lookupMetadata(const char *filePath, TagSettings *tags, double *duration, guint64 *coverHash);
+
+bool lookupStoredTags(const char *filePath, TagSettings *tags);
+
+unsigned int getMetadataVersion(void);
+
+void storeMetadata(const char *filePath, const TagSettings *tags, double duration, const char *codec, int sampleRate, guint64 coverHash);
+
+void startMetadataScan(FileSystemEntry *root);
+
+void queueMetadataScan(FileSystemEntry *entries);
+
+void queueMetadataProbe(const char *filePath);
+
+void stopMetadataScan(void);
+
+#endif
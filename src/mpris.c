@@ -1230,7 +1230,7 @@ void emitMetadataChanged(const gchar *title, const gchar *artist, const gchar *a
         g_variant_builder_add(&changed_properties_builder, "{sv}", "CanGoNext", g_variant_new_boolean((currentSong != NULL && currentSong->next != NULL)));
 
         CanSeek = true;
-        if (currentSong != NULL && endsWith(currentSong->song.filePath, "ogg"))
+        if (currentSong != NULL && !isSeekSupported(currentSong->song.filePath))
         {
                 CanSeek = false;
         }
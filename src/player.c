@@ -55,6 +55,11 @@ int textWidth = 0;
 int indent = 0;
 char *tagsPath;
 double totalDurationSeconds = 0.0;
+char lastProgressText[100] = "";
+int lastElapsedBars = -1;
+int lastNumProgressBars = 0;
+int lastElapsedBarsIndent = 0;
+SongData *coverPendingSong = NULL;
 
 PixelData lastRowColor = {90, 90, 90};
 TagSettings metadata = {};
@@ -259,7 +264,7 @@ int displayCover(FIBITMAP *cover, const char *coverArtPath, int height, bool ans
 {
         if (!ansii)
         {
-                printSquareBitmapCentered(cover, height);
+                printSquareBitmapCentered(cover, coverArtPath, height);
         }
         else
         {
@@ -275,10 +280,10 @@ void printCover(SongData *songdata)
 {
         clearRestOfScreen();
         minWidth = ABSOLUTE_MIN_WIDTH + indent;
-        if (songdata->cover != NULL && coverEnabled)
+        if (getCover(songdata) != NULL && coverEnabled)
         {
                 clearScreen();
-                displayCover(songdata->cover, songdata->coverArtPath, preferredHeight, coverAnsi);
+                displayCover(getCover(songdata), songdata->coverArtPath, preferredHeight, coverAnsi);
 
                 drewCover = true;
         }
@@ -374,6 +379,14 @@ void printBasicMetadata(TagSettings const *metadata)
         cursorJumpDown(rows - 1);
 }
 
+void invalidateCells()
+{
+        // The screen was cleared, so everything has to be drawn again
+        lastProgressText[0] = '\0';
+        lastElapsedBars = -1;
+        invalidateSpectrum();
+}
+
 int calcElapsedBars(double elapsedSeconds, double duration, int numProgressBars)
 {
         if (elapsedSeconds == 0)
@@ -391,9 +404,6 @@ void printProgress(double elapsed_seconds, double total_seconds)
         if (term_w < progressWidth)
                 return;
 
-        // Save the current cursor position
-        printf("\033[s");
-
         int elapsed_hours = (int)(elapsed_seconds / 3600);
         int elapsed_minutes = (int)(((int)elapsed_seconds / 60) % 60);
         int elapsed_seconds_remainder = (int)elapsed_seconds % 60;
@@ -405,14 +415,27 @@ void printProgress(double elapsed_seconds, double total_seconds)
         int progress_percentage = (int)((elapsed_seconds / total_seconds) * 100);
         int vol = getCurrentVolume();
 
+        char progressText[sizeof(lastProgressText)];
+
+        snprintf(progressText, sizeof(progressText), " %02d:%02d:%02d / %02d:%02d:%02d (%d%%) Vol:%d%%",
+                 elapsed_hours, elapsed_minutes, elapsed_seconds_remainder,
+                 total_hours, total_minutes, total_seconds_remainder,
+                 progress_percentage, vol);
+
+        // The line is already on screen
+        if (strcmp(progressText, lastProgressText) == 0)
+                return;
+
+        c_strcpy(lastProgressText, sizeof(lastProgressText), progressText);
+
+        // Save the current cursor position
+        printf("\033[s");
+
         // Clear the current line
         printf("\r\033[K");
         printBlankSpaces(indent);
 
-        printf(" %02d:%02d:%02d / %02d:%02d:%02d (%d%%) Vol:%d%%",
-               elapsed_hours, elapsed_minutes, elapsed_seconds_remainder,
-               total_hours, total_minutes, total_seconds_remainder,
-               progress_percentage, vol);
+        printf("%s", progressText);
 
         // Restore the cursor position
         printf("\033[u");
@@ -869,6 +892,17 @@ void showPlaylist(SongData *songData, PlayList *list, int *chosenSong, int *chos
 
 void printElapsedBars(int elapsedBars)
 {
+        if (elapsedBars == lastElapsedBars && numProgressBars == lastNumProgressBars && indent == lastElapsedBarsIndent)
+        {
+                printf("\n");
+                return;
+        }
+
+        lastElapsedBars = elapsedBars;
+        lastNumProgressBars = numProgressBars;
+        lastElapsedBarsIndent = indent;
+
+        printf("\r");
         printBlankSpaces(indent);
         printf(" ");
         for (int i = 0; i < numProgressBars; i++)
@@ -1263,7 +1297,7 @@ int printPlayer(SongData *songdata, double elapsedSeconds, AppSettings *settings
                 metadata = *songdata->metadata;
                 duration = songdata->duration;
 
-                if (songdata->cover != NULL && coverEnabled)
+                if (getCover(songdata) != NULL && coverEnabled)
                 {
                         color.r = songdata->red;
                         color.g = songdata->green;
@@ -1289,7 +1323,10 @@ int printPlayer(SongData *songdata, double elapsedSeconds, AppSettings *settings
         calcIndent(songdata);
 
         if (preferredWidth <= 0 || preferredHeight <= 0)
+        {
+                flushFrame();
                 return -1;
+        }
 
         if (appState.currentView != PLAYLIST_VIEW)
                 resetPlaylistDisplay = true;
@@ -1323,9 +1360,15 @@ int printPlayer(SongData *songdata, double elapsedSeconds, AppSettings *settings
         }
         else if (appState.currentView == SONG_VIEW && songdata != NULL)
         {
+                // The cover was still being decoded when the view was last drawn
+                if (songdata == coverPendingSong && isCoverLoaded(songdata))
+                        refresh = true;
+
                 if (refresh)
                 {
+                        coverPendingSong = isCoverLoaded(songdata) ? NULL : songdata;
                         clearScreen();
+                        invalidateCells();
                         printf("\n");
                         printCover(songdata);
                         printMetadata(songdata->metadata);
@@ -1335,7 +1378,7 @@ int printPlayer(SongData *songdata, double elapsedSeconds, AppSettings *settings
                 printVisualizer(elapsedSeconds);
         }
 
-        fflush(stdout);
+        flushFrame();
 
         return 0;
 }
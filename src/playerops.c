@@ -515,7 +515,7 @@ void flushSeek()
         {
                 if (currentSong != NULL)
                 {
-                        if (endsWith(currentSong->song.filePath, "ogg"))
+                        if (!isSeekSupported(currentSong->song.filePath))
                         {
                                 return;
                         }
@@ -574,7 +574,7 @@ void seekForward()
 {
         if (currentSong != NULL)
         {
-                if (endsWith(currentSong->song.filePath, "ogg"))
+                if (!isSeekSupported(currentSong->song.filePath))
                 {
                         return;
                 }
@@ -592,7 +592,7 @@ void seekBack()
 {
         if (currentSong != NULL)
         {
-                if (endsWith(currentSong->song.filePath, "ogg"))
+                if (!isSeekSupported(currentSong->song.filePath))
                 {
                         return;
                 }
@@ -1022,6 +1022,11 @@ void handleRemove()
                 }
         }
 
+        // The library watcher changes the tree under switchMutex
+        pthread_mutex_lock(&switchMutex);
+        markAsDequeued(getLibrary(), node->song.filePath);
+        pthread_mutex_unlock(&switchMutex);
+
         pthread_mutex_lock(&(playlist.mutex));
 
         if (node != NULL && song != NULL && currentSong != NULL)
@@ -1030,9 +1035,6 @@ void handleRemove()
                         rebuild = true;
         }
 
-        if (node != NULL)
-                markAsDequeued(getLibrary(), node->song.filePath);
-
         Node *node2 = findSelectedEntryById(&playlist, id);
 
         if (node != NULL)
@@ -1100,14 +1102,8 @@ int loadDecoder(SongData *songData, bool *songDataDeleted)
                 // this should only be done for the second song, as switchAudioImplementation() handles the first one
                 if (!loadingdata.loadingFirstDecoder)
                 {
-                        if (hasBuiltinDecoder(songData->filePath))
+                        if (getDecoderBackend(songData->filePath) != NULL)
                                 result = prepareNextDecoder(songData->filePath);
-                        else if (endsWith(songData->filePath, "opus"))
-                                result = prepareNextOpusDecoder(songData->filePath);
-                        else if (endsWith(songData->filePath, "ogg"))
-                                result = prepareNextVorbisDecoder(songData->filePath);
-                        else if (endsWith(songData->filePath, "m4a") || endsWith(songData->filePath, "aac"))
-                                result = prepareNextM4aDecoder(songData->filePath);
                 }
         }
         return result;
@@ -1618,10 +1614,15 @@ void *updateLibraryThread(void *arg)
 
         copyIsEnqueued(library, temp);
 
+        // The results and the search index point into the old tree
+        clearSearchResults();
+        invalidateSearchIndex();
+
         freeTree(library);
         library = temp;
         numDirectoryTreeEntries = tmpDirectoryTreeEntries;
         resetChosenDir();
+        startMetadataScan(library);
 
         pthread_mutex_unlock(&switchMutex);
 
@@ -1634,8 +1635,6 @@ void updateLibrary(char *path)
 {
         pthread_t threadId;
 
-        freeSearchResults();
-
         if (pthread_create(&threadId, NULL, updateLibraryThread, path) != 0)
         {
                 perror("Failed to create thread");
@@ -1685,12 +1684,17 @@ void askIfCacheLibrary()
 
 void createLibrary(AppSettings *settings)
 {
+        time_t modifiedSince = 0;
+
         if (cacheLibrary > 0)
         {
                 char *libFilepath = getLibraryFilePath();
                 library = reconstructTreeFromFile(libFilepath, settings->path, &numDirectoryTreeEntries);
                 free(libFilepath);
-                updateLibraryIfChangedDetected();                
+
+                // The cached tree is brought up to date by the watcher
+                if (library != NULL && library->children != NULL)
+                        modifiedSince = lastTimeAppRan;
         }
 
         if (library == NULL || library->children == NULL)
@@ -1717,73 +1721,6 @@ void createLibrary(AppSettings *settings)
         {
                 exit(0);
         }
-}
-
-time_t getModificationTime(struct stat *path_stat) {
-
-    if (path_stat->st_mtime != 0) {
-        return path_stat->st_mtime;
-    } else {
-        return path_stat->st_mtim.tv_sec;  // Fallback to st_mtim.tv_sec if st_mtime is zero or invalid
-    }
-}
-
-void *updateIfTopLevelFoldersMtimesChangedThread(void *arg)
-{
-    char *path = (char *)arg;
-    struct stat path_stat;
-
-    if (stat(path, &path_stat) == -1) {
-        perror("stat");
-        pthread_exit(NULL);
-    }
-
-    if (getModificationTime(&path_stat) > lastTimeAppRan && lastTimeAppRan > 0) {        
-        updateLibrary(path);
-        pthread_exit(NULL);
-    }
 
-    DIR *dir = opendir(path);
-    if (!dir) {
-        perror("opendir");
-        pthread_exit(NULL);
-    }
-
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
-        }
-
-        char fullPath[1024];
-        snprintf(fullPath, sizeof(fullPath), "%s/%s", path, entry->d_name);
-
-        if (stat(fullPath, &path_stat) == -1) {
-            perror("stat");
-            continue;
-        }
-
-        if (S_ISDIR(path_stat.st_mode)) {
-
-            if (getModificationTime(&path_stat) > lastTimeAppRan && lastTimeAppRan > 0) {                
-                updateLibrary(path);
-                break;
-            }
-        }
-    }
-
-    closedir(dir);
-
-    pthread_exit(NULL);
-}
-
-// This only checks the library mtime and toplevel subfolders mtimes
-void updateLibraryIfChangedDetected()
-{
-        pthread_t tid;
-        if (pthread_create(&tid, NULL, updateIfTopLevelFoldersMtimesChangedThread, (void *)settings.path) != 0)
-        {
-                perror("pthread_create");
-        }
+        startLibraryWatcher(settings->path, modifiedSince);
 }
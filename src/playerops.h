@@ -9,6 +9,7 @@
 #include <stdlib.h>
 #include <sys/time.h>
 #include <unistd.h>
+#include "librarywatcher.h"
 #include "player.h"
 #include "songloader.h"
 #include "settings.h"
@@ -163,6 +164,5 @@ void reshufflePlaylist();
 
 bool determineCurrentSongData(SongData **currentSongData);
 
-void updateLibraryIfChangedDetected();
 
 #endif
@@ -224,7 +224,7 @@ int compare(const struct dirent **a, const struct dirent **b)
                 return 1;
         }
 
-        return strcmp(nameA, nameB);
+        return compareNatural(nameA, nameB);
 }
 
 void createNode(Node **node, const char *directoryPath, int id)
@@ -281,6 +281,8 @@ void buildPlaylistRecursive(const char *directoryPath, const char *allowedExtens
         if (numEntries < 0)
         {
                 printf("Failed to scan directory: %s\n", directoryPath);
+                closedir(dir);
+                regfree(&regex);
                 return;
         }
 
@@ -293,10 +295,15 @@ void buildPlaylistRecursive(const char *directoryPath, const char *allowedExtens
                         continue;
                 }
 
+                int type = getEntryType(dirfd(dir), entry);
+
+                if (type < 0)
+                        continue;
+
                 char filePath[FILENAME_MAX];
                 snprintf(filePath, sizeof(filePath), "%s/%s", directoryPath, entry->d_name);
 
-                if (isDirectory(filePath))
+                if (type == 1)
                 {
                         int songCount = playlist->count;
                         buildPlaylistRecursive(filePath, allowedExtensions, playlist);
@@ -308,8 +315,6 @@ void buildPlaylistRecursive(const char *directoryPath, const char *allowedExtens
                         extractExtension(entry->d_name, sizeof(exto) - 1, exto);
                         if (match_regex(&regex, exto) == 0)
                         {
-                                snprintf(filePath, sizeof(filePath), "%s/%s", directoryPath, entry->d_name);
-
                                 Node *node = NULL;
                                 createNode(&node, filePath, nodeIdCounter++);
                                 addToList(playlist, node);
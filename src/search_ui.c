@@ -1,6 +1,9 @@
 #include "search_ui.h"
+#include "player.h"
+#include "soundcommon.h"
 
 #define MAX_SEARCH_LEN 32
+#define MAX_SEARCH_RESULTS 500 // Only the best are kept, however many entries match
 
 int numSearchLetters = 0;
 int numSearchBytes = 0;
@@ -8,19 +11,40 @@ int numSearchBytes = 0;
 typedef struct SearchResult
 {
         FileSystemEntry *entry;
-        int distance;
+        int score;
+        uint32_t order; // Equal scores are listed in the order they were found
 } SearchResult;
 
-// Global variables to store results
+// Results on display, swapped in by the search thread while holding switchMutex
 SearchResult *results = NULL;
 size_t resultsCount = 0;
-size_t resultsCapacity = 0;
 bool newUndisplayedSearch = false;
 int minSearchLetters = 1;
 FileSystemEntry *currentSearchEntry = NULL;
 
 char searchText[MAX_SEARCH_LEN * 4 + 1]; // unicode can be 4 characters
 
+// Only touched by the search thread. A heap with the worst of the kept results on top
+SearchResult pendingResults[MAX_SEARCH_RESULTS];
+size_t pendingCount = 0;
+uint32_t numMatchesFound = 0;
+unsigned int runningSearchGeneration = 0;
+
+pthread_t searchThread;
+bool searchThreadRunning = false;
+pthread_mutex_t searchRequestMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t searchRequestCond = PTHREAD_COND_INITIALIZER;
+bool searchRequested = false;
+bool stopSearchRequested = false;
+char requestedSearchText[MAX_SEARCH_LEN * 4 + 1];
+int requestedThreshold = 0;
+_Atomic unsigned int searchGeneration = 0; // Bumped by every new search, which cancels the running one
+unsigned int publishedSearchGeneration = 0; // The search whose final results are in results, under switchMutex
+
+// A row chosen before the search of the text as typed had finished, set under switchMutex
+_Atomic int pendingChosenRow = -1;
+unsigned int pendingChosenGeneration = 0;
+
 FileSystemEntry *getCurrentSearchEntry()
 {
         return currentSearchEntry;
@@ -31,58 +55,316 @@ int getSearchResultsCount()
         return resultsCount;
 }
 
-// Function to add a result to the global array
-void addResult(FileSystemEntry *entry, int distance)
+FileSystemEntry *getSearchResult(int row)
+{
+        if (row < 0 || (size_t)row >= resultsCount)
+                return NULL;
+
+        return results[row].entry;
+}
+
+// The entry on a row of the results of the text as typed, which may not have been drawn yet. The caller holds
+// switchMutex, so the entry stays in the tree. While that search is still running the row is remembered
+// for takePendingSearchResult instead, and NULL is returned.
+FileSystemEntry *chooseSearchResult(int row)
 {
-        if (resultsCount >= resultsCapacity)
+        unsigned int generation = atomic_load(&searchGeneration);
+
+        if (publishedSearchGeneration != generation)
         {
-                resultsCapacity = resultsCapacity == 0 ? 10 : resultsCapacity * 2;
-                results = realloc(results, resultsCapacity * sizeof(SearchResult));
+                pendingChosenGeneration = generation;
+                atomic_store(&pendingChosenRow, row);
+                return NULL;
         }
-        results[resultsCount].distance = distance;
-        results[resultsCount].entry = entry;
-        resultsCount++;
+
+        atomic_store(&pendingChosenRow, -1);
+
+        return getSearchResult(row);
 }
 
-// Callback function to collect results
-void collectResult(FileSystemEntry *entry, int distance)
+bool hasPendingSearchResult()
 {
-        addResult(entry, distance);
+        return atomic_load(&pendingChosenRow) >= 0;
 }
 
-// Free allocated memory from previous search
-void freeSearchResults()
+// The entry chosen while its search was running, once the search has finished. The caller holds switchMutex.
+// A newer search drops the choice.
+FileSystemEntry *takePendingSearchResult()
 {
-        if (results != NULL)
+        int row = atomic_load(&pendingChosenRow);
+
+        if (row < 0)
+                return NULL;
+
+        if (atomic_load(&searchGeneration) != pendingChosenGeneration)
         {
-                free(results);
-                results = NULL;
+                atomic_store(&pendingChosenRow, -1);
+                return NULL;
         }
-        resultsCapacity = 0;
-        resultsCount = 0;
+
+        if (publishedSearchGeneration != pendingChosenGeneration)
+                return NULL;
+
+        atomic_store(&pendingChosenRow, -1);
+
+        return getSearchResult(row);
 }
 
-void fuzzySearch(FileSystemEntry *root, int threshold)
+bool isWorseResult(const SearchResult *a, const SearchResult *b)
 {
-        freeSearchResults();
+        return a->score < b->score || (a->score == b->score && a->order > b->order);
+}
 
-        if (numSearchLetters > minSearchLetters)
+void swapResults(SearchResult *a, SearchResult *b)
+{
+        SearchResult tmp = *a;
+        *a = *b;
+        *b = tmp;
+}
+
+// Keeps the best MAX_SEARCH_RESULTS, so ranking costs the same however many entries match
+void addResult(FileSystemEntry *entry, int score)
+{
+        SearchResult result = {entry, score, numMatchesFound++};
+        size_t i;
+
+        if (pendingCount < MAX_SEARCH_RESULTS)
         {
-                fuzzySearchRecursive(root, searchText, threshold, collectResult);
+                i = pendingCount++;
+                pendingResults[i] = result;
+
+                while (i > 0 && isWorseResult(&pendingResults[i], &pendingResults[(i - 1) / 2]))
+                {
+                        swapResults(&pendingResults[i], &pendingResults[(i - 1) / 2]);
+                        i = (i - 1) / 2;
+                }
+
+                return;
+        }
+
+        if (!isWorseResult(&pendingResults[0], &result))
+                return;
+
+        pendingResults[0] = result;
+        i = 0;
+
+        while (true)
+        {
+                size_t worst = i;
+                size_t left = 2 * i + 1;
+                size_t right = left + 1;
+
+                if (left < pendingCount && isWorseResult(&pendingResults[left], &pendingResults[worst]))
+                        worst = left;
+
+                if (right < pendingCount && isWorseResult(&pendingResults[right], &pendingResults[worst]))
+                        worst = right;
+
+                if (worst == i)
+                        break;
+
+                swapResults(&pendingResults[i], &pendingResults[worst]);
+                i = worst;
         }
-        newUndisplayedSearch = true;
 }
 
 int compareResults(const void *a, const void *b)
 {
         SearchResult *resultA = (SearchResult *)a;
         SearchResult *resultB = (SearchResult *)b;
-        return resultA->distance - resultB->distance;
+
+        if (resultA->score != resultB->score)
+                return resultB->score - resultA->score;
+
+        return (resultA->order > resultB->order) - (resultA->order < resultB->order);
+}
+
+bool isSearchCancelled()
+{
+        return atomic_load(&searchGeneration) != runningSearchGeneration;
+}
+
+// Hands a sorted copy of what has been found so far to the UI
+void publishResults(bool isFinal)
+{
+        SearchResult *ranked = NULL;
+
+        if (pendingCount > 0)
+        {
+                ranked = malloc(pendingCount * sizeof(SearchResult));
+
+                if (ranked == NULL)
+                        return;
+
+                memcpy(ranked, pendingResults, pendingCount * sizeof(SearchResult));
+                qsort(ranked, pendingCount, sizeof(SearchResult), compareResults);
+        }
+
+        pthread_mutex_lock(&switchMutex);
+
+        // Checked under the lock, so results of a cancelled search never replace newer ones
+        if (!isSearchCancelled())
+        {
+                SearchResult *previous = results;
+
+                results = ranked;
+                resultsCount = pendingCount;
+                currentSearchEntry = NULL;
+                newUndisplayedSearch = true;
+                ranked = previous;
+
+                if (isFinal)
+                {
+                        publishedSearchGeneration = runningSearchGeneration;
+                }
+        }
+
+        pthread_mutex_unlock(&switchMutex);
+
+        free(ranked);
+}
+
+void publishPartialResults()
+{
+        if (pendingCount > 0 && !isSearchCancelled())
+                publishResults(false);
 }
 
-void sortResults()
+void runSearch(const char *query, int threshold)
 {
-        qsort(results, resultsCount, sizeof(SearchResult), compareResults);
+        SearchCallbacks callbacks = {addResult, publishPartialResults, isSearchCancelled};
+
+        pendingCount = 0;
+        numMatchesFound = 0;
+
+        if (query[0] != '\0')
+        {
+                // The library watcher and updates change the tree under this lock, so only the names are copied under it.
+                // Looking up tags and building the index could hold up the decode thread at a track change.
+                SearchSnapshot *snapshot = NULL;
+
+                pthread_mutex_lock(&switchMutex);
+
+                if (!isSearchCancelled())
+                        snapshot = takeSearchSnapshot(library);
+
+                pthread_mutex_unlock(&switchMutex);
+
+                if (snapshot != NULL)
+                {
+                        buildSearchIndex(snapshot);
+                        freeSearchSnapshot(snapshot);
+                }
+
+                if (!isSearchCancelled())
+                        searchLibrary(query, threshold, &callbacks);
+        }
+
+        if (!isSearchCancelled())
+                publishResults(true);
+}
+
+void *searchThreadFunc(void *arg)
+{
+        (void)arg;
+
+        char query[sizeof(requestedSearchText)];
+
+        pthread_mutex_lock(&searchRequestMutex);
+
+        while (true)
+        {
+                while (!searchRequested && !stopSearchRequested)
+                        pthread_cond_wait(&searchRequestCond, &searchRequestMutex);
+
+                if (stopSearchRequested)
+                        break;
+
+                searchRequested = false;
+                memcpy(query, requestedSearchText, sizeof(query));
+                int threshold = requestedThreshold;
+                runningSearchGeneration = atomic_load(&searchGeneration);
+
+                pthread_mutex_unlock(&searchRequestMutex);
+
+                runSearch(query, threshold);
+
+                pthread_mutex_lock(&searchRequestMutex);
+        }
+
+        pthread_mutex_unlock(&searchRequestMutex);
+
+        return NULL;
+}
+
+// Clears the results and cancels any search in progress, the caller holds switchMutex
+void clearSearchResults()
+{
+        publishedSearchGeneration = atomic_fetch_add(&searchGeneration, 1) + 1;
+
+        free(results);
+        results = NULL;
+        resultsCount = 0;
+        currentSearchEntry = NULL;
+        newUndisplayedSearch = true;
+}
+
+// Free allocated memory from previous search
+void freeSearchResults()
+{
+        pthread_mutex_lock(&switchMutex);
+        clearSearchResults();
+        pthread_mutex_unlock(&switchMutex);
+}
+
+// Searches on the search thread, a search still running for an older text is cancelled
+void fuzzySearch(int threshold)
+{
+        pthread_mutex_lock(&searchRequestMutex);
+
+        if (!searchThreadRunning)
+        {
+                stopSearchRequested = false;
+                searchThreadRunning = (pthread_create(&searchThread, NULL, searchThreadFunc, NULL) == 0);
+
+                if (!searchThreadRunning)
+                {
+                        pthread_mutex_unlock(&searchRequestMutex);
+                        return;
+                }
+        }
+
+        if (numSearchLetters > minSearchLetters)
+                memcpy(requestedSearchText, searchText, sizeof(requestedSearchText));
+        else
+                requestedSearchText[0] = '\0';
+
+        requestedThreshold = threshold;
+        searchRequested = true;
+        atomic_fetch_add(&searchGeneration, 1);
+
+        pthread_cond_signal(&searchRequestCond);
+        pthread_mutex_unlock(&searchRequestMutex);
+}
+
+void stopSearchThread()
+{
+        pthread_mutex_lock(&searchRequestMutex);
+
+        if (!searchThreadRunning)
+        {
+                pthread_mutex_unlock(&searchRequestMutex);
+                return;
+        }
+
+        stopSearchRequested = true;
+        atomic_fetch_add(&searchGeneration, 1);
+        pthread_cond_signal(&searchRequestCond);
+
+        pthread_mutex_unlock(&searchRequestMutex);
+
+        pthread_join(searchThread, NULL);
+        searchThreadRunning = false;
 }
 
 int displaySearchBox(int indent)
@@ -124,6 +406,8 @@ int addToSearchText(const char *str)
 
         printf("█\n");
 
+        fflush(stdout);
+
         // Add the string to the search text buffer
         for (size_t i = 0; i < len; i++)
         {
@@ -208,8 +492,6 @@ int displaySearchResults(int maxListSize, int indent, int *chosenRow, int startS
         int maxNameWidth = term_w - indent - 5;
         char name[maxNameWidth + 1];
 
-        sortResults();
-
         if (*chosenRow >= (int)resultsCount - 1)
         {
                 *chosenRow = resultsCount - 1;
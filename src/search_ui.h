@@ -1,6 +1,9 @@
-#include <stdbool.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include "directorytree.h"
+#include "searchindex.h"
 #include "term.h"
 #include "common_ui.h"
 
@@ -10,6 +13,11 @@ int displaySearch(int maxListSize, int indent, int *chosenRow, int startSearchIt
 int addToSearchText(const char *str);
 int removeFromSearchText();
 int getSearchResultsCount();
-void fuzzySearch(FileSystemEntry *root, int threshold);
+void fuzzySearch(int threshold);
+void stopSearchThread();
+void clearSearchResults();
 void freeSearchResults();
 FileSystemEntry *getCurrentSearchEntry();
+FileSystemEntry *chooseSearchResult(int row);
+bool hasPendingSearchResult();
+FileSystemEntry *takePendingSearchResult();
@@ -0,0 +1,959 @@
+#include "searchindex.h"
+
+/*
+
+searchindex.c
+
+ Normalized names, tags and folders of the library with a trigram index over them, so a search only
+ scores entries that can match.
+
+*/
+
+#define TRIGRAM_BUCKETS 65536
+#define MAX_QUERY_TRIGRAMS 256
+#define MAX_INDEXED_LENGTH NAME_MAX
+#define CANCEL_CHECK_INTERVAL 1024 // Names scored between checks
+#define MAX_QUERY_WORDS 16 // One bit each in a name's word mask
+#define NO_PARENT UINT32_MAX
+
+// Score of a word found in a field, before the field's weight
+#define MATCH_SCORE 10
+#define PREFIX_BONUS 8      // The field starts with the word
+#define WORD_START_BONUS 5  // A word in the field starts with it
+#define WHOLE_FIELD_BONUS 6 // The field is just the word
+#define PHRASE_BONUS 10     // The words are found together, as typed
+#define FUZZY_PENALTY 5     // Per edit between the search and a name
+#define FOLDER_WEIGHT 1     // A word in the name of a folder the entry is in, below the music folder
+
+enum
+{
+        FIELD_NAME,
+        FIELD_TITLE,
+        FIELD_ARTIST,
+        FIELD_ALBUM,
+        NUM_SEARCH_FIELDS
+};
+
+const int fieldWeights[NUM_SEARCH_FIELDS] = {4, 4, 3, 2};
+
+typedef struct
+{
+        FileSystemEntry *entry;
+        uint32_t nameOffset; // The fields follow the name, each null-terminated
+        uint32_t parent;     // The folder's index, NO_PARENT at the top of the library
+        uint32_t subtreeEnd; // The names in a folder come right after it, up to this one
+        uint16_t fieldLengths[NUM_SEARCH_FIELDS];
+} IndexedName;
+
+typedef struct
+{
+        FileSystemEntry *entry;
+        uint32_t parent;
+        uint32_t subtreeEnd;
+        size_t nameOffset; // Into the snapshot's data
+        size_t pathOffset; // SIZE_MAX for directories, which have no tags
+} SnapshotEntry;
+
+// The entries of the tree in index order with copies of their names and paths, taken under the lock that guards
+// the tree so the index can be built without holding it
+struct SearchSnapshot
+{
+        FileSystemEntry *root;
+        unsigned int version;
+        unsigned int treeGeneration;
+        SnapshotEntry *entries;
+        uint32_t numEntries;
+        uint32_t entriesCapacity;
+        char *data;
+        size_t dataSize;
+        size_t dataCapacity;
+};
+
+typedef struct
+{
+        uint32_t name;
+        int distance;
+} FuzzyMatch;
+
+typedef struct
+{
+        char phrase[NAME_MAX + 1];
+        size_t phraseLength;
+        char wordData[NAME_MAX + 1]; // The phrase with the spaces as terminators
+        const char *words[MAX_QUERY_WORDS];
+        size_t wordLengths[MAX_QUERY_WORDS];
+        int numWords;
+} SearchQuery;
+
+typedef struct
+{
+        FileSystemEntry *root;
+        unsigned int version;
+        unsigned int metadataVersion;
+        unsigned int treeGeneration;
+        IndexedName *names; // In the order a depth-first walk of the tree finds them
+        uint32_t numNames;
+        uint32_t namesCapacity;
+        char *nameData; // Normalized names, null-terminated
+        size_t nameDataSize;
+        size_t nameDataCapacity;
+        uint32_t *postingStarts; // Per bucket, into postings
+        uint32_t *postings;      // Name indices, ascending within each bucket
+        uint16_t *hits;          // Per name, how many of a query word's trigrams it has
+        uint16_t *wordMasks;     // Per name, the query words it or one of its folders has
+        uint32_t *markedNames;   // The names with a word mask set
+        uint32_t numMarkedNames;
+        uint32_t *byLength;      // Name indices ordered by length
+        uint32_t lengthStarts[MAX_INDEXED_LENGTH + 2];
+        uint32_t *substringMatches; // Names with every word of the last query, ascending
+        int *substringScores;
+        uint32_t numSubstringMatches;
+        FuzzyMatch *fuzzyMatches;
+        uint32_t numFuzzyMatches;
+        uint32_t fuzzyMatchesCapacity;
+        bool hasLastQuery;
+        char lastQuery[NAME_MAX + 1];
+        size_t lastQueryLength;
+        int lastThreshold;
+} SearchIndex;
+
+SearchIndex searchIndex = {0};
+_Atomic unsigned int searchTreeGeneration = 0; // Bumped when a tree is freed, a new one may get the same address
+
+// Base letters for U+00C0 to U+017F, 0 where there is none
+const char latinBaseLetters[192] =
+    "aaaaaaaceeeeiiii"
+    "dnooooo\0ouuuuy\0s"
+    "aaaaaaaceeeeiiii"
+    "dnooooo\0ouuuuy\0y"
+    "aaaaaaccccccccdd"
+    "ddeeeeeeeeeegggg"
+    "gggghhhhiiiiiiii"
+    "iiiijjkkklllllll"
+    "lllnnnnnnnnnoooo"
+    "oooorrrrrrssssss"
+    "sstttttt"
+    "uuuuuuuuuuuuwwyy"
+    "yzzzzzzs";
+
+// Lowercases and strips diacritics from Latin letters, so "Beyoncé" is found with "beyonce"
+size_t normalizeName(const char *name, char *out, size_t outSize)
+{
+        size_t length = 0;
+        const unsigned char *c = (const unsigned char *)name;
+
+        while (*c != '\0' && length + 1 < outSize)
+        {
+                if (c[0] >= 0xC3 && c[0] <= 0xC5 && (c[1] & 0xC0) == 0x80)
+                {
+                        unsigned int codepoint = ((c[0] & 0x1F) << 6) | (c[1] & 0x3F);
+
+                        if (codepoint >= 0xC0 && codepoint <= 0x17F && latinBaseLetters[codepoint - 0xC0] != '\0')
+                        {
+                                out[length++] = latinBaseLetters[codepoint - 0xC0];
+                                c += 2;
+                                continue;
+                        }
+                }
+
+                out[length++] = tolower(*c);
+                c++;
+        }
+
+        out[length] = '\0';
+
+        return length;
+}
+
+uint32_t getTrigramBucket(const char *str)
+{
+        const unsigned char *c = (const unsigned char *)str;
+        uint32_t trigram = ((uint32_t)c[0] << 16) | ((uint32_t)c[1] << 8) | c[2];
+
+        return (trigram * 2654435761u) >> 16;
+}
+
+void clearSearchIndex()
+{
+        free(searchIndex.names);
+        free(searchIndex.nameData);
+        free(searchIndex.postingStarts);
+        free(searchIndex.postings);
+        free(searchIndex.hits);
+        free(searchIndex.wordMasks);
+        free(searchIndex.markedNames);
+        free(searchIndex.byLength);
+        free(searchIndex.substringMatches);
+        free(searchIndex.substringScores);
+        free(searchIndex.fuzzyMatches);
+
+        memset(&searchIndex, 0, sizeof(searchIndex));
+}
+
+void freeSearchSnapshot(SearchSnapshot *snapshot)
+{
+        if (snapshot == NULL)
+                return;
+
+        free(snapshot->entries);
+        free(snapshot->data);
+        free(snapshot);
+}
+
+bool addSnapshotString(SearchSnapshot *snapshot, const char *str, size_t *offset)
+{
+        size_t length = strlen(str) + 1;
+
+        if (snapshot->dataSize + length > snapshot->dataCapacity)
+        {
+                size_t capacity = (snapshot->dataCapacity > 0) ? snapshot->dataCapacity * 2 : 65536;
+
+                while (capacity < snapshot->dataSize + length)
+                        capacity *= 2;
+
+                char *data = realloc(snapshot->data, capacity);
+
+                if (data == NULL)
+                        return false;
+
+                snapshot->data = data;
+                snapshot->dataCapacity = capacity;
+        }
+
+        memcpy(snapshot->data + snapshot->dataSize, str, length);
+        *offset = snapshot->dataSize;
+        snapshot->dataSize += length;
+
+        return true;
+}
+
+// Depth first, so the folders an entry is in are found through parent and never stored with it
+bool addSnapshotEntries(SearchSnapshot *snapshot, FileSystemEntry *entry, uint32_t parent)
+{
+        for (; entry != NULL; entry = entry->next)
+        {
+                if (snapshot->numEntries == snapshot->entriesCapacity)
+                {
+                        uint32_t capacity = (snapshot->entriesCapacity > 0) ? snapshot->entriesCapacity * 2 : 4096;
+                        SnapshotEntry *entries = realloc(snapshot->entries, capacity * sizeof(SnapshotEntry));
+
+                        if (entries == NULL)
+                                return false;
+
+                        snapshot->entries = entries;
+                        snapshot->entriesCapacity = capacity;
+                }
+
+                uint32_t index = snapshot->numEntries;
+                SnapshotEntry *copy = &snapshot->entries[index];
+
+                copy->entry = entry;
+                copy->parent = parent;
+                copy->pathOffset = SIZE_MAX;
+
+                if (!addSnapshotString(snapshot, entry->name, &snapshot->entries[index].nameOffset))
+                        return false;
+
+                if (!entry->isDirectory && entry->fullPath != NULL &&
+                    !addSnapshotString(snapshot, entry->fullPath, &snapshot->entries[index].pathOffset))
+                        return false;
+
+                snapshot->numEntries++;
+
+                if (entry->children != NULL && !addSnapshotEntries(snapshot, entry->children, index))
+                        return false;
+
+                snapshot->entries[index].subtreeEnd = snapshot->numEntries;
+        }
+
+        return true;
+}
+
+// NULL if the index is already built from this tree as it is now, or if there is no memory for a copy
+SearchSnapshot *takeSearchSnapshot(FileSystemEntry *root)
+{
+        if (root == NULL)
+                return NULL;
+
+        unsigned int version = getTreeVersion(root);
+        unsigned int treeGeneration = atomic_load(&searchTreeGeneration);
+
+        // Built on the first search and again whenever the library or its tags have changed
+        if (searchIndex.names != NULL && searchIndex.root == root && searchIndex.version == version &&
+            searchIndex.treeGeneration == treeGeneration && searchIndex.metadataVersion == getMetadataVersion())
+                return NULL;
+
+        // Without a copy the old index can't be trusted, its tree may be gone
+        SearchSnapshot *snapshot = calloc(1, sizeof(SearchSnapshot));
+
+        if (snapshot == NULL)
+        {
+                clearSearchIndex();
+                return NULL;
+        }
+
+        snapshot->root = root;
+        snapshot->version = version;
+        snapshot->treeGeneration = treeGeneration;
+
+        // The root is only a container
+        if (!addSnapshotEntries(snapshot, root->children, NO_PARENT))
+        {
+                freeSearchSnapshot(snapshot);
+                clearSearchIndex();
+                return NULL;
+        }
+
+        return snapshot;
+}
+
+bool addIndexedName(const SearchSnapshot *snapshot, uint32_t index)
+{
+        if (searchIndex.numNames == searchIndex.namesCapacity)
+        {
+                uint32_t capacity = (searchIndex.namesCapacity > 0) ? searchIndex.namesCapacity * 2 : 4096;
+                IndexedName *names = realloc(searchIndex.names, capacity * sizeof(IndexedName));
+
+                if (names == NULL)
+                        return false;
+
+                searchIndex.names = names;
+                searchIndex.namesCapacity = capacity;
+        }
+
+        const SnapshotEntry *entry = &snapshot->entries[index];
+
+        TagSettings tags;
+        bool hasTags = entry->pathOffset != SIZE_MAX && lookupStoredTags(snapshot->data + entry->pathOffset, &tags);
+
+        const char *fields[NUM_SEARCH_FIELDS] = {
+            snapshot->data + entry->nameOffset,
+            hasTags ? tags.title : "",
+            hasTags ? (tags.artist[0] != '\0' ? tags.artist : tags.album_artist) : "",
+            hasTags ? tags.album : ""};
+
+        IndexedName *name = &searchIndex.names[searchIndex.numNames];
+
+        name->entry = entry->entry;
+        name->nameOffset = (uint32_t)searchIndex.nameDataSize;
+        name->parent = entry->parent;
+        name->subtreeEnd = entry->subtreeEnd;
+
+        for (int f = 0; f < NUM_SEARCH_FIELDS; f++)
+        {
+                // Normalizing never makes a field longer
+                size_t maxLength = strlen(fields[f]) + 1;
+
+                if (maxLength > MAX_INDEXED_LENGTH + 1)
+                        maxLength = MAX_INDEXED_LENGTH + 1;
+
+                if (searchIndex.nameDataSize + maxLength > searchIndex.nameDataCapacity)
+                {
+                        size_t capacity = (searchIndex.nameDataCapacity > 0) ? searchIndex.nameDataCapacity * 2 : 65536;
+
+                        while (capacity < searchIndex.nameDataSize + maxLength)
+                                capacity *= 2;
+
+                        char *nameData = realloc(searchIndex.nameData, capacity);
+
+                        if (nameData == NULL)
+                                return false;
+
+                        searchIndex.nameData = nameData;
+                        searchIndex.nameDataCapacity = capacity;
+                }
+
+                size_t length = normalizeName(fields[f], searchIndex.nameData + searchIndex.nameDataSize, maxLength);
+
+                name->fieldLengths[f] = (uint16_t)length;
+                searchIndex.nameDataSize += length + 1;
+        }
+
+        searchIndex.numNames++;
+
+        return true;
+}
+
+// Calls fn for each bucket a name has a trigram in, in any of its fields, once per bucket
+void forEachNameBucket(uint32_t nameIndex, uint32_t *lastName, void (*fn)(uint32_t bucket, uint32_t nameIndex))
+{
+        const IndexedName *name = &searchIndex.names[nameIndex];
+        const char *str = searchIndex.nameData + name->nameOffset;
+
+        for (int f = 0; f < NUM_SEARCH_FIELDS; f++)
+        {
+                for (uint32_t i = 0; i + 3 <= name->fieldLengths[f]; i++)
+                {
+                        uint32_t bucket = getTrigramBucket(str + i);
+
+                        if (lastName[bucket] == nameIndex)
+                                continue;
+
+                        lastName[bucket] = nameIndex;
+                        fn(bucket, nameIndex);
+                }
+
+                str += name->fieldLengths[f] + 1;
+        }
+}
+
+void countPosting(uint32_t bucket, uint32_t nameIndex)
+{
+        (void)nameIndex;
+        searchIndex.postingStarts[bucket + 1]++;
+}
+
+void fillPosting(uint32_t bucket, uint32_t nameIndex)
+{
+        // postingStarts[bucket] is used as the fill position and ends up at the next bucket's start
+        searchIndex.postings[searchIndex.postingStarts[bucket]++] = nameIndex;
+}
+
+int getLengthBucket(uint32_t nameIndex)
+{
+        uint32_t length = searchIndex.names[nameIndex].fieldLengths[FIELD_NAME];
+
+        return (length > MAX_INDEXED_LENGTH) ? MAX_INDEXED_LENGTH : (int)length;
+}
+
+// Looks up the tags and builds the trigram lists without the tree, so the lock that guards it isn't held meanwhile
+bool buildSearchIndex(const SearchSnapshot *snapshot)
+{
+        // Read first, tags stored while building get the index built again next time
+        unsigned int metadataVersion = getMetadataVersion();
+
+        clearSearchIndex();
+
+        for (uint32_t i = 0; i < snapshot->numEntries; i++)
+        {
+                if (!addIndexedName(snapshot, i))
+                {
+                        clearSearchIndex();
+                        return false;
+                }
+        }
+
+        uint32_t numNames = searchIndex.numNames;
+        uint32_t *lastName = malloc(TRIGRAM_BUCKETS * sizeof(uint32_t));
+
+        searchIndex.postingStarts = calloc(TRIGRAM_BUCKETS + 1, sizeof(uint32_t));
+        searchIndex.hits = calloc(numNames > 0 ? numNames : 1, sizeof(uint16_t));
+        searchIndex.wordMasks = calloc(numNames > 0 ? numNames : 1, sizeof(uint16_t));
+        searchIndex.markedNames = malloc((numNames > 0 ? numNames : 1) * sizeof(uint32_t));
+
+        if (lastName == NULL || searchIndex.postingStarts == NULL || searchIndex.hits == NULL || searchIndex.wordMasks == NULL ||
+            searchIndex.markedNames == NULL)
+        {
+                free(lastName);
+                clearSearchIndex();
+                return false;
+        }
+
+        memset(lastName, 0xFF, TRIGRAM_BUCKETS * sizeof(uint32_t));
+
+        for (uint32_t i = 0; i < numNames; i++)
+                forEachNameBucket(i, lastName, countPosting);
+
+        for (uint32_t b = 0; b < TRIGRAM_BUCKETS; b++)
+                searchIndex.postingStarts[b + 1] += searchIndex.postingStarts[b];
+
+        uint32_t numPostings = searchIndex.postingStarts[TRIGRAM_BUCKETS];
+        searchIndex.postings = malloc((numPostings > 0 ? numPostings : 1) * sizeof(uint32_t));
+
+        if (searchIndex.postings == NULL)
+        {
+                free(lastName);
+                clearSearchIndex();
+                return false;
+        }
+
+        memset(lastName, 0xFF, TRIGRAM_BUCKETS * sizeof(uint32_t));
+
+        for (uint32_t i = 0; i < numNames; i++)
+                forEachNameBucket(i, lastName, fillPosting);
+
+        // Filling moved every start one bucket ahead
+        memmove(searchIndex.postingStarts + 1, searchIndex.postingStarts, TRIGRAM_BUCKETS * sizeof(uint32_t));
+        searchIndex.postingStarts[0] = 0;
+
+        free(lastName);
+
+        searchIndex.byLength = malloc((numNames > 0 ? numNames : 1) * sizeof(uint32_t));
+        searchIndex.substringMatches = malloc((numNames > 0 ? numNames : 1) * sizeof(uint32_t));
+        searchIndex.substringScores = malloc((numNames > 0 ? numNames : 1) * sizeof(int));
+
+        if (searchIndex.byLength == NULL || searchIndex.substringMatches == NULL || searchIndex.substringScores == NULL)
+        {
+                clearSearchIndex();
+                return false;
+        }
+
+        // Counting sort, names of the same length stay in tree order
+        for (uint32_t i = 0; i < numNames; i++)
+                searchIndex.lengthStarts[getLengthBucket(i) + 1]++;
+
+        for (int length = 0; length <= MAX_INDEXED_LENGTH; length++)
+                searchIndex.lengthStarts[length + 1] += searchIndex.lengthStarts[length];
+
+        uint32_t fill[MAX_INDEXED_LENGTH + 1];
+        memcpy(fill, searchIndex.lengthStarts, sizeof(fill));
+
+        for (uint32_t i = 0; i < numNames; i++)
+                searchIndex.byLength[fill[getLengthBucket(i)]++] = i;
+
+        searchIndex.root = snapshot->root;
+        searchIndex.version = snapshot->version;
+        searchIndex.treeGeneration = snapshot->treeGeneration;
+        searchIndex.metadataVersion = metadataVersion;
+
+        return true;
+}
+
+void freeSearchIndex()
+{
+        clearSearchIndex();
+}
+
+const char *getIndexedName(uint32_t nameIndex)
+{
+        return searchIndex.nameData + searchIndex.names[nameIndex].nameOffset;
+}
+
+void parseSearchQuery(const char *searchTerm, SearchQuery *query)
+{
+        query->phraseLength = normalizeName(searchTerm, query->phrase, sizeof(query->phrase));
+        query->numWords = 0;
+
+        memcpy(query->wordData, query->phrase, query->phraseLength + 1);
+
+        char *word = query->wordData;
+
+        while (*word != '\0' && query->numWords < MAX_QUERY_WORDS)
+        {
+                char *end = strchr(word, ' ');
+
+                if (end != NULL)
+                        *end = '\0';
+
+                if (*word != '\0')
+                {
+                        query->words[query->numWords] = word;
+                        query->wordLengths[query->numWords] = strlen(word);
+                        query->numWords++;
+                }
+
+                if (end == NULL)
+                        break;
+
+                word = end + 1;
+        }
+}
+
+// Score of a word in a field before the field's weight, 0 if the field doesn't contain it
+int scoreWordInField(const char *field, size_t fieldLength, const char *word, size_t wordLength)
+{
+        int best = 0;
+
+        for (const char *found = strstr(field, word); found != NULL; found = strstr(found + 1, word))
+        {
+                int score = MATCH_SCORE;
+
+                // Nothing later in the field scores higher
+                if (found == field)
+                        return score + PREFIX_BONUS + (wordLength == fieldLength ? WHOLE_FIELD_BONUS : 0);
+
+                if (!isalnum((unsigned char)found[-1]))
+                        score += WORD_START_BONUS;
+
+                if (score > best)
+                        best = score;
+        }
+
+        return best;
+}
+
+// Best score of a word in the name's own fields, 0 if none contains it
+int scoreOwnWord(uint32_t nameIndex, const char *word, size_t wordLength)
+{
+        const IndexedName *name = &searchIndex.names[nameIndex];
+        const char *field = searchIndex.nameData + name->nameOffset;
+        int best = 0;
+
+        for (int f = 0; f < NUM_SEARCH_FIELDS; f++)
+        {
+                int score = fieldWeights[f] * scoreWordInField(field, name->fieldLengths[f], word, wordLength);
+
+                if (score > best)
+                        best = score;
+
+                field += name->fieldLengths[f] + 1;
+        }
+
+        return best;
+}
+
+// Best score of a word in the fields of a name or the folders it is in, 0 if none contains it
+int scoreWord(uint32_t nameIndex, const char *word, size_t wordLength)
+{
+        int best = scoreOwnWord(nameIndex, word, wordLength);
+
+        for (uint32_t p = searchIndex.names[nameIndex].parent; p != NO_PARENT; p = searchIndex.names[p].parent)
+        {
+                int score = FOLDER_WEIGHT * scoreWordInField(getIndexedName(p), searchIndex.names[p].fieldLengths[FIELD_NAME], word, wordLength);
+
+                if (score > best)
+                        best = score;
+        }
+
+        return best;
+}
+
+// 0 unless every word is somewhere in the name's fields or folders
+int scoreSubstringMatch(uint32_t nameIndex, const SearchQuery *query)
+{
+        int total = 0;
+
+        for (int w = 0; w < query->numWords; w++)
+        {
+                int score = scoreWord(nameIndex, query->words[w], query->wordLengths[w]);
+
+                if (score == 0)
+                        return 0;
+
+                total += score;
+        }
+
+        if (query->numWords > 1)
+        {
+                const IndexedName *name = &searchIndex.names[nameIndex];
+                const char *field = searchIndex.nameData + name->nameOffset;
+                int best = 0;
+
+                for (int f = 0; f < NUM_SEARCH_FIELDS; f++)
+                {
+                        if (fieldWeights[f] > best && strstr(field, query->phrase) != NULL)
+                                best = fieldWeights[f];
+
+                        field += name->fieldLengths[f] + 1;
+                }
+
+                for (uint32_t p = name->parent; p != NO_PARENT && best < FOLDER_WEIGHT; p = searchIndex.names[p].parent)
+                {
+                        if (strstr(getIndexedName(p), query->phrase) != NULL)
+                                best = FOLDER_WEIGHT;
+                }
+
+                total += PHRASE_BONUS * best;
+        }
+
+        return total;
+}
+
+void addSubstringMatch(uint32_t nameIndex, const SearchQuery *query)
+{
+        int score = scoreSubstringMatch(nameIndex, query);
+
+        if (score == 0)
+                return;
+
+        searchIndex.substringMatches[searchIndex.numSubstringMatches] = nameIndex;
+        searchIndex.substringScores[searchIndex.numSubstringMatches] = score;
+        searchIndex.numSubstringMatches++;
+}
+
+// Keeps the names in substringMatches that match the query, with their scores
+bool scoreSubstringCandidates(const SearchQuery *query, bool (*isCancelled)(void))
+{
+        uint32_t numCandidates = searchIndex.numSubstringMatches;
+
+        searchIndex.numSubstringMatches = 0;
+
+        for (uint32_t m = 0; m < numCandidates; m++)
+        {
+                if (m % CANCEL_CHECK_INTERVAL == 0 && isCancelled())
+                        return false;
+
+                addSubstringMatch(searchIndex.substringMatches[m], query);
+        }
+
+        return true;
+}
+
+int getWordBuckets(const char *word, size_t wordLength, uint32_t *buckets)
+{
+        int numBuckets = 0;
+
+        for (size_t i = 0; i + 3 <= wordLength && numBuckets < MAX_QUERY_TRIGRAMS; i++)
+        {
+                uint32_t bucket = getTrigramBucket(word + i);
+                bool seen = false;
+
+                for (int j = 0; j < numBuckets && !seen; j++)
+                        seen = (buckets[j] == bucket);
+
+                if (!seen)
+                        buckets[numBuckets++] = bucket;
+        }
+
+        return numBuckets;
+}
+
+void markWord(uint32_t nameIndex, uint16_t wordBit)
+{
+        if (searchIndex.wordMasks[nameIndex] == 0)
+                searchIndex.markedNames[searchIndex.numMarkedNames++] = nameIndex;
+
+        searchIndex.wordMasks[nameIndex] |= wordBit;
+}
+
+// Marks the names that have the word in their own fields, and everything in a folder that has it in its name
+bool markWordMatches(const char *word, size_t wordLength, uint16_t wordBit, bool (*isCancelled)(void))
+{
+        uint32_t buckets[MAX_QUERY_TRIGRAMS];
+        int numBuckets = getWordBuckets(word, wordLength, buckets);
+
+        uint32_t rarest = buckets[0];
+        int numCounted = 0;
+        bool cancelled = false;
+
+        for (; numCounted < numBuckets && !cancelled; numCounted++)
+        {
+                uint32_t bucket = buckets[numCounted];
+
+                if (searchIndex.postingStarts[bucket + 1] - searchIndex.postingStarts[bucket] <
+                    searchIndex.postingStarts[rarest + 1] - searchIndex.postingStarts[rarest])
+                        rarest = bucket;
+
+                for (uint32_t p = searchIndex.postingStarts[bucket]; p < searchIndex.postingStarts[bucket + 1]; p++)
+                        searchIndex.hits[searchIndex.postings[p]]++;
+
+                cancelled = isCancelled();
+        }
+
+        // A name containing the word has all its trigrams, so it is in the shortest list. The list is ascending,
+        // so a folder inside one already marked is skipped.
+        uint32_t coveredUntil = 0;
+
+        for (uint32_t p = searchIndex.postingStarts[rarest]; p < searchIndex.postingStarts[rarest + 1] && !cancelled; p++)
+        {
+                uint32_t i = searchIndex.postings[p];
+
+                if (i < coveredUntil || searchIndex.hits[i] != numBuckets || scoreOwnWord(i, word, wordLength) == 0)
+                        continue;
+
+                for (uint32_t d = i; d < searchIndex.names[i].subtreeEnd; d++)
+                        markWord(d, wordBit);
+
+                coveredUntil = searchIndex.names[i].subtreeEnd;
+        }
+
+        // The counts are cleared even when cancelled, the next word starts from zero
+        for (int j = 0; j < numCounted; j++)
+        {
+                for (uint32_t p = searchIndex.postingStarts[buckets[j]]; p < searchIndex.postingStarts[buckets[j] + 1]; p++)
+                        searchIndex.hits[searchIndex.postings[p]] = 0;
+        }
+
+        return !cancelled;
+}
+
+int compareNameIndices(const void *a, const void *b)
+{
+        uint32_t nameA = *(const uint32_t *)a;
+        uint32_t nameB = *(const uint32_t *)b;
+
+        return (nameA > nameB) - (nameA < nameB);
+}
+
+bool findSubstringMatches(const SearchQuery *query, bool (*isCancelled)(void))
+{
+        uint16_t allWords = 0;
+        bool cancelled = false;
+
+        searchIndex.numSubstringMatches = 0;
+
+        // Words can be in different fields and folders, so each is looked up on its own
+        for (int w = 0; w < query->numWords && !cancelled; w++)
+        {
+                // Too short for trigrams, it is only checked when scoring
+                if (query->wordLengths[w] < 3)
+                        continue;
+
+                allWords |= (uint16_t)(1u << w);
+                cancelled = !markWordMatches(query->words[w], query->wordLengths[w], (uint16_t)(1u << w), isCancelled);
+        }
+
+        // Every word is too short, every name has to be looked at
+        if (allWords == 0)
+        {
+                for (uint32_t i = 0; i < searchIndex.numNames; i++)
+                {
+                        if (i % CANCEL_CHECK_INTERVAL == 0 && isCancelled())
+                                return false;
+
+                        addSubstringMatch(i, query);
+                }
+
+                return true;
+        }
+
+        for (uint32_t m = 0; m < searchIndex.numMarkedNames; m++)
+        {
+                uint32_t i = searchIndex.markedNames[m];
+
+                if (!cancelled && searchIndex.wordMasks[i] == allWords)
+                        searchIndex.substringMatches[searchIndex.numSubstringMatches++] = i;
+
+                searchIndex.wordMasks[i] = 0;
+        }
+
+        searchIndex.numMarkedNames = 0;
+
+        if (cancelled)
+        {
+                searchIndex.numSubstringMatches = 0;
+                return false;
+        }
+
+        // Folders mark their contents out of order, matches are kept ascending
+        qsort(searchIndex.substringMatches, searchIndex.numSubstringMatches, sizeof(uint32_t), compareNameIndices);
+
+        return scoreSubstringCandidates(query, isCancelled);
+}
+
+bool isSubstringMatch(uint32_t nameIndex)
+{
+        uint32_t low = 0, high = searchIndex.numSubstringMatches;
+
+        while (low < high)
+        {
+                uint32_t mid = low + (high - low) / 2;
+
+                if (searchIndex.substringMatches[mid] < nameIndex)
+                        low = mid + 1;
+                else
+                        high = mid;
+        }
+
+        return low < searchIndex.numSubstringMatches && searchIndex.substringMatches[low] == nameIndex;
+}
+
+int compareFuzzyMatches(const void *a, const void *b)
+{
+        uint32_t nameA = ((const FuzzyMatch *)a)->name;
+        uint32_t nameB = ((const FuzzyMatch *)b)->name;
+
+        return (nameA > nameB) - (nameA < nameB);
+}
+
+// Catches typos in names. Only names whose length is within the threshold can be close enough
+bool findFuzzyMatches(const SearchQuery *query, int threshold, bool (*isCancelled)(void))
+{
+        static EditPattern pattern;
+        prepareEditPattern(&pattern, query->phrase);
+
+        int minLength = (int)query->phraseLength - threshold;
+        int maxLength = (int)query->phraseLength + threshold;
+
+        if (minLength < 0)
+                minLength = 0;
+
+        if (maxLength > MAX_INDEXED_LENGTH)
+                maxLength = MAX_INDEXED_LENGTH;
+
+        searchIndex.numFuzzyMatches = 0;
+
+        for (uint32_t p = searchIndex.lengthStarts[minLength]; p < searchIndex.lengthStarts[maxLength + 1]; p++)
+        {
+                if ((p - searchIndex.lengthStarts[minLength]) % CANCEL_CHECK_INTERVAL == 0 && isCancelled())
+                        return false;
+
+                uint32_t i = searchIndex.byLength[p];
+
+                if (isSubstringMatch(i))
+                        continue;
+
+                int distance = boundedEditDistance(&pattern, getIndexedName(i), searchIndex.names[i].fieldLengths[FIELD_NAME], threshold);
+
+                if (distance > threshold)
+                        continue;
+
+                if (searchIndex.numFuzzyMatches == searchIndex.fuzzyMatchesCapacity)
+                {
+                        uint32_t capacity = (searchIndex.fuzzyMatchesCapacity > 0) ? searchIndex.fuzzyMatchesCapacity * 2 : 64;
+                        FuzzyMatch *matches = realloc(searchIndex.fuzzyMatches, capacity * sizeof(FuzzyMatch));
+
+                        if (matches == NULL)
+                                break;
+
+                        searchIndex.fuzzyMatches = matches;
+                        searchIndex.fuzzyMatchesCapacity = capacity;
+                }
+
+                searchIndex.fuzzyMatches[searchIndex.numFuzzyMatches].name = i;
+                searchIndex.fuzzyMatches[searchIndex.numFuzzyMatches].distance = distance;
+                searchIndex.numFuzzyMatches++;
+        }
+
+        if (searchIndex.numFuzzyMatches > 1)
+                qsort(searchIndex.fuzzyMatches, searchIndex.numFuzzyMatches, sizeof(FuzzyMatch), compareFuzzyMatches);
+
+        return true;
+}
+
+// A near miss of the whole name, ranked like a whole-field match less a penalty per edit
+int scoreFuzzyMatch(int distance)
+{
+        int score = MATCH_SCORE + PREFIX_BONUS + WHOLE_FIELD_BONUS - FUZZY_PENALTY * distance;
+
+        return fieldWeights[FIELD_NAME] * (score > 1 ? score : 1);
+}
+
+// Called when a tree is freed, so an index of it isn't mistaken for one of a new tree at the same address
+void invalidateSearchIndex()
+{
+        atomic_fetch_add(&searchTreeGeneration, 1);
+}
+
+void searchLibrary(const char *searchTerm, int threshold, const SearchCallbacks *callbacks)
+{
+        if (searchIndex.names == NULL)
+                return;
+
+        SearchQuery query;
+        parseSearchQuery(searchTerm, &query);
+
+        // Only a search that ran to the end can be refined
+        bool canRefine = searchIndex.hasLastQuery && searchIndex.lastThreshold == threshold &&
+                         query.phraseLength > searchIndex.lastQueryLength &&
+                         strncmp(query.phrase, searchIndex.lastQuery, searchIndex.lastQueryLength) == 0;
+
+        searchIndex.hasLastQuery = false;
+
+        if (query.numWords == 0)
+                return;
+
+        // Names with every word of a longer query also had the words of the shorter one
+        bool found = canRefine ? scoreSubstringCandidates(&query, callbacks->isCancelled)
+                               : findSubstringMatches(&query, callbacks->isCancelled);
+
+        if (!found)
+                return;
+
+        // Exact matches are cheap to find, they can be shown while the rest are scored
+        for (uint32_t m = 0; m < searchIndex.numSubstringMatches; m++)
+                callbacks->addMatch(searchIndex.names[searchIndex.substringMatches[m]].entry, searchIndex.substringScores[m]);
+
+        callbacks->matchesFound();
+
+        memcpy(searchIndex.lastQuery, query.phrase, query.phraseLength + 1);
+        searchIndex.lastQueryLength = query.phraseLength;
+        searchIndex.lastThreshold = threshold;
+        searchIndex.hasLastQuery = true;
+
+        if (!findFuzzyMatches(&query, threshold, callbacks->isCancelled))
+                return;
+
+        for (uint32_t f = 0; f < searchIndex.numFuzzyMatches; f++)
+                callbacks->addMatch(searchIndex.names[searchIndex.fuzzyMatches[f].name].entry, scoreFuzzyMatch(searchIndex.fuzzyMatches[f].distance));
+}
@@ -0,0 +1,39 @@
+#ifndef SEARCHINDEX_H
+#define SEARCHINDEX_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "directorytree.h"
+#include "metadatastore.h"
+
+#ifndef SEARCHCALLBACKS_STRUCT
+#define SEARCHCALLBACKS_STRUCT
+
+typedef struct
+{
+        void (*addMatch)(FileSystemEntry *entry, int score); // Higher is a better match
+        void (*matchesFound)(void); // The exact matches are in, the fuzzy ones follow
+        bool (*isCancelled)(void);  // Polled while scoring, a newer search makes this one pointless
+} SearchCallbacks;
+
+#endif
+
+typedef struct SearchSnapshot SearchSnapshot;
+
+SearchSnapshot *takeSearchSnapshot(FileSystemEntry *root);
+
+bool buildSearchIndex(const SearchSnapshot *snapshot);
+
+void freeSearchSnapshot(SearchSnapshot *snapshot);
+
+void invalidateSearchIndex(void);
+
+void searchLibrary(const char *searchTerm, int threshold, const SearchCallbacks *callbacks);
+
+void freeSearchIndex(void);
+
+#endif
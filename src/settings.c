@@ -35,6 +35,7 @@ AppSettings constructAppSettings(KeyValuePair *pairs, int count)
         strncpy(settings.allowNotifications, "1", sizeof(settings.allowNotifications));
         strncpy(settings.coverAnsi, "0", sizeof(settings.coverAnsi));
         strncpy(settings.visualizerEnabled, "1", sizeof(settings.visualizerEnabled));
+        strncpy(settings.visualizerStereo, "0", sizeof(settings.visualizerStereo));
         strncpy(settings.useProfileColors, "0", sizeof(settings.useProfileColors));
         strncpy(settings.hideLogo, "0", sizeof(settings.hideLogo));
         strncpy(settings.hideHelp, "0", sizeof(settings.hideHelp));
@@ -126,6 +127,14 @@ AppSettings constructAppSettings(KeyValuePair *pairs, int count)
                 {
                         snprintf(settings.visualizerHeight, sizeof(settings.visualizerHeight), "%s", pair->value);
                 }
+                else if (strcmp(stringToLower(pair->key), "visualizerfftsize") == 0)
+                {
+                        snprintf(settings.visualizerFftSize, sizeof(settings.visualizerFftSize), "%s", pair->value);
+                }
+                else if (strcmp(stringToLower(pair->key), "visualizerstereo") == 0)
+                {
+                        snprintf(settings.visualizerStereo, sizeof(settings.visualizerStereo), "%s", pair->value);
+                }
                 else if (strcmp(stringToLower(pair->key), "volumeup") == 0)
                 {
                         snprintf(settings.volumeUp, sizeof(settings.volumeUp), "%s", pair->value);
@@ -377,6 +386,7 @@ void getConfig(AppSettings *settings)
         coverEnabled = (settings->coverEnabled[0] == '1');
         coverAnsi = (settings->coverAnsi[0] == '1');
         visualizerEnabled = (settings->visualizerEnabled[0] == '1');
+        visualizerStereo = (settings->visualizerStereo[0] == '1');
         useProfileColors = (settings->useProfileColors[0] == '1');
         hideLogo = (settings->hideLogo[0] == '1');
         hideHelp = (settings->hideHelp[0] == '1');
@@ -400,6 +410,10 @@ void getConfig(AppSettings *settings)
         if (temp2 > 0)
                 visualizerHeight = temp2;
 
+        temp2 = atoi(settings->visualizerFftSize);
+        if (temp2 > 0)
+                visualizerFftSize = temp2;
+
         int temp3 = atoi(settings->lastVolume);
         if (temp3 >= 0)
                 setVolume(temp3);
@@ -445,6 +459,12 @@ void setConfig(AppSettings *settings)
         {
                 sprintf(settings->visualizerHeight, "%d", visualizerHeight);
         }
+        if (settings->visualizerFftSize[0] == '\0')
+        {
+                sprintf(settings->visualizerFftSize, "%d", visualizerFftSize);
+        }
+        if (settings->visualizerStereo[0] == '\0')
+                visualizerStereo ? c_strcpy(settings->visualizerStereo, sizeof(settings->visualizerStereo), "1") : c_strcpy(settings->visualizerStereo, sizeof(settings->visualizerStereo), "0");
         if (settings->hideLogo[0] == '\0')
                 hideLogo ? c_strcpy(settings->hideLogo, sizeof(settings->hideLogo), "1") : c_strcpy(settings->hideLogo, sizeof(settings->hideLogo), "0");
         if (settings->hideHelp[0] == '\0')
@@ -463,6 +483,8 @@ void setConfig(AppSettings *settings)
         settings->coverAnsi[1] = '\0';
         settings->visualizerEnabled[1] = '\0';
         settings->visualizerHeight[5] = '\0';
+        settings->visualizerFftSize[5] = '\0';
+        settings->visualizerStereo[1] = '\0';
         settings->lastVolume[5] = '\0';
         settings->useProfileColors[1] = '\0';
         settings->allowNotifications[1] = '\0';
@@ -479,6 +501,8 @@ void setConfig(AppSettings *settings)
         fprintf(file, "coverAnsi=%s\n", settings->coverAnsi);
         fprintf(file, "visualizerEnabled=%s\n", settings->visualizerEnabled);
         fprintf(file, "visualizerHeight=%s\n", settings->visualizerHeight);
+        fprintf(file, "visualizerFftSize=%s\n", settings->visualizerFftSize);
+        fprintf(file, "visualizerStereo=%s\n", settings->visualizerStereo);
         fprintf(file, "useProfileColors=%s\n", settings->useProfileColors);
         fprintf(file, "allowNotifications=%s\n", settings->allowNotifications);
         fprintf(file, "hideLogo=%s\n", settings->hideLogo);
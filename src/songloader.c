@@ -11,6 +11,23 @@ songloader.c
 #define MAXPATHLEN 4096
 #endif
 
+#ifndef ALBUM_COLOR_CACHE_SIZE
+#define ALBUM_COLOR_CACHE_SIZE 32
+#endif
+
+typedef struct
+{
+        char key[513];
+        unsigned char red;
+        unsigned char green;
+        unsigned char blue;
+} AlbumColor;
+
+AlbumColor albumColors[ALBUM_COLOR_CACHE_SIZE];
+int numAlbumColors = 0;
+int nextAlbumColor = 0;
+pthread_mutex_t albumColorsMutex = PTHREAD_MUTEX_INITIALIZER;
+
 Cache *tempCache = NULL;
 
 void removeTagPrefix(char *value)
@@ -37,39 +54,38 @@ char *findLargestImageFile(const char *directoryPath, char *largestImageFile, of
 
         while ((entry = readdir(directory)) != NULL)
         {
-                char filePath[MAXPATHLEN];
-
-                if (directoryPath[strlen(directoryPath) - 1] == '/')
+                // Check the name first so only image files need a stat
+                char *extension = strrchr(entry->d_name, '.');
+                if (extension == NULL || (strcasecmp(extension, ".jpg") != 0 && strcasecmp(extension, ".jpeg") != 0 &&
+                                          strcasecmp(extension, ".png") != 0 && strcasecmp(extension, ".gif") != 0))
                 {
-                        snprintf(filePath, sizeof(filePath), "%s%s", directoryPath, entry->d_name);
-                }
-                else
-                {
-                        snprintf(filePath, sizeof(filePath), "%s/%s", directoryPath, entry->d_name);
+                        continue;
                 }
 
-                if (stat(filePath, &fileStats) == -1)
+                if (fstatat(dirfd(directory), entry->d_name, &fileStats, 0) == -1)
                 {
                         continue;
                 }
 
-                if (S_ISREG(fileStats.st_mode))
+                if (S_ISREG(fileStats.st_mode) && fileStats.st_size > *largestFileSize)
                 {
-                        // Check if the entry is an image file and has a larger size than the current largest image file
-                        char *extension = strrchr(entry->d_name, '.');
-                        if (extension != NULL && (strcasecmp(extension, ".jpg") == 0 || strcasecmp(extension, ".jpeg") == 0 ||
-                                                  strcasecmp(extension, ".png") == 0 || strcasecmp(extension, ".gif") == 0))
+                        char filePath[MAXPATHLEN];
+
+                        if (directoryPath[strlen(directoryPath) - 1] == '/')
+                        {
+                                snprintf(filePath, sizeof(filePath), "%s%s", directoryPath, entry->d_name);
+                        }
+                        else
+                        {
+                                snprintf(filePath, sizeof(filePath), "%s/%s", directoryPath, entry->d_name);
+                        }
+
+                        *largestFileSize = fileStats.st_size;
+                        if (largestImageFile != NULL)
                         {
-                                if (fileStats.st_size > *largestFileSize)
-                                {
-                                        *largestFileSize = fileStats.st_size;
-                                        if (largestImageFile != NULL)
-                                        {
-                                                free(largestImageFile);
-                                        }
-                                        largestImageFile = strdup(filePath);
-                                }
+                                free(largestImageFile);
                         }
+                        largestImageFile = strdup(filePath);
                 }
         }
 
@@ -91,6 +107,45 @@ void turnFilePathIntoTitle(const char *filePath, char *title)
         }
 }
 
+AVPacket *findAttachedPicture(AVFormatContext *fmt_ctx)
+{
+        for (unsigned int i = 0; i < fmt_ctx->nb_streams; i++)
+        {
+                if (fmt_ctx->streams[i]->disposition & AV_DISPOSITION_ATTACHED_PIC)
+                        return &fmt_ctx->streams[i]->attached_pic;
+        }
+
+        return NULL;
+}
+
+guint64 hashCover(const AVPacket *pkt)
+{
+        // FNV-1a, 0 is reserved for no cover
+        guint64 hash = 14695981039346656037ULL;
+
+        for (int i = 0; i < pkt->size; i++)
+        {
+                hash ^= pkt->data[i];
+                hash *= 1099511628211ULL;
+        }
+
+        return (hash != 0) ? hash : 1;
+}
+
+int writeCover(const AVPacket *pkt, const char *coverFilePath)
+{
+        FILE *file = fopen(coverFilePath, "wb");
+        if (!file)
+        {
+                fprintf(stderr, "Could not open output file '%s'\n", coverFilePath);
+                return -1;
+        }
+        fwrite(pkt->data, 1, pkt->size, file);
+        fclose(file);
+
+        return 0;
+}
+
 // Extracts metadata, returns -1 if no album cover found, -2 if no file found or if file has errors
 int extractTags(const char *input_file, TagSettings *tag_settings, double *duration, const char *coverFilePath)
 {
@@ -155,45 +210,53 @@ int extractTags(const char *input_file, TagSettings *tag_settings, double *durat
         else
         {
                 *duration = 0.0;
+                avformat_close_input(&fmt_ctx);
                 return -2;
         }
 
-        int stream_index = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
-        if (stream_index < 0)
+        const char *codec = "";
+        int sampleRate = 0;
+
+        int audio_index = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+        if (audio_index >= 0)
         {
-                fprintf(stderr, "Could not find a video stream in the input file\n");
-                avformat_close_input(&fmt_ctx);
-                return -1;
+                AVCodecParameters *codecpar = fmt_ctx->streams[audio_index]->codecpar;
+                codec = avcodec_get_name(codecpar->codec_id);
+                sampleRate = codecpar->sample_rate;
         }
 
-        AVStream *video_stream = fmt_ctx->streams[stream_index];
-        if (video_stream->disposition & AV_DISPOSITION_ATTACHED_PIC)
+        guint64 coverHash = 0;
+        AVPacket *pkt = findAttachedPicture(fmt_ctx);
+
+        if (pkt != NULL)
         {
+                coverHash = hashCover(pkt);
 
-                AVPacket *pkt = &video_stream->attached_pic;
+                if (coverFilePath != NULL && writeCover(pkt, coverFilePath) < 0)
+                        pkt = NULL;
+        }
 
-                FILE *file = fopen(coverFilePath, "wb");
-                if (!file)
-                {
-                        fprintf(stderr, "Could not open output file '%s'\n", coverFilePath);
-                        avformat_close_input(&fmt_ctx);
-                        return -1;
-                }
-                fwrite(pkt->data, 1, pkt->size, file);
-                fclose(file);
+        storeMetadata(input_file, tag_settings, *duration, codec, sampleRate, coverHash);
 
-                avformat_close_input(&fmt_ctx);
-                return 0;
-        }
-        else
-        {
-                avformat_close_input(&fmt_ctx);
+        avformat_close_input(&fmt_ctx);
+
+        return (pkt != NULL) ? 0 : -1;
+}
+
+// Extracts only the embedded cover, for tracks whose tags are already known
+int extractCover(const char *input_file, const char *coverFilePath)
+{
+        AVFormatContext *fmt_ctx = NULL;
+
+        if (avformat_open_input(&fmt_ctx, input_file, NULL, NULL) < 0)
                 return -1;
-        }
+
+        AVPacket *pkt = findAttachedPicture(fmt_ctx);
+        int result = (pkt != NULL) ? writeCover(pkt, coverFilePath) : -1;
 
         avformat_close_input(&fmt_ctx);
 
-        return 0;
+        return result;
 }
 
 static guint track_counter = 0;
@@ -206,9 +269,116 @@ gchar *generateTrackId()
         return trackId;
 }
 
+bool getAlbumKey(SongData *songdata, char *key, size_t size)
+{
+        TagSettings *tags = songdata->metadata;
+
+        if (tags == NULL || tags->album[0] == '\0')
+                return false;
+
+        const char *artist = (tags->album_artist[0] != '\0') ? tags->album_artist : tags->artist;
+
+        snprintf(key, size, "%s\t%s", artist, tags->album);
+
+        return true;
+}
+
+bool findAlbumColor(const char *key, SongData *songdata)
+{
+        bool found = false;
+
+        pthread_mutex_lock(&albumColorsMutex);
+
+        for (int i = 0; i < numAlbumColors; i++)
+        {
+                if (strcmp(albumColors[i].key, key) == 0)
+                {
+                        songdata->red = albumColors[i].red;
+                        songdata->green = albumColors[i].green;
+                        songdata->blue = albumColors[i].blue;
+                        found = true;
+                        break;
+                }
+        }
+
+        pthread_mutex_unlock(&albumColorsMutex);
+
+        return found;
+}
+
+void storeAlbumColor(const char *key, SongData *songdata)
+{
+        pthread_mutex_lock(&albumColorsMutex);
+
+        // Replace the oldest entry when full
+        AlbumColor *entry = &albumColors[nextAlbumColor];
+        nextAlbumColor = (nextAlbumColor + 1) % ALBUM_COLOR_CACHE_SIZE;
+
+        if (numAlbumColors < ALBUM_COLOR_CACHE_SIZE)
+                numAlbumColors++;
+
+        c_strcpy(entry->key, sizeof(entry->key), key);
+        entry->red = songdata->red;
+        entry->green = songdata->green;
+        entry->blue = songdata->blue;
+
+        pthread_mutex_unlock(&albumColorsMutex);
+}
+
 void loadColor(SongData *songdata)
 {
+        char key[sizeof(((AlbumColor *)0)->key)];
+        bool hasKey = getAlbumKey(songdata, key, sizeof(key));
+
+        // Songs from the same album share a cover, so they share its color too
+        if (hasKey && findAlbumColor(key, songdata))
+                return;
+
         getCoverColor(songdata->cover, &(songdata->red), &(songdata->green), &(songdata->blue));
+
+        if (hasKey)
+                storeAlbumColor(key, songdata);
+}
+
+void *coverLoaderThread(void *arg)
+{
+        SongData *songdata = (SongData *)arg;
+
+        FIBITMAP *bitmap = getBitmap(songdata->coverArtPath);
+
+        if (bitmap != NULL)
+        {
+                // Only keep as many pixels as the terminal can show
+                int maxSize = getMaxCoverSize();
+
+                if ((int)FreeImage_GetWidth(bitmap) > maxSize || (int)FreeImage_GetHeight(bitmap) > maxSize)
+                {
+                        FIBITMAP *scaled = FreeImage_MakeThumbnail(bitmap, maxSize, TRUE);
+
+                        if (scaled != NULL)
+                        {
+                                FreeImage_Unload(bitmap);
+                                bitmap = scaled;
+                        }
+                }
+
+                songdata->cover = bitmap;
+                loadColor(songdata);
+        }
+
+        atomic_store_explicit(&songdata->coverLoaded, true, memory_order_release);
+
+        return NULL;
+}
+
+bool isCoverLoaded(SongData *songdata)
+{
+        return atomic_load_explicit(&songdata->coverLoaded, memory_order_acquire);
+}
+
+FIBITMAP *getCover(SongData *songdata)
+{
+        return isCoverLoaded(songdata) ? songdata->cover : NULL;
 }
 
 void loadMetaData(SongData *songdata)
@@ -217,7 +387,15 @@ void loadMetaData(SongData *songdata)
 
         songdata->metadata = malloc(sizeof(TagSettings));
         generateTempFilePath(songdata->coverArtPath, "cover", ".jpg");
-        int res = extractTags(songdata->filePath, songdata->metadata, &songdata->duration, songdata->coverArtPath);
+
+        guint64 coverHash = 0;
+        int res;
+
+        // Known tracks only need their cover, if they have one embedded
+        if (lookupMetadata(songdata->filePath, songdata->metadata, &songdata->duration, &coverHash))
+                res = (coverHash != 0) ? extractCover(songdata->filePath, songdata->coverArtPath) : -1;
+        else
+                res = extractTags(songdata->filePath, songdata->metadata, &songdata->duration, songdata->coverArtPath);
 
         if (res == -2)
         {
@@ -241,7 +419,11 @@ void loadMetaData(SongData *songdata)
                 addToCache(tempCache, songdata->coverArtPath);
         }
 
-        songdata->cover = getBitmap(songdata->coverArtPath);
+        // Decode the cover in the background so playback doesn't wait for it
+        if (pthread_create(&songdata->coverThread, NULL, coverLoaderThread, songdata) == 0)
+                songdata->coverThreadStarted = true;
+        else
+                coverLoaderThread(songdata);
 }
 
 SongData *loadSongData(char *filePath)
@@ -257,10 +439,11 @@ SongData *loadSongData(char *filePath)
         songdata->blue = 150;
         songdata->metadata = NULL;
         songdata->cover = NULL;
+        songdata->coverThreadStarted = false;
+        atomic_init(&songdata->coverLoaded, false);
         songdata->duration = 0.0;
         c_strcpy(songdata->filePath, sizeof(songdata->filePath), filePath);
         loadMetaData(songdata);
-        loadColor(songdata);
         return songdata;
 }
 
@@ -271,6 +454,12 @@ void unloadSongData(SongData **songdata)
 
         SongData *data = *songdata;
 
+        if (data->coverThreadStarted)
+        {
+                pthread_join(data->coverThread, NULL);
+                data->coverThreadStarted = false;
+        }
+
         if (data->cover != NULL)
         {
                 FreeImage_Unload(data->cover);
@@ -7,6 +7,7 @@
 #include "cache.h"
 #include "chafafunc.h"
 #include "file.h"
+#include "metadatastore.h"
 #include "sound.h"
 #include "soundcommon.h"
 #include "utils.h"
@@ -53,6 +54,9 @@ typedef struct
         unsigned char blue;
         TagSettings *metadata;
         FIBITMAP *cover;
+        pthread_t coverThread;
+        bool coverThreadStarted;
+        _Atomic bool coverLoaded;
         double duration;
         bool hasErrors;
 } SongData;
@@ -61,5 +65,8 @@ typedef struct
 
 extern Cache *tempCache;
 
+int extractTags(const char *input_file, TagSettings *tag_settings, double *duration, const char *coverFilePath);
 SongData *loadSongData(char *filePath);
 void unloadSongData(SongData **songdata);
+bool isCoverLoaded(SongData *songdata);
+FIBITMAP *getCover(SongData *songdata);
@@ -44,65 +44,23 @@ ma_result initFirstDatasource(AudioData *pAudioData, UserData *pUserData)
         pAudioData->currentPCMFrame = 0;
         pAudioData->restart = false;
 
-        if (hasBuiltinDecoder(filePath))
-        {
-                int result = prepareNextDecoder(filePath);
-                if (result < 0)
-                        return -1;
-                ma_decoder *first = getFirstDecoder();
-                pAudioData->format = first->outputFormat;
-                pAudioData->channels = first->outputChannels;
-                pAudioData->sampleRate = first->outputSampleRate;
-                ma_data_source_get_length_in_pcm_frames(first, &pAudioData->totalFrames);
-        }
-        else if (endsWith(filePath, "opus"))
-        {
-                int result = prepareNextOpusDecoder(filePath);
-                if (result < 0)
-                        return -1;
-                ma_libopus *first = getFirstOpusDecoder();
-                ma_channel channelMap[MA_MAX_CHANNELS];
-                ma_libopus_ds_get_data_format(first, &pAudioData->format, &pAudioData->channels, &pAudioData->sampleRate, channelMap, MA_MAX_CHANNELS);
-                ma_data_source_get_length_in_pcm_frames(first, &pAudioData->totalFrames);
-                ma_data_source_base *base = (ma_data_source_base *)first;
-                base->pCurrent = first;
-                first->pReadSeekTellUserData = pAudioData;
-        }
-        else if (endsWith(filePath, "ogg"))
-        {
-                int result = prepareNextVorbisDecoder(filePath);
-                if (result < 0)
-                        return -1;
-                ma_libvorbis *first = getFirstVorbisDecoder();
-                ma_channel channelMap[MA_MAX_CHANNELS];
-                ma_libvorbis_ds_get_data_format(first, &pAudioData->format, &pAudioData->channels, &pAudioData->sampleRate, channelMap, MA_MAX_CHANNELS);
-                ma_data_source_get_length_in_pcm_frames(first, &pAudioData->totalFrames);
-                ma_data_source_base *base = (ma_data_source_base *)first;
-                base->pCurrent = first;
-                first->pReadSeekTellUserData = pAudioData;
-        }
-        else if (endsWith(filePath, "m4a") || endsWith(filePath, "aac"))
-        {
-                int result = prepareNextM4aDecoder(filePath);
-                if (result < 0)
-                        return -1;
-                m4a_decoder *first = getFirstM4aDecoder();
-                ma_channel channelMap[MA_MAX_CHANNELS];
-                m4a_decoder_ds_get_data_format(first, &pAudioData->format, &pAudioData->channels, &pAudioData->sampleRate, channelMap, MA_MAX_CHANNELS);
-                ma_data_source_get_length_in_pcm_frames(first, &pAudioData->totalFrames);
-                ma_data_source_base *base = (ma_data_source_base *)first;
-                base->pCurrent = first;
-                first->pReadSeekTellUserData = pAudioData;
-        }
-        else
-        {
+        int result = prepareNextDecoder(filePath);
+
+        if (result < 0)
                 return MA_ERROR;
-        }
+
+        ma_data_source *first = getFirstDecoder();
+
+        if (first == NULL)
+                return MA_ERROR;
+
+        ma_data_source_get_data_format(first, &pAudioData->format, &pAudioData->channels, &pAudioData->sampleRate, NULL, 0);
+        ma_data_source_get_length_in_pcm_frames(first, &pAudioData->totalFrames);
 
         return MA_SUCCESS;
 }
 
-int createDevice(UserData *userData, ma_device *device, ma_context *context, ma_data_source_vtable *vtable, ma_device_data_proc callback)
+int createDevice(UserData *userData, ma_device *device, ma_context *context, ma_data_source_vtable *vtable)
 {
         ma_result result;
 
@@ -117,147 +75,26 @@ int createDevice(UserData *userData, ma_device *device, ma_context *context, ma_
         deviceConfig.playback.format = audioData.format;
         deviceConfig.playback.channels = audioData.channels;
         deviceConfig.sampleRate = audioData.sampleRate;
-        deviceConfig.dataCallback = callback;
+        deviceConfig.dataCallback = on_audio_frames;
         deviceConfig.pUserData = &audioData;
 
         result = ma_device_init(context, &deviceConfig, device);
         if (result != MA_SUCCESS)
                 return -1;
 
-        setVolume(getCurrentVolume());
-
-        result = ma_device_start(device);
-        if (result != MA_SUCCESS)
-                return -1;
-        emitStringPropertyChanged("PlaybackStatus", "Playing");
-
-        return 0;        
-}
-
-int builtin_createAudioDevice(UserData *userData, ma_device *device, ma_context *context, ma_data_source_vtable *vtable)
-{
-        return createDevice(userData, device, context, vtable, builtin_on_audio_frames);
-}
-
-int vorbis_createAudioDevice(UserData *userData, ma_device *device, ma_context *context)
-{
-        ma_result result;
-
-        result = initFirstDatasource(&audioData, userData);
-        if (result != MA_SUCCESS)
-        {
-                printf("\n\nFailed to initialize ogg vorbis file.\n");
-                return -1;
-        }
-        ma_libvorbis *vorbis = getFirstVorbisDecoder();
-        ma_device_config deviceConfig = ma_device_config_init(ma_device_type_playback);
-
-        deviceConfig.playback.format = vorbis->format;
-        deviceConfig.playback.channels = audioData.channels;
-        deviceConfig.sampleRate = audioData.sampleRate;
-        deviceConfig.dataCallback = vorbis_on_audio_frames;
-        deviceConfig.pUserData = vorbis;
-
-        result = ma_device_init(context, &deviceConfig, device);
-        if (result != MA_SUCCESS)
-        {
-                printf("\n\nFailed to initialize miniaudio device.\n");
-                return -1;
-        }
-
-        setVolume(getCurrentVolume());
-
-        result = ma_device_start(device);
-        if (result != MA_SUCCESS)
-        {
-                printf("\n\nFailed to start miniaudio device.\n");
-                return -1;
-        }
-        emitStringPropertyChanged("PlaybackStatus", "Playing");
-
-        return 0;        
-}
-
-int m4a_createAudioDevice(UserData *userData, ma_device *device, ma_context *context)
-{
-        ma_result result;
-
-        result = initFirstDatasource(&audioData, userData);
-        if (result != MA_SUCCESS)
-        {
-                printf("\n\nFailed to initialize m4a file.\n");
-                return -1;
-        }        
-        m4a_decoder *decoder = getFirstM4aDecoder();
-        ma_device_config deviceConfig = ma_device_config_init(ma_device_type_playback);
-
-        deviceConfig.playback.format = decoder->format;
-        deviceConfig.playback.channels = audioData.channels;
-        deviceConfig.sampleRate = audioData.sampleRate;
-        deviceConfig.dataCallback = m4a_on_audio_frames;
-        deviceConfig.pUserData = decoder;
-
-        result = ma_device_init(context, &deviceConfig, device);
-        if (result != MA_SUCCESS)
-        {
-                printf("\n\nFailed to initialize miniaudio device.\n");
+        if (setDecodeSource(decoder_read_pcm_frames, &audioData.base, audioData.format, audioData.channels, audioData.sampleRate) < 0)
                 return -1;
-        }
 
         setVolume(getCurrentVolume());
 
         result = ma_device_start(device);
-
         if (result != MA_SUCCESS)
-        {
-                printf("\n\nFailed to start miniaudio device.\n");
                 return -1;
-        }
         emitStringPropertyChanged("PlaybackStatus", "Playing");
 
         return 0;        
 }
 
-int opus_createAudioDevice(UserData *userData, ma_device *device, ma_context *context)
-{
-        ma_result result;
-
-        result = initFirstDatasource(&audioData, userData);
-        if (result != MA_SUCCESS)
-        {
-                printf("\n\nFailed to initialize opus file.\n");
-                return -1;
-        }        
-        ma_libopus *opus = getFirstOpusDecoder();
-
-        ma_device_config deviceConfig = ma_device_config_init(ma_device_type_playback);
-
-        deviceConfig.playback.format = opus->format;
-        deviceConfig.playback.channels = audioData.channels;
-        deviceConfig.sampleRate = audioData.sampleRate;
-        deviceConfig.dataCallback = opus_on_audio_frames;
-        deviceConfig.pUserData = opus;
-
-        result = ma_device_init(context, &deviceConfig, device);
-        if (result != MA_SUCCESS)
-        {
-                printf("\n\nFailed to initialize miniaudio device.\n");
-                return -1;
-        }
-
-        setVolume(getCurrentVolume());
-
-        result = ma_device_start(device);
-        if (result != MA_SUCCESS)
-        {
-                printf("\n\nFailed to start miniaudio device.\n");
-                return -1;
-        }
-        emitStringPropertyChanged("PlaybackStatus", "Playing");
-
-        return 0;
-}
-
 bool validFilePath(char *filePath)
 {
         if (filePath == NULL || filePath[0] == '\0' || filePath[0] == '\r')
@@ -315,228 +152,54 @@ int switchAudioImplementation()
 
         tryAgain = false;
 
-        if (hasBuiltinDecoder(filePath))
-        {
-                ma_uint32 sampleRate = 0;
-                ma_uint32 channels = 0;
-                ma_format format = ma_format_unknown;
-                ma_decoder *decoder = getCurrentBuiltinDecoder();
-
-                getFileInfo(filePath, &sampleRate, &channels, &format);
-
-                bool sameFormat = (decoder != NULL && (sampleRate == decoder->outputSampleRate &&
-                                                       channels == decoder->outputChannels &&
-                                                       format == decoder->outputFormat));
-
-                if (isRepeatEnabled() || !(sameFormat && currentImplementation == BUILTIN))
-                {
-                        setImplSwitchReached();
-
-                        pthread_mutex_lock(&dataSourceMutex);
-
-                        setCurrentImplementationType(BUILTIN);
-
-                        cleanupPlaybackDevice();
-
-                        resetDecoders();
-                        resetVorbisDecoders();
-                        resetM4aDecoders();
-                        resetOpusDecoders();
-                        resetAudioBuffer();
-
-                        int result = builtin_createAudioDevice(&userData, getDevice(), &context, &builtin_file_data_source_vtable);
-
-                        if (result < 0)
-                        {
-                                setCurrentImplementationType(NONE);
-                                setImplSwitchNotReached();
-                                setEOFReached();
-                                free(filePath);
-                                pthread_mutex_unlock(&dataSourceMutex);                                
-                                return -1;
-                        }
-
-                        pthread_mutex_unlock(&dataSourceMutex);
+        const DecoderBackend *backend = getDecoderBackend(filePath);
 
-                        setImplSwitchNotReached();
-                }
-        }
-        else if (endsWith(filePath, "opus"))
+        if (backend == NULL)
         {
-                ma_uint32 sampleRate;
-                ma_uint32 channels;
-                ma_format format;
-                ma_channel channelMap[MA_MAX_CHANNELS];
-
-                ma_uint32 nSampleRate;
-                ma_uint32 nChannels;
-                ma_format nFormat;
-                ma_channel nChannelMap[MA_MAX_CHANNELS];
-                ma_libopus *decoder = getCurrentOpusDecoder();
-
-                getOpusFileInfo(filePath, &format, &channels, &sampleRate, channelMap);
-
-                if (decoder != NULL)
-                        ma_libopus_ds_get_data_format(decoder, &nFormat, &nChannels, &nSampleRate, nChannelMap, MA_MAX_CHANNELS);
-
-                bool sameFormat = (decoder != NULL && (format == decoder->format &&
-                                                       channels == nChannels &&
-                                                       sampleRate == nSampleRate));
-
-                if (isRepeatEnabled() || !(sameFormat && currentImplementation == OPUS))
-                {
-                        setImplSwitchReached();
-
-                        pthread_mutex_lock(&dataSourceMutex);
-
-                        setCurrentImplementationType(OPUS);
-
-                        cleanupPlaybackDevice();
-
-                        resetDecoders();
-                        resetVorbisDecoders();
-                        resetM4aDecoders();
-                        resetOpusDecoders();
-                        resetAudioBuffer();
-
-                        int result = opus_createAudioDevice(&userData, getDevice(), &context);
-
-                        if (result < 0)
-                        {
-                                setCurrentImplementationType(NONE);
-                                setImplSwitchNotReached();
-                                setEOFReached();
-                                free(filePath);
-                                pthread_mutex_unlock(&dataSourceMutex);                                
-                                return -1;
-                        }
-
-                        pthread_mutex_unlock(&dataSourceMutex);
-
-                        setImplSwitchNotReached();
-                }
+                free(filePath);
+                return -1;
         }
-        else if (endsWith(filePath, "ogg"))
-        {
-                ma_uint32 sampleRate;
-                ma_uint32 channels;
-                ma_format format;
-                ma_channel channelMap[MA_MAX_CHANNELS];
-
-                ma_uint32 nSampleRate;
-                ma_uint32 nChannels;
-                ma_format nFormat;
-                ma_channel nChannelMap[MA_MAX_CHANNELS];
-                ma_libvorbis *decoder = getCurrentVorbisDecoder();
 
-                getVorbisFileInfo(filePath, &format, &channels, &sampleRate, channelMap);
-
-                if (decoder != NULL)
-                        ma_libvorbis_ds_get_data_format(decoder, &nFormat, &nChannels, &nSampleRate, nChannelMap, MA_MAX_CHANNELS);
-
-                bool sameFormat = (decoder != NULL && (format == decoder->format &&
-                                                       channels == nChannels &&
-                                                       sampleRate == nSampleRate));
+        if (strcmp(backend->name, "m4a") == 0 && check_aac_codec_support() < 0)
+        {
+                free(filePath);
+                printf("\n\nUnable to find AAC codec. If you have the free version of FFmpeg, there might be no AAC/M4A file support.\n");
+                exit(0);
+        }
 
-                if (isRepeatEnabled() || !(sameFormat && currentImplementation == VORBIS))
-                {
-                        setImplSwitchReached();
+        // The next track has already been chained to the current one, converted to the device format if needed
+        bool sameTrack = (getCurrentDecoder() != NULL && strcmp(getCurrentDecoderFilePath(), filePath) == 0);
 
-                        pthread_mutex_lock(&dataSourceMutex);
+        if (isRepeatEnabled() || !(sameTrack && currentImplementation == DECODER))
+        {
+                setImplSwitchReached();
 
-                        setCurrentImplementationType(VORBIS);
+                pthread_mutex_lock(&dataSourceMutex);
 
-                        cleanupPlaybackDevice();
+                waitForDecodedFramesToPlay();
 
-                        resetDecoders();
-                        resetVorbisDecoders();
-                        resetM4aDecoders();
-                        resetOpusDecoders();
-                        resetAudioBuffer();
+                setCurrentImplementationType(DECODER);
 
-                        int result = vorbis_createAudioDevice(&userData, getDevice(), &context);
+                cleanupPlaybackDevice();
 
-                        if (result < 0)
-                        {
-                                setCurrentImplementationType(NONE);
-                                setImplSwitchNotReached();
-                                setEOFReached();
-                                free(filePath);
-                                pthread_mutex_unlock(&dataSourceMutex);                                
-                                return -1;
-                        }
+                resetDecoders();
+                resetAnalysisTap();
 
-                        pthread_mutex_unlock(&dataSourceMutex);
+                int result = createDevice(&userData, getDevice(), &context, &builtin_file_data_source_vtable);
 
-                        setImplSwitchNotReached();
-                }
-        }
-        else if (endsWith(filePath, "m4a") || endsWith(filePath, "aac"))
-        {
-                if (check_aac_codec_support() < 0)
+                if (result < 0)
                 {
+                        setCurrentImplementationType(NONE);
+                        setImplSwitchNotReached();
+                        setEOFReached();
                         free(filePath);
-                        printf("\n\nUnable to find AAC codec. If you have the free version of FFmpeg, there might be no AAC/M4A file support.\n");
-                        exit(0);
+                        pthread_mutex_unlock(&dataSourceMutex);
+                        return -1;
                 }
 
-                ma_uint32 sampleRate;
-                ma_uint32 channels;
-                ma_format format;
-                ma_channel channelMap[MA_MAX_CHANNELS];
-
-                ma_uint32 nSampleRate;
-                ma_uint32 nChannels;
-                ma_format nFormat;
-                ma_channel nChannelMap[MA_MAX_CHANNELS];
-                m4a_decoder *decoder = getCurrentM4aDecoder();
-
-                getM4aFileInfo(filePath, &format, &channels, &sampleRate, channelMap);
-
-                if (decoder != NULL)
-                        m4a_decoder_ds_get_data_format(decoder, &nFormat, &nChannels, &nSampleRate, nChannelMap, MA_MAX_CHANNELS);
-
-                bool sameFormat = (decoder != NULL && (format == decoder->format &&
-                                                       channels == nChannels &&
-                                                       sampleRate == nSampleRate));
-
-                if (isRepeatEnabled() || !(sameFormat && currentImplementation == M4A))
-                {
-                        setImplSwitchReached();
-
-                        pthread_mutex_lock(&dataSourceMutex);
-
-                        setCurrentImplementationType(M4A);
-
-                        cleanupPlaybackDevice();
-
-                        resetDecoders();
-                        resetVorbisDecoders();
-                        resetM4aDecoders();
-                        resetOpusDecoders();
-                        resetAudioBuffer();
-
-                        int result = m4a_createAudioDevice(&userData, getDevice(), &context);
-
-                        if (result < 0)
-                        {
-                                setCurrentImplementationType(NONE);
-                                setImplSwitchNotReached();
-                                setEOFReached();
-                                free(filePath);
-                                pthread_mutex_unlock(&dataSourceMutex);                                
-                                return -1;
-                        }
+                pthread_mutex_unlock(&dataSourceMutex);
 
-                        pthread_mutex_unlock(&dataSourceMutex);
-
-                        setImplSwitchNotReached();
-                }
-        }
-        else
-        {
-                free(filePath);
-                return -1;
+                setImplSwitchNotReached();
         }
 
         free(filePath);
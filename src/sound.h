@@ -56,12 +56,6 @@ extern bool isContextInitialized;
 
 int prepareNextDecoder(char *filepath);
 
-int prepareNextOpusDecoder(char *filepath);
-
-int prepareNextVorbisDecoder(char *filepath);
-
-int prepareNextM4aDecoder(char *filepath);
-
 void setDecoders(bool usingA, char *filePath);
 
 int createAudioDevice(UserData *userData);
@@ -4,6 +4,7 @@
 soundbuiltin.c
 
  Functions related to miniaudio implementation for miniaudio built-in decoders (flac, wav and mp3)
+ and the data source the audio device reads from
 
 */
 
@@ -21,12 +22,12 @@ static ma_result builtin_file_data_source_seek(ma_data_source *pDataSource, ma_u
 {
         AudioData *audioData = (AudioData *)pDataSource;
 
-        if (getCurrentBuiltinDecoder() == NULL)
+        if (getCurrentDecoder() == NULL)
         {
                 return MA_INVALID_ARGS;
         }
 
-        ma_result result = ma_decoder_seek_to_pcm_frame(getCurrentBuiltinDecoder(), frameIndex);
+        ma_result result = ma_data_source_seek_to_pcm_frame(getCurrentDecoder(), frameIndex);
 
         if (result == MA_SUCCESS)
         {
@@ -63,12 +64,12 @@ static ma_result builtin_file_data_source_get_length(ma_data_source *pDataSource
         (void)pDataSource;
         ma_uint64 totalFrames = 0;
 
-        if (getCurrentBuiltinDecoder() == NULL)
+        if (getCurrentDecoder() == NULL)
         {
                 return MA_INVALID_ARGS;
         }
 
-        ma_result result = ma_decoder_get_length_in_pcm_frames(getCurrentBuiltinDecoder(), &totalFrames);
+        ma_result result = ma_data_source_get_length_in_pcm_frames(getCurrentDecoder(), &totalFrames);
 
         if (result != MA_SUCCESS)
         {
@@ -99,113 +100,35 @@ ma_data_source_vtable builtin_file_data_source_vtable = {
     0 // flags
 };
 
-void builtin_read_pcm_frames(ma_data_source *pDataSource, void *pFramesOut, ma_uint64 frameCount, ma_uint64 *pFramesRead)
+ma_result builtin_open_decoder(const char *filePath, ma_data_source **ppDataSource)
 {
-        AudioData *audioData = (AudioData *)pDataSource;
-        ma_uint64 framesRead = 0;
+        ma_decoder *decoder = (ma_decoder *)malloc(sizeof(ma_decoder));
 
-        while (framesRead < frameCount)
-        {
-                ma_uint64 remainingFrames = frameCount - framesRead;
-
-                if (pthread_mutex_trylock(&dataSourceMutex) != 0)
-                {
-                        return;
-                }
-
-                if (isImplSwitchReached() || audioData == NULL)
-                {
-                        pthread_mutex_unlock(&dataSourceMutex);
-                        return;
-                }
-
-                if (audioData->switchFiles)
-                {
-                        executeSwitch(audioData);
-                        pthread_mutex_unlock(&dataSourceMutex);
-                        break;
-                }
-
-                ma_decoder *decoder = getCurrentBuiltinDecoder();
-
-                if ((getCurrentImplementationType() != BUILTIN && !isSkipToNext()))
-                {
-                        pthread_mutex_unlock(&dataSourceMutex);                        
-                        return;
-                }
-
-                if (audioData->totalFrames == 0)
-                        ma_data_source_get_length_in_pcm_frames(decoder, &audioData->totalFrames);
-
-                if (isSeekRequested())
-                {
-                        ma_uint64 totalFrames = audioData->totalFrames;
-                        ma_uint64 seekPercent = getSeekPercentage();
-                        if (seekPercent >= 100.0)
-                                seekPercent = 100.0;
-                        ma_uint64 targetFrame = (totalFrames * seekPercent) / 100;
-                        ma_result seekResult = ma_decoder_seek_to_pcm_frame(decoder, targetFrame);
-
-                        if (seekResult != MA_SUCCESS)
-                        {
-                                setSeekRequested(false);
-                                pthread_mutex_unlock(&dataSourceMutex);
-                                return;
-                        }
-
-                        setSeekRequested(false);
-                }
-
-                ma_uint64 framesToRead = 0;
-                ma_decoder *firstDecoder = getFirstDecoder();
-                ma_uint64 cursor = 0;
-                ma_result result;
-
-                if (firstDecoder == NULL)
-                {                       
-                        pthread_mutex_unlock(&dataSourceMutex);
-                        return;
-                }
-
-                result = ma_data_source_read_pcm_frames(firstDecoder, (ma_int32 *)pFramesOut + framesRead * audioData->channels, remainingFrames, &framesToRead);
-                ma_data_source_get_cursor_in_pcm_frames(decoder, &cursor);
-
-                if (((audioData->totalFrames != 0 && cursor != 0 && cursor >= audioData->totalFrames) || framesToRead == 0 || isSkipToNext() || result != MA_SUCCESS) && !isEOFReached())
-                {
-                        activateSwitch(audioData);
-                        pthread_mutex_unlock(&dataSourceMutex);
-                        continue;
-                }
-
-                framesRead += framesToRead;
-                setBufferSize(framesToRead);
-
-                pthread_mutex_unlock(&dataSourceMutex);
-        }
+        if (decoder == NULL)
+                return MA_OUT_OF_MEMORY;
 
-        ma_int32 *audioBuffer = getAudioBuffer();
-        if (audioBuffer == NULL)
+        ma_result result = ma_decoder_init_file(filePath, NULL, decoder);
+
+        if (result != MA_SUCCESS)
         {
-                audioBuffer = malloc(sizeof(ma_int32) * MAX_BUFFER_SIZE);
-                if (audioBuffer == NULL)
-                {
-                        return;
-                }
+                free(decoder);
+                return result;
         }
 
-        memcpy(audioBuffer, pFramesOut, sizeof(ma_int32) * framesRead);
-        setAudioBuffer(audioBuffer);
+        *ppDataSource = decoder;
 
-        if (pFramesRead != NULL)
-        {
-                *pFramesRead = framesRead;
-        }
+        return MA_SUCCESS;
 }
 
-void builtin_on_audio_frames(ma_device *pDevice, void *pFramesOut, const void *pFramesIn, ma_uint32 frameCount)
+void builtin_close_decoder(ma_data_source *pDataSource)
 {
-        AudioData *pDataSource = (AudioData *)pDevice->pUserData;
-        ma_uint64 framesRead = 0;
-        builtin_read_pcm_frames(&pDataSource->base, pFramesOut, frameCount, &framesRead);
-        (void)pFramesIn;
+        ma_decoder_uninit((ma_decoder *)pDataSource);
+        free(pDataSource);
 }
+
+const DecoderBackend builtinDecoderBackend = {
+    "builtin",
+    {"wav", "flac", "mp3", NULL},
+    true,
+    builtin_open_decoder,
+    builtin_close_decoder};
@@ -8,8 +8,8 @@
 
 extern ma_data_source_vtable builtin_file_data_source_vtable;
 
-void builtin_read_pcm_frames(ma_data_source *pDataSource, void *pFramesOut, ma_uint64 frameCount, ma_uint64 *pFramesRead);
+ma_result builtin_open_decoder(const char *filePath, ma_data_source **ppDataSource);
 
-void builtin_on_audio_frames(ma_device *pDevice, void *pFramesOut, const void *pFramesIn, ma_uint32 frameCount);
+void builtin_close_decoder(ma_data_source *pDataSource);
 
 #endif
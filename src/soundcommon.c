@@ -10,6 +10,26 @@ soundcommon.c
 
 #define MAX_DECODERS 2
 
+#ifndef DECODE_CHUNK_FRAMES
+#define DECODE_CHUNK_FRAMES 1024
+#endif
+
+#ifndef RING_BUFFER_MILLISECONDS
+#define RING_BUFFER_MILLISECONDS 100
+#endif
+
+#ifndef DECODE_IDLE_MILLISECONDS
+#define DECODE_IDLE_MILLISECONDS 2
+#endif
+
+#ifndef ANALYSIS_TAP_FRAMES
+#define ANALYSIS_TAP_FRAMES 16384 // Must be a power of two, with room for the largest FFT and a device period
+#endif
+
+#ifndef CONVERTER_INPUT_FRAMES
+#define CONVERTER_INPUT_FRAMES 1024
+#endif
+
 bool allowNotifications = true;
 bool repeatEnabled = false;
 bool shuffleEnabled = false;
@@ -29,9 +49,7 @@ _Atomic bool readingFrames = false;
 pthread_mutex_t dataSourceMutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t switchMutex = PTHREAD_MUTEX_INITIALIZER;
 ma_device device = {0};
-ma_int32 *audioBuffer = NULL;
 AudioData audioData;
-int bufSize;
 ma_event switchAudioImpl;
 enum AudioImplementation currentImplementation = NONE;
 
@@ -44,20 +62,28 @@ double elapsedSeconds = 0.0;
 
 int soundVolume = 100;
 
-ma_decoder *firstDecoder;
-ma_decoder *currentDecoder;
-
-ma_decoder *decoders[MAX_DECODERS];
-ma_libopus *opusDecoders[MAX_DECODERS];
-ma_libopus *firstOpusDecoder;
-ma_libvorbis *vorbisDecoders[MAX_DECODERS];
-ma_libvorbis *firstVorbisDecoder;
-m4a_decoder *m4aDecoders[MAX_DECODERS];
-m4a_decoder *firstM4aDecoder;
+Decoder firstDecoder;
+Decoder decoders[MAX_DECODERS];
 int decoderIndex = -1;
-int m4aDecoderIndex = -1;
-int opusDecoderIndex = -1;
-int vorbisDecoderIndex = -1;
+
+// Decoded audio is produced by the decode thread and consumed by the device callback
+ma_pcm_rb pcmRingBuffer;
+bool pcmRingBufferInitialized = false;
+pthread_t decodeThread;
+_Atomic bool decodeThreadRunning = false;
+pthread_mutex_t decodeMutex = PTHREAD_MUTEX_INITIALIZER;
+decode_pcm_frames_proc decodeProc = NULL;
+ma_data_source *decodeDataSource = NULL;
+
+// Counts of frames through pcmRingBuffer, so a seek or skip drops exactly the frames decoded before it
+_Atomic ma_uint64 decodedFramesCommitted = 0;
+_Atomic ma_uint64 discardDecodedFramesUntil = 0;
+ma_uint64 decodedFramesConsumed = 0; // Only touched by the device callback
+
+// The last frames played, written by the device callback and read by the visualizer
+float analysisTap[ANALYSIS_TAP_FRAMES][2];
+_Atomic ma_uint64 analysisTapWritten = 0;
+_Atomic ma_uint32 analysisTapMaxBlock = 0; // The most frames the callback has stored in one go
 
 #ifdef USE_LIBNOTIFY
 NotifyNotification *previous_notification;
@@ -81,804 +107,572 @@ void setCurrentImplementationType(enum AudioImplementation value)
         currentImplementation = value;
 }
 
-ma_decoder *getFirstDecoder()
-{
-        return firstDecoder;
-}
-
-ma_decoder *getCurrentBuiltinDecoder()
+ma_result openOpusDecoder(const char *filePath, ma_data_source **ppDataSource)
 {
-        if (decoderIndex == -1)
-                return getFirstDecoder();
-        else
-                return decoders[decoderIndex];
-}
+        ma_libopus *decoder = (ma_libopus *)malloc(sizeof(ma_libopus));
 
-void switchDecoder()
-{
-        if (decoderIndex == -1)
-                decoderIndex = 0;
-        else
-                decoderIndex = 1 - decoderIndex;
-}
+        if (decoder == NULL)
+                return MA_OUT_OF_MEMORY;
 
-void resetDecoders()
-{
-        decoderIndex = -1;
+        ma_result result = ma_libopus_init_file(filePath, NULL, NULL, decoder);
 
-        if (firstDecoder != NULL && firstDecoder->outputFormat != ma_format_unknown)
+        if (result != MA_SUCCESS)
         {
-                ma_decoder_uninit(firstDecoder);
-                free(firstDecoder);
-                firstDecoder = NULL;
+                free(decoder);
+                return result;
         }
 
-        if (decoders[0] != NULL && decoders[0]->outputFormat != ma_format_unknown)
-        {
-                ma_decoder_uninit(decoders[0]);
-                free(decoders[0]);
-                decoders[0] = NULL;
-        }
+        *ppDataSource = decoder;
 
-        if (decoders[1] != NULL && decoders[1]->outputFormat != ma_format_unknown)
-        {
-                ma_decoder_uninit(decoders[1]);
-                free(decoders[1]);
-                decoders[1] = NULL;
-        }
+        return MA_SUCCESS;
 }
 
-void uninitPreviousDecoder()
+void closeOpusDecoder(ma_data_source *pDataSource)
 {
-        if (decoderIndex == -1)
-        {
-                return;
-        }
-        ma_decoder *toUninit = decoders[1 - decoderIndex];
-
-        if (toUninit != NULL)
-        {
-                ma_decoder_uninit(toUninit);
-                free(toUninit);
-                decoders[1 - decoderIndex] = NULL;
-        }
+        ma_libopus_uninit((ma_libopus *)pDataSource, NULL);
+        free(pDataSource);
 }
 
-void uninitPreviousVorbisDecoder()
+ma_result openVorbisDecoder(const char *filePath, ma_data_source **ppDataSource)
 {
-        if (vorbisDecoderIndex == -1)
-        {
-                return;
-        }
-        ma_libvorbis *toUninit = vorbisDecoders[1 - vorbisDecoderIndex];
+        ma_libvorbis *decoder = (ma_libvorbis *)malloc(sizeof(ma_libvorbis));
+
+        if (decoder == NULL)
+                return MA_OUT_OF_MEMORY;
 
-        if (toUninit != NULL)
+        ma_result result = ma_libvorbis_init_file(filePath, NULL, NULL, decoder);
+
+        if (result != MA_SUCCESS)
         {
-                ma_libvorbis_uninit(toUninit, NULL);
-                free(toUninit);
-                vorbisDecoders[1 - vorbisDecoderIndex] = NULL;
+                free(decoder);
+                return result;
         }
+
+        *ppDataSource = decoder;
+
+        return MA_SUCCESS;
 }
 
-void uninitPreviousM4aDecoder()
+void closeVorbisDecoder(ma_data_source *pDataSource)
 {
-        if (m4aDecoderIndex == -1) // either start of the program or resetM4aDecoders has been called
-        {
-                return;
-        }
-        m4a_decoder *toUninit = m4aDecoders[1 - m4aDecoderIndex];
-
-        if (toUninit != NULL)
-        {
-                m4a_decoder_uninit(toUninit, NULL);
-                free(toUninit);
-                m4aDecoders[1 - m4aDecoderIndex] = NULL;
-        }
+        ma_libvorbis_uninit((ma_libvorbis *)pDataSource, NULL);
+        free(pDataSource);
 }
 
-void uninitPreviousOpusDecoder()
+ma_result openM4aDecoder(const char *filePath, ma_data_source **ppDataSource)
 {
-        if (opusDecoderIndex == -1)
-        {
-                return;
-        }
-        ma_libopus *toUninit = opusDecoders[1 - opusDecoderIndex];
+        m4a_decoder *decoder = (m4a_decoder *)malloc(sizeof(m4a_decoder));
+
+        if (decoder == NULL)
+                return MA_OUT_OF_MEMORY;
+
+        ma_result result = m4a_decoder_init_file(filePath, NULL, NULL, decoder);
 
-        if (toUninit != NULL)
+        if (result != MA_SUCCESS)
         {
-                ma_libopus_uninit(toUninit, NULL);
-                free(toUninit);
-                opusDecoders[1 - opusDecoderIndex] = NULL;
+                free(decoder);
+                return result;
         }
-}
 
-ma_libvorbis *getFirstVorbisDecoder()
-{
-        return firstVorbisDecoder;
-}
+        *ppDataSource = decoder;
 
-m4a_decoder *getFirstM4aDecoder()
-{
-        return firstM4aDecoder;
+        return MA_SUCCESS;
 }
 
-ma_libopus *getFirstOpusDecoder()
+void closeM4aDecoder(ma_data_source *pDataSource)
 {
-        return firstOpusDecoder;
+        m4a_decoder_uninit((m4a_decoder *)pDataSource, NULL);
+        free(pDataSource);
 }
 
-ma_libvorbis *getCurrentVorbisDecoder()
-{
-        if (vorbisDecoderIndex == -1)
-                return getFirstVorbisDecoder();
-        else
-                return vorbisDecoders[vorbisDecoderIndex];
-}
+const DecoderBackend opusDecoderBackend = {
+    "opus",
+    {"opus", NULL},
+    true,
+    openOpusDecoder,
+    closeOpusDecoder};
 
-m4a_decoder *getCurrentM4aDecoder()
-{
-        if (m4aDecoderIndex == -1)
-                return getFirstM4aDecoder();
-        else
-                return m4aDecoders[m4aDecoderIndex];
-}
+// Seeking is disabled for ogg vorbis
+const DecoderBackend vorbisDecoderBackend = {
+    "vorbis",
+    {"ogg", NULL},
+    false,
+    openVorbisDecoder,
+    closeVorbisDecoder};
 
-ma_libopus *getCurrentOpusDecoder()
-{
-        if (opusDecoderIndex == -1)
-                return getFirstOpusDecoder();
-        else
-                return opusDecoders[opusDecoderIndex];
-}
+const DecoderBackend m4aDecoderBackend = {
+    "m4a",
+    {"m4a", "aac", NULL},
+    true,
+    openM4aDecoder,
+    closeM4aDecoder};
 
-ma_format getCurrentFormat()
-{
-        ma_format format = ma_format_unknown;
+const DecoderBackend *decoderBackends[] = {
+    &builtinDecoderBackend,
+    &opusDecoderBackend,
+    &vorbisDecoderBackend,
+    &m4aDecoderBackend};
 
-        if (getCurrentImplementationType() == BUILTIN)
-        {
-                ma_decoder *decoder = getCurrentBuiltinDecoder();
+const DecoderBackend *getDecoderBackend(const char *filePath)
+{
+        const char *extension = strrchr(filePath, '.');
 
-                if (decoder != NULL)
-                        format = decoder->outputFormat;
-        }
-        else if (getCurrentImplementationType() == OPUS)
-        {
-                ma_libopus *decoder = getCurrentOpusDecoder();
+        if (extension == NULL)
+                return NULL;
 
-                if (decoder != NULL)
-                        format = decoder->format;
-        }
-        else if (getCurrentImplementationType() == VORBIS)
-        {
-                ma_libvorbis *decoder = getCurrentVorbisDecoder();
+        extension++;
 
-                if (decoder != NULL)
-                        format = decoder->format;
-        }
-        else if (getCurrentImplementationType() == M4A)
+        for (size_t i = 0; i < sizeof(decoderBackends) / sizeof(decoderBackends[0]); i++)
         {
-                m4a_decoder *decoder = getCurrentM4aDecoder();
-
-                if (decoder != NULL)
-                        format = decoder->format;
+                for (int j = 0; decoderBackends[i]->extensions[j] != NULL; j++)
+                {
+                        if (strcasecmp(extension, decoderBackends[i]->extensions[j]) == 0)
+                                return decoderBackends[i];
+                }
         }
 
-        return format;
+        return NULL;
 }
 
-void switchVorbisDecoder()
+bool isSeekSupported(const char *filePath)
 {
-        if (vorbisDecoderIndex == -1)
-                vorbisDecoderIndex = 0;
-        else
-                vorbisDecoderIndex = 1 - vorbisDecoderIndex;
-}
+        const DecoderBackend *backend = getDecoderBackend(filePath);
 
-void switchM4aDecoder()
-{
-        if (m4aDecoderIndex == -1)
-                m4aDecoderIndex = 0;
-        else
-                m4aDecoderIndex = 1 - m4aDecoderIndex;
+        return (backend != NULL && backend->canSeek);
 }
 
-void switchOpusDecoder()
+static ma_result converter_data_source_read(ma_data_source *pDataSource, void *pFramesOut, ma_uint64 frameCount, ma_uint64 *pFramesRead)
 {
-        if (opusDecoderIndex == -1)
-                opusDecoderIndex = 0;
-        else
-                opusDecoderIndex = 1 - opusDecoderIndex;
-}
+        ConverterDataSource *pConverter = (ConverterDataSource *)pDataSource;
+        ma_uint32 inputBytesPerFrame = ma_get_bytes_per_frame(pConverter->formatIn, pConverter->channelsIn);
+        ma_uint32 outputBytesPerFrame = ma_get_bytes_per_frame(pConverter->converter.formatOut, pConverter->converter.channelsOut);
+        ma_uint64 framesRead = 0;
 
-void setNextVorbisDecoder(ma_libvorbis *decoder)
-{
-        if (vorbisDecoderIndex == -1 && firstVorbisDecoder == NULL)
-        {
-                firstVorbisDecoder = decoder;
-        }
-        else if (vorbisDecoderIndex == -1)
+        while (framesRead < frameCount)
         {
-                if (vorbisDecoders[0] != NULL)
+                if (pConverter->inputFramesAvailable == 0 && !pConverter->inputEnded)
                 {
-                        ma_libvorbis_uninit(vorbisDecoders[0], NULL);
-                        free(vorbisDecoders[0]);
-                        vorbisDecoders[0] = NULL;
-                }
+                        ma_uint64 framesDecoded = 0;
+                        ma_result result = ma_data_source_read_pcm_frames(pConverter->pDecoder, pConverter->inputBuffer, CONVERTER_INPUT_FRAMES, &framesDecoded);
 
-                vorbisDecoders[0] = decoder;
-        }
-        else
-        {
-                int nextIndex = 1 - vorbisDecoderIndex;
+                        pConverter->inputFrameOffset = 0;
+                        pConverter->inputFramesAvailable = framesDecoded;
 
-                if (vorbisDecoders[nextIndex] != NULL)
-                {
-                        ma_libvorbis_uninit(vorbisDecoders[nextIndex], NULL);
-                        free(vorbisDecoders[nextIndex]);
-                        vorbisDecoders[nextIndex] = NULL;
+                        if (result != MA_SUCCESS || framesDecoded == 0)
+                                pConverter->inputEnded = true;
                 }
 
-                vorbisDecoders[nextIndex] = decoder;
-        }
-}
+                if (pConverter->inputFramesAvailable == 0)
+                        break;
 
-void setNextM4aDecoder(m4a_decoder *decoder)
-{
-        if (m4aDecoderIndex == -1 && firstM4aDecoder == NULL)
-        {
-                firstM4aDecoder = decoder;
-        }
-        else if (m4aDecoderIndex == -1) // array hasn't been used yet
-        {
-                if (m4aDecoders[0] != NULL)
-                {
-                        m4a_decoder_uninit(m4aDecoders[0], NULL);
-                        free(m4aDecoders[0]);
-                        m4aDecoders[0] = NULL;
-                }
+                ma_uint64 frameCountIn = pConverter->inputFramesAvailable;
+                ma_uint64 frameCountOut = frameCount - framesRead;
 
-                m4aDecoders[0] = decoder;
-        }
-        else
-        {
-                int nextIndex = 1 - m4aDecoderIndex;
-                if (m4aDecoders[nextIndex] != NULL)
-                {
-                        m4a_decoder_uninit(m4aDecoders[nextIndex], NULL);
-                        free(m4aDecoders[nextIndex]);
-                        m4aDecoders[nextIndex] = NULL;
-                }
+                ma_data_converter_process_pcm_frames(&pConverter->converter,
+                                                     pConverter->inputBuffer + pConverter->inputFrameOffset * inputBytesPerFrame, &frameCountIn,
+                                                     (ma_uint8 *)pFramesOut + framesRead * outputBytesPerFrame, &frameCountOut);
 
-                m4aDecoders[nextIndex] = decoder;
-        }
-}
+                pConverter->inputFrameOffset += frameCountIn;
+                pConverter->inputFramesAvailable -= frameCountIn;
+                framesRead += frameCountOut;
 
-void setNextOpusDecoder(ma_libopus *decoder)
-{
-        if (opusDecoderIndex == -1 && firstOpusDecoder == NULL)
-        {
-                firstOpusDecoder = decoder;
-        }
-        else if (opusDecoderIndex == -1)
-        {
-                if (opusDecoders[0] != NULL)
-                {
-                        ma_libopus_uninit(opusDecoders[0], NULL);
-                        free(opusDecoders[0]);
-                        opusDecoders[0] = NULL;
-                }
-                opusDecoders[0] = decoder;
-        }
-        else
-        {
-                int nextIndex = 1 - opusDecoderIndex;
-                if (opusDecoders[nextIndex] != NULL)
-                {
-                        ma_libopus_uninit(opusDecoders[nextIndex], NULL);
-                        free(opusDecoders[nextIndex]);
-                        opusDecoders[nextIndex] = NULL;
-                }
-                opusDecoders[nextIndex] = decoder;
+                if (frameCountIn == 0 && frameCountOut == 0)
+                        break;
         }
-}
 
-void resetVorbisDecoders()
-{
-        vorbisDecoderIndex = -1;
+        pConverter->cursor += framesRead;
 
-        if (firstVorbisDecoder != NULL && firstVorbisDecoder->format != ma_format_unknown)
-        {
-                ma_libvorbis_uninit(firstVorbisDecoder, NULL);
-                free(firstVorbisDecoder);
-                firstVorbisDecoder = NULL;
-        }
-
-        if (vorbisDecoders[0] != NULL && vorbisDecoders[0]->format != ma_format_unknown)
-        {
-                ma_libvorbis_uninit(vorbisDecoders[0], NULL);
-                free(vorbisDecoders[0]);
-                vorbisDecoders[0] = NULL;
-        }
+        if (pFramesRead != NULL)
+                *pFramesRead = framesRead;
 
-        if (vorbisDecoders[1] != NULL && vorbisDecoders[1]->format != ma_format_unknown)
-        {
-                ma_libvorbis_uninit(vorbisDecoders[1], NULL);
-                free(vorbisDecoders[1]);
-                vorbisDecoders[1] = NULL;
-        }
+        return (framesRead == 0 && pConverter->inputEnded) ? MA_AT_END : MA_SUCCESS;
 }
 
-void resetM4aDecoders()
+static ma_result converter_data_source_seek(ma_data_source *pDataSource, ma_uint64 frameIndex)
 {
-        m4aDecoderIndex = -1;
+        ConverterDataSource *pConverter = (ConverterDataSource *)pDataSource;
+        ma_uint64 inputFrameIndex = frameIndex * pConverter->sampleRateIn / pConverter->converter.sampleRateOut;
 
-        if (firstM4aDecoder != NULL && firstM4aDecoder->format != ma_format_unknown)
-        {
-                m4a_decoder_uninit(firstM4aDecoder, NULL);
-                free(firstM4aDecoder);
-                firstM4aDecoder = NULL;
-        }
+        ma_result result = ma_data_source_seek_to_pcm_frame(pConverter->pDecoder, inputFrameIndex);
 
-        if (m4aDecoders[0] != NULL && m4aDecoders[0]->format != ma_format_unknown)
-        {
-                m4a_decoder_uninit(m4aDecoders[0], NULL);
-                free(m4aDecoders[0]);
-                m4aDecoders[0] = NULL;
-        }
+        if (result != MA_SUCCESS)
+                return result;
 
-        if (m4aDecoders[1] != NULL && m4aDecoders[1]->format != ma_format_unknown)
-        {
-                m4a_decoder_uninit(m4aDecoders[1], NULL);
-                free(m4aDecoders[1]);
-                m4aDecoders[1] = NULL;
-        }
+        ma_data_converter_reset(&pConverter->converter);
+
+        pConverter->inputFramesAvailable = 0;
+        pConverter->inputFrameOffset = 0;
+        pConverter->inputEnded = false;
+        pConverter->cursor = frameIndex;
+
+        return MA_SUCCESS;
 }
 
-void resetOpusDecoders()
+static ma_result converter_data_source_get_data_format(ma_data_source *pDataSource, ma_format *pFormat, ma_uint32 *pChannels, ma_uint32 *pSampleRate, ma_channel *pChannelMap, size_t channelMapCap)
 {
-        opusDecoderIndex = -1;
+        ConverterDataSource *pConverter = (ConverterDataSource *)pDataSource;
 
-        if (firstOpusDecoder != NULL && firstOpusDecoder->format != ma_format_unknown)
-        {
-                ma_libopus_uninit(firstOpusDecoder, NULL);
-                free(firstOpusDecoder);
-                firstOpusDecoder = NULL;
-        }
-
-        if (opusDecoders[0] != NULL && opusDecoders[0]->format != ma_format_unknown)
-        {
-                ma_libopus_uninit(opusDecoders[0], NULL);
-                ma_free(opusDecoders[0], NULL);
-                opusDecoders[0] = NULL;
-        }
+        if (pFormat != NULL)
+                *pFormat = pConverter->converter.formatOut;
+        if (pChannels != NULL)
+                *pChannels = pConverter->converter.channelsOut;
+        if (pSampleRate != NULL)
+                *pSampleRate = pConverter->converter.sampleRateOut;
+        if (pChannelMap != NULL)
+                ma_data_converter_get_output_channel_map(&pConverter->converter, pChannelMap, channelMapCap);
 
-        if (opusDecoders[1] != NULL && opusDecoders[1]->format != ma_format_unknown)
-        {
-                ma_libopus_uninit(opusDecoders[1], NULL);
-                ma_free(opusDecoders[1], NULL);
-                opusDecoders[1] = NULL;
-        }
+        return MA_SUCCESS;
 }
 
-void getFileInfo(const char *filename, ma_uint32 *sampleRate, ma_uint32 *channels, ma_format *format)
+static ma_result converter_data_source_get_cursor(ma_data_source *pDataSource, ma_uint64 *pCursor)
 {
-        ma_decoder tmp;
-        if (ma_decoder_init_file(filename, NULL, &tmp) == MA_SUCCESS)
-        {
-                *sampleRate = tmp.outputSampleRate;
-                *channels = tmp.outputChannels;
-                *format = tmp.outputFormat;
-                ma_decoder_uninit(&tmp);
-        }
-        else
-        {
-                // Handle file open error.
-        }
+        ConverterDataSource *pConverter = (ConverterDataSource *)pDataSource;
+        *pCursor = pConverter->cursor;
+
+        return MA_SUCCESS;
 }
 
-void getVorbisFileInfo(const char *filename, ma_format *format, ma_uint32 *channels, ma_uint32 *sampleRate, ma_channel *channelMap)
+static ma_result converter_data_source_get_length(ma_data_source *pDataSource, ma_uint64 *pLength)
 {
-        ma_libvorbis decoder;
-        if (ma_libvorbis_init_file(filename, NULL, NULL, &decoder) == MA_SUCCESS)
-        {
-                *format = decoder.format;
-                ma_libvorbis_get_data_format(&decoder, format, channels, sampleRate, channelMap, MA_MAX_CHANNELS);
-                ma_libvorbis_uninit(&decoder, NULL);
-        }
+        ConverterDataSource *pConverter = (ConverterDataSource *)pDataSource;
+        ma_uint64 inputLength = 0;
+
+        ma_result result = ma_data_source_get_length_in_pcm_frames(pConverter->pDecoder, &inputLength);
+
+        if (result != MA_SUCCESS)
+                return result;
+
+        *pLength = inputLength * pConverter->converter.sampleRateOut / pConverter->sampleRateIn;
+
+        return MA_SUCCESS;
 }
 
-void getM4aFileInfo(const char *filename, ma_format *format, ma_uint32 *channels, ma_uint32 *sampleRate, ma_channel *channelMap)
+static ma_data_source_vtable converter_data_source_vtable = {
+    converter_data_source_read,
+    converter_data_source_seek,
+    converter_data_source_get_data_format,
+    converter_data_source_get_cursor,
+    converter_data_source_get_length,
+    NULL, // set_looping
+    0     // flags
+};
+
+// Wraps a decoder so that it outputs the given format, converting channels and sample rate on the decode thread
+ma_result initConverterDataSource(ma_data_source *pDecoder, ma_format formatOut, ma_uint32 channelsOut, ma_uint32 sampleRateOut, ConverterDataSource **ppConverter)
 {
-        m4a_decoder decoder;
-        if (m4a_decoder_init_file(filename, NULL, NULL, &decoder) == MA_SUCCESS)
+        ma_format formatIn;
+        ma_uint32 channelsIn;
+        ma_uint32 sampleRateIn;
+
+        ma_result result = ma_data_source_get_data_format(pDecoder, &formatIn, &channelsIn, &sampleRateIn, NULL, 0);
+
+        if (result != MA_SUCCESS)
+                return result;
+
+        if (channelsIn == 0 || sampleRateIn == 0)
+                return MA_INVALID_DATA;
+
+        ConverterDataSource *pConverter = (ConverterDataSource *)calloc(1, sizeof(ConverterDataSource));
+
+        if (pConverter == NULL)
+                return MA_OUT_OF_MEMORY;
+
+        pConverter->inputBuffer = (ma_uint8 *)malloc(CONVERTER_INPUT_FRAMES * ma_get_bytes_per_frame(formatIn, channelsIn));
+
+        if (pConverter->inputBuffer == NULL)
         {
-                *format = decoder.format;
-                m4a_decoder_get_data_format(&decoder, format, channels, sampleRate, channelMap, MA_MAX_CHANNELS);
-                m4a_decoder_uninit(&decoder, NULL);
+                free(pConverter);
+                return MA_OUT_OF_MEMORY;
         }
-}
 
-void getOpusFileInfo(const char *filename, ma_format *format, ma_uint32 *channels, ma_uint32 *sampleRate, ma_channel *channelMap)
-{
-        ma_libopus decoder;
+        ma_data_converter_config config = ma_data_converter_config_init(formatIn, formatOut, channelsIn, channelsOut, sampleRateIn, sampleRateOut);
+        config.resampling.algorithm = ma_resample_algorithm_linear;
+        config.resampling.linear.lpfOrder = MA_MAX_FILTER_ORDER;
+
+        result = ma_data_converter_init(&config, NULL, &pConverter->converter);
 
-        if (ma_libopus_init_file(filename, NULL, NULL, &decoder) == MA_SUCCESS)
+        if (result != MA_SUCCESS)
         {
-                *format = decoder.format;
-                ma_libopus_get_data_format(&decoder, format, channels, sampleRate, channelMap, MA_MAX_CHANNELS);
-                ma_libopus_uninit(&decoder, NULL);
+                free(pConverter->inputBuffer);
+                free(pConverter);
+                return result;
         }
-}
 
-void setNextDecoder(ma_decoder *decoder)
-{
-        if (decoderIndex == -1 && firstDecoder == NULL)
+        ma_data_source_config baseConfig = ma_data_source_config_init();
+        baseConfig.vtable = &converter_data_source_vtable;
+
+        result = ma_data_source_init(&baseConfig, &pConverter->base);
+
+        if (result != MA_SUCCESS)
         {
-                firstDecoder = decoder;
+                ma_data_converter_uninit(&pConverter->converter, NULL);
+                free(pConverter->inputBuffer);
+                free(pConverter);
+                return result;
         }
-        else if (decoderIndex == -1)
-        {
-                if (decoders[0] != NULL)
-                {
-                        ma_decoder_uninit(decoders[0]);
-                        free(decoders[0]);
-                        decoders[0] = NULL;
-                }
 
-                decoders[0] = decoder;
-        }
-        else
-        {
-                int nextIndex = 1 - decoderIndex;
+        pConverter->pDecoder = pDecoder;
+        pConverter->formatIn = formatIn;
+        pConverter->channelsIn = channelsIn;
+        pConverter->sampleRateIn = sampleRateIn;
 
-                if (decoders[nextIndex] != NULL)
-                {
-                        ma_decoder_uninit(decoders[nextIndex]);
-                        free(decoders[nextIndex]);
-                        decoders[nextIndex] = NULL;
-                }
+        *ppConverter = pConverter;
 
-                decoders[nextIndex] = decoder;
-        }
+        return MA_SUCCESS;
 }
 
-MA_API ma_result m4a_read_pcm_frames_wrapper(void *pDecoder, void *pFramesOut, size_t frameCount, size_t *pFramesRead)
+void uninitConverterDataSource(ConverterDataSource *pConverter)
 {
-        ma_decoder *dec = (ma_decoder *)pDecoder;
-        return m4a_decoder_read_pcm_frames((m4a_decoder *)dec->pUserData, pFramesOut, frameCount, (ma_uint64 *)pFramesRead);
-}
+        if (pConverter == NULL)
+                return;
 
-MA_API ma_result m4a_seek_to_pcm_frame_wrapper(void *pDecoder, long long int frameIndex, ma_seek_origin origin)
-{
-        (void)origin;
-        ma_decoder *dec = (ma_decoder *)pDecoder;
-        return m4a_decoder_seek_to_pcm_frame((m4a_decoder *)dec->pUserData, frameIndex);
+        ma_data_source_uninit(&pConverter->base);
+        ma_data_converter_uninit(&pConverter->converter, NULL);
+        free(pConverter->inputBuffer);
+        free(pConverter);
 }
 
-MA_API ma_result m4a_get_cursor_in_pcm_frames_wrapper(void *pDecoder, long long int *pCursor)
+void closeDecoder(Decoder *decoder)
 {
-        ma_decoder *dec = (ma_decoder *)pDecoder;
-        return m4a_decoder_get_cursor_in_pcm_frames((m4a_decoder *)dec->pUserData, (ma_uint64 *)pCursor);
-}
+        uninitConverterDataSource(decoder->pConverter);
 
-MA_API ma_result ma_libopus_read_pcm_frames_wrapper(void *pDecoder, void *pFramesOut, size_t frameCount, size_t *pFramesRead)
-{
-        ma_decoder *dec = (ma_decoder *)pDecoder;
-        return ma_libopus_read_pcm_frames((ma_libopus *)dec->pUserData, pFramesOut, frameCount, (ma_uint64 *)pFramesRead);
+        if (decoder->pDecoder != NULL && decoder->backend != NULL)
+                decoder->backend->close(decoder->pDecoder);
+
+        decoder->backend = NULL;
+        decoder->pDecoder = NULL;
+        decoder->pConverter = NULL;
+        decoder->pDataSource = NULL;
+        decoder->filePath[0] = '\0';
 }
 
-MA_API ma_result ma_libopus_seek_to_pcm_frame_wrapper(void *pDecoder, long long int frameIndex, ma_seek_origin origin)
+Decoder *getCurrentDecoderSlot()
 {
-        (void)origin;
-        ma_decoder *dec = (ma_decoder *)pDecoder;
-        return ma_libopus_seek_to_pcm_frame((ma_libopus *)dec->pUserData, frameIndex);
+        if (decoderIndex == -1)
+                return &firstDecoder;
+        else
+                return &decoders[decoderIndex];
 }
 
-MA_API ma_result ma_libopus_get_cursor_in_pcm_frames_wrapper(void *pDecoder, long long int *pCursor)
+ma_data_source *getFirstDecoder()
 {
-        ma_decoder *dec = (ma_decoder *)pDecoder;
-        return ma_libopus_get_cursor_in_pcm_frames((ma_libopus *)dec->pUserData, (ma_uint64 *)pCursor);
+        return firstDecoder.pDataSource;
 }
 
-MA_API ma_result ma_libvorbis_read_pcm_frames_wrapper(void *pDecoder, void *pFramesOut, size_t frameCount, size_t *pFramesRead)
+ma_data_source *getCurrentDecoder()
 {
-        ma_decoder *dec = (ma_decoder *)pDecoder;
-        return ma_libvorbis_read_pcm_frames((ma_libvorbis *)dec->pUserData, pFramesOut, frameCount, (ma_uint64 *)pFramesRead);
+        return getCurrentDecoderSlot()->pDataSource;
 }
 
-MA_API ma_result ma_libvorbis_seek_to_pcm_frame_wrapper(void *pDecoder, long long int frameIndex, ma_seek_origin origin)
+const DecoderBackend *getCurrentDecoderBackend()
 {
-        (void)origin;
-        ma_decoder *dec = (ma_decoder *)pDecoder;
-        return ma_libvorbis_seek_to_pcm_frame((ma_libvorbis *)dec->pUserData, frameIndex);
+        return getCurrentDecoderSlot()->backend;
 }
 
-MA_API ma_result ma_libvorbis_get_cursor_in_pcm_frames_wrapper(void *pDecoder, long long int *pCursor)
+const char *getCurrentDecoderFilePath()
 {
-        ma_decoder *dec = (ma_decoder *)pDecoder;
-        return ma_libvorbis_get_cursor_in_pcm_frames((ma_libvorbis *)dec->pUserData, (ma_uint64 *)pCursor);
+        return getCurrentDecoderSlot()->filePath;
 }
 
-int prepareNextVorbisDecoder(char *filepath)
+void switchDecoder()
 {
-        ma_libvorbis *currentDecoder;
-
-        if (vorbisDecoderIndex == -1)
-        {
-                currentDecoder = getFirstVorbisDecoder();
-        }
+        if (decoderIndex == -1)
+                decoderIndex = 0;
         else
-        {
-                currentDecoder = vorbisDecoders[vorbisDecoderIndex];
-        }
-
-        ma_uint32 sampleRate;
-        ma_uint32 channels;
-        ma_format format;
-        ma_channel channelMap[MA_MAX_CHANNELS];
-        ma_libvorbis_get_data_format(currentDecoder, &format, &channels, &sampleRate, channelMap, MA_MAX_CHANNELS);
-
-        uninitPreviousVorbisDecoder();
-
-        ma_libvorbis *decoder = (ma_libvorbis *)malloc(sizeof(ma_libvorbis));
-        ma_result result = ma_libvorbis_init_file(filepath, NULL, NULL, decoder);
-
-        if (result != MA_SUCCESS)
-                return -1;
-
-        ma_format nformat;
-        ma_uint32 nchannels;
-        ma_uint32 nsampleRate;
-        ma_channel nchannelMap[MA_MAX_CHANNELS];
+                decoderIndex = 1 - decoderIndex;
+}
 
-        ma_libvorbis_get_data_format(decoder, &nformat, &nchannels, &nsampleRate, nchannelMap, MA_MAX_CHANNELS);
-        bool sameFormat = (currentDecoder == NULL || (format == nformat &&
-                                                      channels == nchannels &&
-                                                      sampleRate == nsampleRate));
+void resetDecoders()
+{
+        decoderIndex = -1;
 
-        if (!sameFormat)
-        {
-                ma_libvorbis_uninit(decoder, NULL);
-                free(decoder);
-                return -1;
-        }
+        closeDecoder(&firstDecoder);
+        closeDecoder(&decoders[0]);
+        closeDecoder(&decoders[1]);
+}
 
-        ma_libvorbis *first = getFirstVorbisDecoder();
-        if (first != NULL)
+void uninitPreviousDecoder()
+{
+        if (decoderIndex == -1) // either start of the program or resetDecoders has been called
         {
-                decoder->pReadSeekTellUserData = (AudioData *)first->pReadSeekTellUserData;
+                return;
         }
 
-        decoder->format = nformat;
-        decoder->onRead = ma_libvorbis_read_pcm_frames_wrapper;
-        decoder->onSeek = ma_libvorbis_seek_to_pcm_frame_wrapper;
-        decoder->onTell = ma_libvorbis_get_cursor_in_pcm_frames_wrapper;
-
-        setNextVorbisDecoder(decoder);
-        if (currentDecoder != NULL)
-                ma_data_source_set_next(currentDecoder, decoder);
-
-        return 0;
+        closeDecoder(&decoders[1 - decoderIndex]);
 }
 
-int prepareNextDecoder(char *filepath)
+void setNextDecoder(const DecoderBackend *backend, ma_data_source *pDecoder, ConverterDataSource *pConverter, const char *filePath)
 {
-        ma_decoder *currentDecoder;
+        Decoder *next;
 
-        if (decoderIndex == -1)
+        if (decoderIndex == -1 && firstDecoder.pDataSource == NULL)
         {
-                currentDecoder = getFirstDecoder();
+                next = &firstDecoder;
         }
-        else
+        else if (decoderIndex == -1) // array hasn't been used yet
         {
-                currentDecoder = decoders[decoderIndex];
+                next = &decoders[0];
         }
-
-        ma_uint32 sampleRate;
-        ma_uint32 channels;
-        ma_format format;
-        getFileInfo(filepath, &sampleRate, &channels, &format);
-
-        bool sameFormat = (currentDecoder == NULL || (format == currentDecoder->outputFormat &&
-                                                      channels == currentDecoder->outputChannels &&
-                                                      sampleRate == currentDecoder->outputSampleRate));
-
-        if (!sameFormat)
+        else
         {
-                return 0;
+                next = &decoders[1 - decoderIndex];
         }
 
-        uninitPreviousDecoder();
+        closeDecoder(next);
 
-        ma_decoder *decoder = (ma_decoder *)malloc(sizeof(ma_decoder));
-        ma_result result = ma_decoder_init_file(filepath, NULL, decoder);
+        next->backend = backend;
+        next->pDecoder = pDecoder;
+        next->pConverter = pConverter;
+        next->pDataSource = (pConverter != NULL) ? (ma_data_source *)pConverter : pDecoder;
+        c_strcpy(next->filePath, sizeof(next->filePath), filePath);
+}
 
-        if (result != MA_SUCCESS)
+bool hasSameDataFormat(ma_data_source *pDataSourceA, ma_data_source *pDataSourceB)
+{
+        ma_format format, nformat;
+        ma_uint32 channels, nchannels;
+        ma_uint32 sampleRate, nsampleRate;
+
+        if (ma_data_source_get_data_format(pDataSourceA, &format, &channels, &sampleRate, NULL, 0) != MA_SUCCESS ||
+            ma_data_source_get_data_format(pDataSourceB, &nformat, &nchannels, &nsampleRate, NULL, 0) != MA_SUCCESS)
         {
-                free(decoder);
-                return -1;
+                return false;
         }
-        setNextDecoder(decoder);
 
-        if (currentDecoder != NULL && decoder != NULL)
-                ma_data_source_set_next(currentDecoder, decoder);
-
-        return 0;
+        return (format == nformat && channels == nchannels && sampleRate == nsampleRate);
 }
 
-int prepareNextM4aDecoder(char *filepath)
+int prepareNextDecoder(char *filepath)
 {
-        m4a_decoder *currentDecoder;
+        const DecoderBackend *backend = getDecoderBackend(filepath);
 
-        if (m4aDecoderIndex == -1)
-        {
-                currentDecoder = getFirstM4aDecoder();
-        }
-        else
-        {
-                currentDecoder = m4aDecoders[m4aDecoderIndex];
-        }
+        if (backend == NULL)
+                return -1;
 
-        ma_uint32 sampleRate;
-        ma_uint32 channels;
-        ma_format format;
-        ma_channel channelMap[MA_MAX_CHANNELS];
-        m4a_decoder_get_data_format(currentDecoder, &format, &channels, &sampleRate, channelMap, MA_MAX_CHANNELS);
+        ma_data_source *currentDecoder = getCurrentDecoder();
 
-        uninitPreviousM4aDecoder();
+        uninitPreviousDecoder();
 
-        m4a_decoder *decoder = (m4a_decoder *)malloc(sizeof(m4a_decoder));
-        ma_result result = m4a_decoder_init_file(filepath, NULL, NULL, decoder);
+        ma_data_source *decoder = NULL;
+        ma_result result = backend->open(filepath, &decoder);
 
         if (result != MA_SUCCESS)
                 return -1;
 
-        ma_format nformat;
-        ma_uint32 nchannels;
-        ma_uint32 nsampleRate;
-        ma_channel nchannelMap[MA_MAX_CHANNELS];
-
-        m4a_decoder_get_data_format(decoder, &nformat, &nchannels, &nsampleRate, nchannelMap, MA_MAX_CHANNELS);
-        bool sameFormat = (currentDecoder == NULL || (format == nformat &&
-                                                      channels == nchannels &&
-                                                      sampleRate == nsampleRate));
+        ConverterDataSource *converter = NULL;
 
-        if (!sameFormat)
+        // Convert the next track to the format the device was opened with, so that it can be chained without recreating the device
+        if (currentDecoder != NULL && !hasSameDataFormat(currentDecoder, decoder))
         {
-                m4a_decoder_uninit(decoder, NULL);
-                free(decoder);
-                return -1;
-        }
+                ma_format format;
+                ma_uint32 channels;
+                ma_uint32 sampleRate;
 
-        m4a_decoder *first = getFirstM4aDecoder();
-        if (first != NULL)
-        {
-                decoder->pReadSeekTellUserData = (AudioData *)first->pReadSeekTellUserData;
+                result = ma_data_source_get_data_format(currentDecoder, &format, &channels, &sampleRate, NULL, 0);
+
+                if (result == MA_SUCCESS)
+                        result = initConverterDataSource(decoder, format, channels, sampleRate, &converter);
+
+                if (result != MA_SUCCESS)
+                {
+                        backend->close(decoder);
+                        return 0;
+                }
         }
 
-        decoder->format = nformat;
-        decoder->onRead = m4a_read_pcm_frames_wrapper;
-        decoder->onSeek = m4a_seek_to_pcm_frame_wrapper;
-        decoder->onTell = m4a_get_cursor_in_pcm_frames_wrapper;
-        decoder->cursor = 0;
+        setNextDecoder(backend, decoder, converter, filepath);
 
-        setNextM4aDecoder(decoder);
         if (currentDecoder != NULL)
-                ma_data_source_set_next(currentDecoder, decoder);
+                ma_data_source_set_next(currentDecoder, (converter != NULL) ? (ma_data_source *)converter : decoder);
 
         return 0;
 }
 
-int prepareNextOpusDecoder(char *filepath)
+float pcmSampleToFloat(const ma_uint8 *pSample, ma_format format)
 {
-        ma_libopus *currentDecoder;
-
-        if (opusDecoderIndex == -1)
+        switch (format)
         {
-                currentDecoder = getFirstOpusDecoder();
+        case ma_format_u8:
+                return ((float)pSample[0] - 128.0f) / 128.0f;
+        case ma_format_s16:
+                return *(const ma_int16 *)pSample / 32768.0f;
+        case ma_format_s24:
+                return (ma_int32)(((ma_uint32)pSample[0] << 8) | ((ma_uint32)pSample[1] << 16) | ((ma_uint32)pSample[2] << 24)) / 2147483648.0f;
+        case ma_format_s32:
+                return *(const ma_int32 *)pSample / 2147483648.0f;
+        case ma_format_f32:
+                return *(const float *)pSample;
+        default:
+                return 0.0f;
         }
-        else
-        {
-                currentDecoder = opusDecoders[decoderIndex];
-        }
-
-        ma_uint32 sampleRate;
-        ma_uint32 channels;
-        ma_format format;
-        ma_channel channelMap[MA_MAX_CHANNELS];
-        ma_libopus_get_data_format(currentDecoder, &format, &channels, &sampleRate, channelMap, MA_MAX_CHANNELS);
-
-        uninitPreviousOpusDecoder();
-
-        ma_libopus *decoder = (ma_libopus *)malloc(sizeof(ma_libopus));
-        ma_result result = ma_libopus_init_file(filepath, NULL, NULL, decoder);
-
-        if (result != MA_SUCCESS)
-                return -1;
+}
 
-        ma_format nformat;
-        ma_uint32 nchannels;
-        ma_uint32 nsampleRate;
-        ma_channel nchannelMap[MA_MAX_CHANNELS];
+// Called from the device callback. Stores the left and right channel (mono is duplicated) as float.
+void writeAnalysisTap(const void *pFrames, ma_format format, ma_uint32 channels, ma_uint32 frameCount)
+{
+        ma_uint32 bytesPerSample = ma_get_bytes_per_sample(format);
+        ma_uint32 rightOffset = (channels > 1) ? bytesPerSample : 0;
+        ma_uint64 written = atomic_load_explicit(&analysisTapWritten, memory_order_relaxed);
+        const ma_uint8 *pSample = (const ma_uint8 *)pFrames;
 
-        ma_libopus_get_data_format(decoder, &nformat, &nchannels, &nsampleRate, nchannelMap, MA_MAX_CHANNELS);
-        bool sameFormat = (currentDecoder == NULL || (format == nformat &&
-                                                      channels == nchannels &&
-                                                      sampleRate == nsampleRate));
+        // Published before the samples are stored, so a reader accounts for a block that is being written
+        if (frameCount > atomic_load_explicit(&analysisTapMaxBlock, memory_order_relaxed))
+                atomic_store_explicit(&analysisTapMaxBlock, frameCount, memory_order_seq_cst);
 
-        if (!sameFormat)
+        for (ma_uint32 i = 0; i < frameCount; i++)
         {
-                ma_libopus_uninit(decoder, NULL);
-                free(decoder);
-                return -1;
-        }
+                size_t index = (written + i) & (ANALYSIS_TAP_FRAMES - 1);
 
-        ma_libopus *first = getFirstOpusDecoder();
+                analysisTap[index][0] = pcmSampleToFloat(pSample, format);
+                analysisTap[index][1] = pcmSampleToFloat(pSample + rightOffset, format);
 
-        if (first != NULL)
-        {
-                decoder->pReadSeekTellUserData = (AudioData *)first->pReadSeekTellUserData;
+                pSample += bytesPerSample * channels;
         }
 
-        decoder->format = nformat;
-        decoder->onRead = ma_libopus_read_pcm_frames_wrapper;
-        decoder->onSeek = ma_libopus_seek_to_pcm_frame_wrapper;
-        decoder->onTell = ma_libopus_get_cursor_in_pcm_frames_wrapper;
-
-        setNextOpusDecoder(decoder);
-
-        if (currentDecoder != NULL)
-                ma_data_source_set_next(currentDecoder, decoder);
-
-        return 0;
-}
-
-int getBufferSize()
-{
-        return bufSize;
+        atomic_store_explicit(&analysisTapWritten, written + frameCount, memory_order_release);
 }
 
-void setBufferSize(int value)
+// Copies the last frameCount frames that were played. Returns the number of frames copied, 0 if there aren't enough yet.
+int getAnalysisFrames(float *left, float *right, int frameCount)
 {
-        bufSize = value;
-}
+        if (frameCount <= 0 || frameCount > ANALYSIS_TAP_FRAMES / 2)
+                return 0;
 
-void initAudioBuffer()
-{
-        if (audioBuffer == NULL)
+        for (int attempt = 0; attempt < 3; attempt++)
         {
-                audioBuffer = malloc(sizeof(ma_int32) * MAX_BUFFER_SIZE);
-                if (audioBuffer == NULL)
+                ma_uint64 end = atomic_load_explicit(&analysisTapWritten, memory_order_acquire);
+
+                if (end < (ma_uint64)frameCount)
+                        return 0;
+
+                ma_uint64 start = end - frameCount;
+
+                for (int i = 0; i < frameCount; i++)
                 {
-                        // Memory allocation failed
-                        return;
+                        size_t index = (start + i) & (ANALYSIS_TAP_FRAMES - 1);
+                        left[i] = analysisTap[index][0];
+                        right[i] = analysisTap[index][1];
                 }
-        }
-}
 
-ma_int32 *getAudioBuffer()
-{
-        return audioBuffer;
-}
+                atomic_thread_fence(memory_order_acquire);
 
-void setAudioBuffer(ma_int32 *buf)
-{
-        audioBuffer = buf;
-}
+                // The snapshot is consistent if the callback didn't wrap around into the frames we copied. It may be
+                // storing a block past what it has published, so room is left for the largest one.
+                ma_uint64 after = atomic_load_explicit(&analysisTapWritten, memory_order_relaxed);
+                ma_uint64 maxBlock = atomic_load_explicit(&analysisTapMaxBlock, memory_order_relaxed);
+
+                if (after - end + maxBlock <= (ma_uint64)(ANALYSIS_TAP_FRAMES - frameCount))
+                        return frameCount;
+        }
 
-void resetAudioBuffer()
-{
-        memset(audioBuffer, 0, sizeof(float) * MAX_BUFFER_SIZE);
+        return 0;
 }
 
-void freeAudioBuffer()
+void resetAnalysisTap()
 {
-        if (audioBuffer != NULL)
-        {
-                free(audioBuffer);
-                audioBuffer = NULL;
-        }
+        memset(analysisTap, 0, sizeof(analysisTap));
+        atomic_store(&analysisTapWritten, 0);
+        atomic_store(&analysisTapMaxBlock, 0);
 }
 
 bool isRepeatEnabled()
@@ -1055,6 +849,7 @@ void cleanupPlaybackDevice()
                 c_sleep(100);
         }
         ma_device_uninit(&device);
+        clearDecodeSource();
 }
 
 void clearCurrentTrack()
@@ -1065,12 +860,9 @@ void clearCurrentTrack()
                 ma_device_stop(&device);
         }
 
-        resetDecoders();
-        resetVorbisDecoders();
-        resetOpusDecoders();
-        resetM4aDecoders();
+        clearDecodeSource();
 
-        ma_data_source_set_next(currentDecoder, NULL);
+        resetDecoders();
 }
 
 void togglePausePlayback()
@@ -1113,6 +905,7 @@ void resetDevice()
         pthread_mutex_unlock(&deviceMutex);
 
         ma_device_uninit(&device);
+        clearDecodeSource();
 }
 
 ma_device *getDevice()
@@ -1120,11 +913,207 @@ ma_device *getDevice()
         return &device;
 }
 
-bool hasBuiltinDecoder(char *filePath)
+void *decodeThreadFunction(void *arg)
+{
+        (void)arg;
+
+        while (atomic_load(&decodeThreadRunning))
+        {
+                ma_uint64 framesDecoded = 0;
+
+                pthread_mutex_lock(&decodeMutex);
+
+                if (decodeProc != NULL && pcmRingBufferInitialized && !isImplSwitchReached() &&
+                    ma_pcm_rb_available_write(&pcmRingBuffer) >= DECODE_CHUNK_FRAMES)
+                {
+                        ma_uint32 framesToWrite = DECODE_CHUNK_FRAMES;
+                        void *pWriteBuffer = NULL;
+
+                        if (ma_pcm_rb_acquire_write(&pcmRingBuffer, &framesToWrite, &pWriteBuffer) == MA_SUCCESS && framesToWrite > 0)
+                        {
+                                decodeProc(decodeDataSource, pWriteBuffer, framesToWrite, &framesDecoded);
+
+                                if (framesDecoded > framesToWrite)
+                                        framesDecoded = framesToWrite;
+
+                                ma_pcm_rb_commit_write(&pcmRingBuffer, (ma_uint32)framesDecoded);
+                                atomic_fetch_add(&decodedFramesCommitted, framesDecoded);
+                        }
+                }
+
+                pthread_mutex_unlock(&decodeMutex);
+
+                // Nothing to do until the device callback has consumed some frames
+                if (framesDecoded == 0)
+                        c_sleep(DECODE_IDLE_MILLISECONDS);
+        }
+
+        return NULL;
+}
+
+void startDecodeThread()
+{
+        if (atomic_load(&decodeThreadRunning))
+                return;
+
+        atomic_store(&decodeThreadRunning, true);
+
+        if (pthread_create(&decodeThread, NULL, decodeThreadFunction, NULL) != 0)
+        {
+                atomic_store(&decodeThreadRunning, false);
+                fprintf(stderr, "Failed to create decode thread.\n");
+        }
+}
+
+void stopDecodeThread()
+{
+        if (!atomic_load(&decodeThreadRunning))
+                return;
+
+        atomic_store(&decodeThreadRunning, false);
+        pthread_join(decodeThread, NULL);
+
+        pthread_mutex_lock(&decodeMutex);
+        decodeProc = NULL;
+        decodeDataSource = NULL;
+        pthread_mutex_unlock(&decodeMutex);
+}
+
+// Must be called while the device is stopped, since it replaces the buffer the callback reads from
+int setDecodeSource(decode_pcm_frames_proc onDecode, ma_data_source *pDataSource, ma_format format, ma_uint32 channels, ma_uint32 sampleRate)
+{
+        int result = 0;
+
+        pthread_mutex_lock(&decodeMutex);
+
+        decodeProc = NULL;
+        decodeDataSource = NULL;
+
+        if (pcmRingBufferInitialized)
+        {
+                ma_pcm_rb_uninit(&pcmRingBuffer);
+                pcmRingBufferInitialized = false;
+        }
+
+        // Round up to whole decode chunks so that reads from the decoders stay a fixed size
+        ma_uint32 bufferSizeInFrames = sampleRate * RING_BUFFER_MILLISECONDS / 1000;
+        ma_uint32 numChunks = (bufferSizeInFrames + DECODE_CHUNK_FRAMES - 1) / DECODE_CHUNK_FRAMES;
+
+        if (numChunks < 2)
+                numChunks = 2;
+
+        if (ma_pcm_rb_init(format, channels, numChunks * DECODE_CHUNK_FRAMES, NULL, NULL, &pcmRingBuffer) == MA_SUCCESS)
+        {
+                atomic_store(&decodedFramesCommitted, 0);
+                atomic_store(&discardDecodedFramesUntil, 0);
+                decodedFramesConsumed = 0;
+                pcmRingBufferInitialized = true;
+                decodeProc = onDecode;
+                decodeDataSource = pDataSource;
+        }
+        else
+        {
+                result = -1;
+        }
+
+        pthread_mutex_unlock(&decodeMutex);
+
+        return result;
+}
+
+// Must be called while the device is stopped
+void clearDecodeSource()
+{
+        pthread_mutex_lock(&decodeMutex);
+
+        decodeProc = NULL;
+        decodeDataSource = NULL;
+
+        if (pcmRingBufferInitialized)
+        {
+                pcmRingBufferInitialized = false;
+                ma_pcm_rb_uninit(&pcmRingBuffer);
+        }
+
+        pthread_mutex_unlock(&decodeMutex);
+}
+
+// Lets the frames that were decoded before a track switch play out before the device is torn down
+void waitForDecodedFramesToPlay()
 {
-        char *extension = strrchr(filePath, '.');
-        return (extension != NULL && (strcasecmp(extension, ".wav") == 0 || strcasecmp(extension, ".flac") == 0 ||
-                                      strcasecmp(extension, ".mp3") == 0));
+        int maxNumTries = RING_BUFFER_MILLISECONDS / 5 + 1;
+        int numTries = 0;
+
+        while (pcmRingBufferInitialized && ma_device_is_started(&device) &&
+               ma_pcm_rb_available_read(&pcmRingBuffer) > 0 && numTries < maxNumTries)
+        {
+                c_sleep(5);
+                numTries++;
+        }
+}
+
+// Called from the decode thread on a seek or skip. framesNotCommitted are old frames it decoded but hasn't handed over yet.
+void requestDecodedFramesFlush(ma_uint64 framesNotCommitted)
+{
+        atomic_store(&discardDecodedFramesUntil, atomic_load(&decodedFramesCommitted) + framesNotCommitted);
+}
+
+// Drops the frames a flush was requested for. Only the callback moves the read pointer, so it does this itself.
+// False while some of them haven't been committed yet.
+bool discardFlushedFrames()
+{
+        ma_uint64 until = atomic_load(&discardDecodedFramesUntil);
+
+        while (decodedFramesConsumed < until)
+        {
+                ma_uint64 remaining = until - decodedFramesConsumed;
+                ma_uint32 framesToDiscard = (remaining > UINT32_MAX) ? UINT32_MAX : (ma_uint32)remaining;
+                void *pReadBuffer = NULL;
+
+                if (ma_pcm_rb_acquire_read(&pcmRingBuffer, &framesToDiscard, &pReadBuffer) != MA_SUCCESS || framesToDiscard == 0)
+                        break;
+
+                ma_pcm_rb_commit_read(&pcmRingBuffer, framesToDiscard);
+                decodedFramesConsumed += framesToDiscard;
+        }
+
+        return decodedFramesConsumed >= until;
+}
+
+// Runs on the realtime audio thread, so it only copies already decoded frames
+void on_audio_frames(ma_device *pDevice, void *pFramesOut, const void *pFramesIn, ma_uint32 frameCount)
+{
+        (void)pFramesIn;
+
+        if (!pcmRingBufferInitialized)
+                return;
+
+        // Silence until the old frames are gone, rather than a piece of them
+        if (!discardFlushedFrames())
+                return;
+
+        ma_uint32 bytesPerFrame = ma_get_bytes_per_frame(pDevice->playback.format, pDevice->playback.channels);
+        ma_uint32 framesWritten = 0;
+
+        // At most two iterations are needed, one for when the buffer wraps around
+        while (framesWritten < frameCount)
+        {
+                ma_uint32 framesToRead = frameCount - framesWritten;
+                void *pReadBuffer = NULL;
+
+                if (ma_pcm_rb_acquire_read(&pcmRingBuffer, &framesToRead, &pReadBuffer) != MA_SUCCESS || framesToRead == 0)
+                        break;
+
+                memcpy((ma_uint8 *)pFramesOut + framesWritten * bytesPerFrame, pReadBuffer, framesToRead * bytesPerFrame);
+                ma_pcm_rb_commit_read(&pcmRingBuffer, framesToRead);
+                decodedFramesConsumed += framesToRead;
+
+                writeAnalysisTap((ma_uint8 *)pFramesOut + framesWritten * bytesPerFrame, pDevice->playback.format, pDevice->playback.channels, framesToRead);
+
+                framesWritten += framesToRead;
+        }
+
+        // Anything not written stays silent, miniaudio clears the output buffer before calling us
 }
 
 void setCurrentFileIndex(AudioData *pAudioData, int index)
@@ -1291,9 +1280,6 @@ void executeSwitch(AudioData *pAudioData)
 {
         pAudioData->switchFiles = false;
         switchDecoder();
-        switchOpusDecoder();
-        switchM4aDecoder();
-        switchVorbisDecoder();
 
         pAudioData->pUserData->currentSongData = (pAudioData->currentFileIndex == 0) ? pAudioData->pUserData->songdataA : pAudioData->pUserData->songdataB;
         pAudioData->totalFrames = 0;
@@ -1424,25 +1410,22 @@ int adjustVolumePercent(int volumeChange)
         return 0;
 }
 
-ma_uint64 lastCursor = 0;
-
-void m4a_read_pcm_frames(ma_data_source *pDataSource, void *pFramesOut, ma_uint64 frameCount, ma_uint64 *pFramesRead)
+void decoder_read_pcm_frames(ma_data_source *pDataSource, void *pFramesOut, ma_uint64 frameCount, ma_uint64 *pFramesRead)
 {
-        m4a_decoder *m4a = (m4a_decoder *)pDataSource;
-        AudioData *pAudioData = (AudioData *)m4a->pReadSeekTellUserData;
+        AudioData *pAudioData = (AudioData *)pDataSource;
         ma_uint64 framesRead = 0;
 
         while (framesRead < frameCount)
         {
                 if (doQuit)
-                        return;
+                        break;
 
                 if (isImplSwitchReached())
-                        return;
+                        break;
 
                 if (pthread_mutex_trylock(&dataSourceMutex) != 0)
                 {
-                        return;
+                        break;
                 }
 
                 // Check if a file switch is required
@@ -1453,13 +1436,21 @@ void m4a_read_pcm_frames(ma_data_source *pDataSource, void *pFramesOut, ma_uint6
                         break; // Exit the loop after the file switch
                 }
 
-                if (getCurrentImplementationType() != M4A && !isSkipToNext())
+                if (getCurrentImplementationType() == NONE && !isSkipToNext())
                 {
                         pthread_mutex_unlock(&dataSourceMutex);
-                        return;
+                        break;
                 }
 
-                m4a_decoder *decoder = getCurrentM4aDecoder();
+                ma_data_source *decoder = getCurrentDecoder();
+                ma_data_source *firstDecoder = getFirstDecoder();
+                const DecoderBackend *backend = getCurrentDecoderBackend();
+
+                if (decoder == NULL || firstDecoder == NULL)
+                {
+                        pthread_mutex_unlock(&dataSourceMutex);
+                        break;
+                }
 
                 if (pAudioData->totalFrames == 0)
                         ma_data_source_get_length_in_pcm_frames(decoder, &pAudioData->totalFrames);
@@ -1467,305 +1458,58 @@ void m4a_read_pcm_frames(ma_data_source *pDataSource, void *pFramesOut, ma_uint6
                 // Check if seeking is requested
                 if (isSeekRequested())
                 {
-                        ma_uint64 totalFrames = 0;
-                        m4a_decoder_get_length_in_pcm_frames(decoder, &totalFrames);
-                        ma_uint64 seekPercent = getSeekPercentage();
-
-                        if (seekPercent >= 100.0)
-                                seekPercent = 100.0;
-
-                        ma_uint64 targetFrame = (totalFrames * seekPercent) / 100 - 1; // Remove one frame or we get invalid args if we send in totalframes
-
-                        // Set the read pointer for the decoder
-                        ma_result seekResult = m4a_decoder_seek_to_pcm_frame(decoder, targetFrame);
-                        if (seekResult != MA_SUCCESS)
+                        if (backend != NULL && backend->canSeek)
                         {
-                                // Handle seek error
-                                setSeekRequested(false);
-                                pthread_mutex_unlock(&dataSourceMutex);
-                                return;
-                        }
-
-                        setSeekRequested(false); // Reset seek flag
-                }
-
-                // Read from the current decoder
-                ma_uint64 framesToRead = 0;
-                ma_result result;
-                ma_uint64 remainingFrames = frameCount - framesRead;
-                m4a_decoder *firstDecoder = getFirstM4aDecoder();
-                ma_uint64 cursor = 0;
-
-                if (firstDecoder == NULL)
-                {
-                        pthread_mutex_unlock(&dataSourceMutex);
-                        return;
-                }
-
-                result = ma_data_source_read_pcm_frames(firstDecoder, (ma_int32 *)pFramesOut + framesRead * pAudioData->channels, remainingFrames, &framesToRead);
-
-                ma_data_source_get_cursor_in_pcm_frames(decoder, &cursor);
-
-                if (((cursor != 0 && cursor == lastCursor) || framesToRead == 0 || isSkipToNext() || result != MA_SUCCESS) && !isEOFReached())
-                {
-                        activateSwitch(pAudioData);
-                        pthread_mutex_unlock(&dataSourceMutex);
-                        continue;
-                }
-
-                lastCursor = cursor;
-
-                framesRead += framesToRead;
-                setBufferSize(framesToRead);
-
-                pthread_mutex_unlock(&dataSourceMutex);
-        }
+                                ma_uint64 totalFrames = 0;
+                                ma_data_source_get_length_in_pcm_frames(decoder, &totalFrames);
+                                float seekPercent = getSeekPercentage();
 
-        ma_int32 *audioBuffer = getAudioBuffer();
-        if (audioBuffer == NULL)
-        {
-                audioBuffer = malloc(sizeof(ma_int32) * MAX_BUFFER_SIZE);
-                if (audioBuffer == NULL)
-                {
-                        // Memory allocation failed
-                        return;
-                }
-        }
-
-        // No format conversion needed, just copy the audio samples
-        memcpy(audioBuffer, pFramesOut, sizeof(ma_int32) * framesRead);
-        setAudioBuffer(audioBuffer);
-
-        if (pFramesRead != NULL)
-        {
-                *pFramesRead = framesRead;
-        }
-}
-
-void m4a_on_audio_frames(ma_device *pDevice, void *pFramesOut, const void *pFramesIn, ma_uint32 frameCount)
-{
-        AudioData *pDataSource = (AudioData *)pDevice->pUserData;
-        ma_uint64 framesRead = 0;
-        m4a_read_pcm_frames(&pDataSource->base, pFramesOut, frameCount, &framesRead);
-        (void)pFramesIn;
-}
-
-void opus_read_pcm_frames(ma_data_source *pDataSource, void *pFramesOut, ma_uint64 frameCount, ma_uint64 *pFramesRead)
-{
-        ma_libopus *opus = (ma_libopus *)pDataSource;
-        AudioData *pAudioData = (AudioData *)opus->pReadSeekTellUserData;
-
-        ma_uint64 framesRead = 0;
-
-        while (framesRead < frameCount)
-        {
-                if (doQuit)
-                        return;
-
-                if (isImplSwitchReached())
-                        return;
-
-                if (pthread_mutex_trylock(&dataSourceMutex) != 0)
-                {
-                        return;
-                }
-
-                // Check if a file switch is required
-                if (pAudioData->switchFiles)
-                {
-                        executeSwitch(pAudioData);
-                        pthread_mutex_unlock(&dataSourceMutex);
-                        break; // Exit the loop after the file switch
-                }
+                                if (seekPercent >= 100.0)
+                                        seekPercent = 100.0;
 
-                if (getCurrentImplementationType() != OPUS && !isSkipToNext())
-                {
-                        pthread_mutex_unlock(&dataSourceMutex);
-                        return;
-                }
+                                ma_uint64 targetFrame = (ma_uint64)((totalFrames * seekPercent) / 100.0);
 
-                ma_libopus *decoder = getCurrentOpusDecoder();
+                                // Stay one frame short of the end or we get invalid args
+                                if (totalFrames > 0 && targetFrame >= totalFrames)
+                                        targetFrame = totalFrames - 1;
 
-                if (pAudioData->totalFrames == 0)
-                        ma_data_source_get_length_in_pcm_frames(decoder, &pAudioData->totalFrames);
+                                ma_data_source_seek_to_pcm_frame(decoder, targetFrame);
 
-                // Check if seeking is requested
-                if (isSeekRequested())
-                {
-                        ma_uint64 totalFrames = 0;
-                        ma_libopus_get_length_in_pcm_frames(decoder, &totalFrames);
-                        ma_uint64 seekPercent = getSeekPercentage();
-                        if (seekPercent >= 100.0)
-                                seekPercent = 100.0;
-                        ma_uint64 targetFrame = (totalFrames * seekPercent) / 100 - 1; // Remove one frame or we get invalid args if we send in totalframes
-
-                        // Set the read pointer for the decoder
-                        ma_result seekResult = ma_libopus_seek_to_pcm_frame(decoder, targetFrame);
-                        if (seekResult != MA_SUCCESS)
-                        {
-                                // Handle seek error
-                                setSeekRequested(false);
-                                pthread_mutex_unlock(&dataSourceMutex);
-                                return;
+                                // What is buffered is from before the seek, including what this call read so far
+                                requestDecodedFramesFlush(framesRead);
                         }
 
                         setSeekRequested(false); // Reset seek flag
                 }
 
-                // Read from the current decoder
+                // Read from the first decoder, chaining moves on to the next one
                 ma_uint64 framesToRead = 0;
-                ma_result result;
                 ma_uint64 remainingFrames = frameCount - framesRead;
-                ma_libopus *firstDecoder = getFirstOpusDecoder();
-                ma_uint64 cursor = 0;
-
-                if (firstDecoder == NULL)
-                {
-                        pthread_mutex_unlock(&dataSourceMutex);
-                        return;
-                }
-
-                result = ma_data_source_read_pcm_frames(firstDecoder, (ma_int32 *)pFramesOut + framesRead * pAudioData->channels, remainingFrames, &framesToRead);
-
-                ma_data_source_get_cursor_in_pcm_frames(decoder, &cursor);
-
-                if (((cursor != 0 && cursor >= pAudioData->totalFrames) || framesToRead == 0 || isSkipToNext() || result != MA_SUCCESS) && !isEOFReached())
-                {
-                        activateSwitch(pAudioData);
-                        pthread_mutex_unlock(&dataSourceMutex);
-                        continue;
-                }
+                ma_result result = ma_data_source_read_pcm_frames(firstDecoder, (ma_uint8 *)pFramesOut + framesRead * ma_get_bytes_per_frame(pAudioData->format, pAudioData->channels), remainingFrames, &framesToRead);
 
                 framesRead += framesToRead;
-                setBufferSize(framesToRead);
-
-                pthread_mutex_unlock(&dataSourceMutex);
-        }
-
-        ma_int32 *audioBuffer = getAudioBuffer();
-        if (audioBuffer == NULL)
-        {
-                audioBuffer = malloc(sizeof(ma_int32) * MAX_BUFFER_SIZE);
-                if (audioBuffer == NULL)
-                {
-                        // Memory allocation failed
-                        return;
-                }
-        }
-
-        // No format conversion needed, just copy the audio samples
-        memcpy(audioBuffer, pFramesOut, sizeof(ma_int32) * framesRead);
-        setAudioBuffer(audioBuffer);
-
-        if (pFramesRead != NULL)
-        {
-                *pFramesRead = framesRead;
-        }
-}
-
-void opus_on_audio_frames(ma_device *pDevice, void *pFramesOut, const void *pFramesIn, ma_uint32 frameCount)
-{
-        AudioData *pDataSource = (AudioData *)pDevice->pUserData;
-        ma_uint64 framesRead = 0;
-        opus_read_pcm_frames(&pDataSource->base, pFramesOut, frameCount, &framesRead);
-        (void)pFramesIn;
-}
-
-void vorbis_read_pcm_frames(ma_data_source *pDataSource, void *pFramesOut, ma_uint64 frameCount, ma_uint64 *pFramesRead)
-{
-        ma_libvorbis *vorbis = (ma_libvorbis *)pDataSource;
-        AudioData *pAudioData = (AudioData *)vorbis->pReadSeekTellUserData;
-
-        ma_uint64 framesRead = 0;
-
-        while (framesRead < frameCount)
-        {
-                if (doQuit)
-                        return;
-
-                if (isImplSwitchReached())
-                        return;
-
-                if (pthread_mutex_trylock(&dataSourceMutex) != 0)
-                {
-                        return;
-                }
-
-                // Check if a file switch is required
-                if (pAudioData->switchFiles)
-                {
-                        executeSwitch(pAudioData);
-                        pthread_mutex_unlock(&dataSourceMutex);
-                        break; // Exit the loop after the file switch
-                }
 
-                ma_libvorbis *decoder = getCurrentVorbisDecoder();
-
-                if ((getCurrentImplementationType() != VORBIS && !isSkipToNext()) || (decoder == NULL))
-                {
-                        pthread_mutex_unlock(&dataSourceMutex);
-                        return;
-                }
+                bool endOfTrack = (framesToRead == 0 || result != MA_SUCCESS || ma_data_source_get_current(firstDecoder) != decoder);
 
-                if (isSeekRequested())
+                if ((endOfTrack || isSkipToNext()) && !isEOFReached())
                 {
-                        // disabled for ogg vorbis
-                        setSeekRequested(false);
-                }
-
-                // Read from the current decoder
-                ma_uint64 framesToRead = 0;
-                ma_result result;
-                ma_uint64 remainingFrames = frameCount - framesRead;
-                ma_libvorbis *firstDecoder = getFirstVorbisDecoder();
+                        // A track ending on its own plays out gaplessly, a skip cuts the rest of it
+                        if (isSkipToNext())
+                                requestDecodedFramesFlush(framesRead);
 
-                if (firstDecoder == NULL)
-                {
-                        pthread_mutex_unlock(&dataSourceMutex);
-                        return;
+                        activateSwitch(pAudioData);
                 }
-
-                result = ma_data_source_read_pcm_frames(firstDecoder, (ma_int32 *)pFramesOut + framesRead * pAudioData->channels, remainingFrames, &framesToRead);
-
-                if ((getPercentageElapsed() >= 1.0 || isSkipToNext() || result != MA_SUCCESS) &&
-                    !isEOFReached())
+                else if (framesToRead == 0)
                 {
-                        activateSwitch(pAudioData);
                         pthread_mutex_unlock(&dataSourceMutex);
-                        continue;
+                        break;
                 }
 
-                framesRead += framesToRead;
-                setBufferSize(framesToRead);
-
                 pthread_mutex_unlock(&dataSourceMutex);
         }
 
-        ma_int32 *audioBuffer = getAudioBuffer();
-        if (audioBuffer == NULL)
-        {
-                audioBuffer = malloc(sizeof(ma_int32) * MAX_BUFFER_SIZE);
-                if (audioBuffer == NULL)
-                {
-                        // Memory allocation failed
-                        return;
-                }
-        }
-
-        // No format conversion needed, just copy the audio samples
-        memcpy(audioBuffer, pFramesOut, sizeof(ma_int32) * framesRead);
-        setAudioBuffer(audioBuffer);
-
         if (pFramesRead != NULL)
         {
                 *pFramesRead = framesRead;
         }
 }
-
-void vorbis_on_audio_frames(ma_device *pDevice, void *pFramesOut, const void *pFramesIn, ma_uint32 frameCount)
-{
-        AudioData *pDataSource = (AudioData *)pDevice->pUserData;
-        ma_uint64 framesRead = 0;
-        vorbis_read_pcm_frames(&pDataSource->base, pFramesOut, frameCount, &framesRead);
-        (void)pFramesIn;
-}
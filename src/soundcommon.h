@@ -56,6 +56,9 @@ typedef struct
         unsigned char blue;
         TagSettings *metadata;
         FIBITMAP *cover;
+        pthread_t coverThread;
+        bool coverThreadStarted;
+        _Atomic bool coverLoaded;
         double duration;
         bool hasErrors;
 } SongData;
@@ -94,6 +97,59 @@ typedef struct
 } AudioData;
 #endif
 
+typedef void (*decode_pcm_frames_proc)(ma_data_source *pDataSource, void *pFramesOut, ma_uint64 frameCount, ma_uint64 *pFramesRead);
+
+#ifndef DECODERBACKEND_STRUCT
+#define DECODERBACKEND_STRUCT
+
+// A decoder backend opens files of the given extensions as a miniaudio data source.
+// Reading, seeking and querying the format all go through the data source vtable.
+typedef struct
+{
+        const char *name;
+        const char *extensions[4];
+        bool canSeek;
+        ma_result (*open)(const char *filePath, ma_data_source **ppDataSource);
+        void (*close)(ma_data_source *pDataSource);
+} DecoderBackend;
+
+#endif
+
+#ifndef CONVERTERDATASOURCE_STRUCT
+#define CONVERTERDATASOURCE_STRUCT
+
+// Converts the output of a decoder to another format, channel count and sample rate
+typedef struct
+{
+        ma_data_source_base base;
+        ma_data_source *pDecoder;
+        ma_data_converter converter;
+        ma_format formatIn;
+        ma_uint32 channelsIn;
+        ma_uint32 sampleRateIn;
+        ma_uint8 *inputBuffer;
+        ma_uint64 inputFrameOffset;
+        ma_uint64 inputFramesAvailable;
+        bool inputEnded;
+        ma_uint64 cursor;
+} ConverterDataSource;
+
+#endif
+
+#ifndef DECODER_STRUCT
+#define DECODER_STRUCT
+
+typedef struct
+{
+        const DecoderBackend *backend;
+        ma_data_source *pDecoder;
+        ConverterDataSource *pConverter;
+        ma_data_source *pDataSource; // What gets chained: the converter if there is one, otherwise the decoder
+        char filePath[MAXPATHLEN];
+} Decoder;
+
+#endif
+
 #ifndef KEYVALUEPAIR_STRUCT
 #define KEYVALUEPAIR_STRUCT
 
@@ -115,6 +171,8 @@ typedef struct
         char useProfileColors[2];
         char visualizerEnabled[2];
         char visualizerHeight[6];
+        char visualizerFftSize[6];
+        char visualizerStereo[2];
         char togglePlaylist[6];
         char toggleBindings[6];
         char volumeUp[6];
@@ -182,11 +240,7 @@ typedef struct
 
 enum AudioImplementation
 {
-        PCM,
-        BUILTIN,
-        VORBIS,
-        OPUS,
-        M4A,
+        DECODER,
         NONE
 };
 
@@ -230,71 +284,41 @@ enum AudioImplementation getCurrentImplementationType();
 
 void setCurrentImplementationType(enum AudioImplementation value);
 
-int getBufferSize();
-
-void setBufferSize(int value);
-
 void setPlayingStatus(bool playing);
 
 bool isPlaying();
 
-ma_decoder *getFirstDecoder();
-
-ma_decoder *getCurrentBuiltinDecoder();
-
-ma_decoder *getPreviousDecoder();
-
-ma_format getCurrentFormat();
-
-void resetDecoders();
-
-ma_libopus *getCurrentOpusDecoder();
-
-void resetOpusDecoders();
-
-m4a_decoder *getCurrentM4aDecoder();
-
-m4a_decoder *getFirstM4aDecoder();
-
-ma_libopus *getFirstOpusDecoder();
+extern const DecoderBackend builtinDecoderBackend;
 
-ma_libvorbis *getFirstVorbisDecoder();
+const DecoderBackend *getDecoderBackend(const char *filePath);
 
-void getVorbisFileInfo(const char *filename, ma_format *format, ma_uint32*channels, ma_uint32 *sampleRate, ma_channel *channelMap);
+bool isSeekSupported(const char *filePath);
 
-void getM4aFileInfo(const char *filename, ma_format *format, ma_uint32*channels, ma_uint32 *sampleRate, ma_channel *channelMap);
+ma_data_source *getFirstDecoder();
 
-void getOpusFileInfo(const char *filename, ma_format *format, ma_uint32*channels, ma_uint32 *sampleRate, ma_channel *channelMap);
+ma_data_source *getCurrentDecoder();
 
-ma_libvorbis *getCurrentVorbisDecoder();
+const DecoderBackend *getCurrentDecoderBackend();
 
-void switchVorbisDecoder();
+const char *getCurrentDecoderFilePath();
 
-int prepareNextOpusDecoder(char *filepath);
+void switchDecoder();
 
-int prepareNextOpusDecoder(char *filepath);
-
-int prepareNextVorbisDecoder(char *filepath);
-
-int prepareNextM4aDecoder(char *filepath);
-
-void resetVorbisDecoders();
-
-void resetM4aDecoders();
+void resetDecoders();
 
-ma_libvorbis *getFirstVorbisDecoder();
+int prepareNextDecoder(char *filepath);
 
-void getFileInfo(const char* filename, ma_uint32* sampleRate, ma_uint32* channels, ma_format* format);
+ma_result initConverterDataSource(ma_data_source *pDecoder, ma_format formatOut, ma_uint32 channelsOut, ma_uint32 sampleRateOut, ConverterDataSource **ppConverter);
 
-void initAudioBuffer();
+void uninitConverterDataSource(ConverterDataSource *pConverter);
 
-ma_int32 *getAudioBuffer();
+float pcmSampleToFloat(const ma_uint8 *pSample, ma_format format);
 
-void setAudioBuffer(ma_int32 *buf);
+void writeAnalysisTap(const void *pFrames, ma_format format, ma_uint32 channels, ma_uint32 frameCount);
 
-void resetAudioBuffer();
+int getAnalysisFrames(float *left, float *right, int frameCount);
 
-void freeAudioBuffer();
+void resetAnalysisTap();
 
 bool isRepeatEnabled();
 
@@ -354,8 +378,6 @@ void resetDevice();
 
 ma_device *getDevice();
 
-bool hasBuiltinDecoder(char *filePath);
-
 void setCurrentFileIndex(AudioData *pAudioData, int index);
 
 void activateSwitch(AudioData *pPCMDataSource);
@@ -372,11 +394,21 @@ void setVolume(int volume);
 
 int adjustVolumePercent(int volumeChange);
 
-void m4a_on_audio_frames(ma_device *pDevice, void *pFramesOut, const void *pFramesIn, ma_uint32 frameCount);
+void decoder_read_pcm_frames(ma_data_source *pDataSource, void *pFramesOut, ma_uint64 frameCount, ma_uint64 *pFramesRead);
+
+void startDecodeThread();
+
+void stopDecodeThread();
+
+int setDecodeSource(decode_pcm_frames_proc onDecode, ma_data_source *pDataSource, ma_format format, ma_uint32 channels, ma_uint32 sampleRate);
+
+void clearDecodeSource();
+
+void waitForDecodedFramesToPlay();
 
-void opus_on_audio_frames(ma_device *pDevice, void *pFramesOut, const void *pFramesIn, ma_uint32 frameCount);
+void requestDecodedFramesFlush(ma_uint64 framesNotCommitted);
 
-void vorbis_on_audio_frames(ma_device *pDevice, void *pFramesOut, const void *pFramesIn, ma_uint32 frameCount);
+void on_audio_frames(ma_device *pDevice, void *pFramesOut, const void *pFramesIn, ma_uint32 frameCount);
 
 void logTime(const char *message);
 
@@ -9,8 +9,25 @@ term.c
 
 */
 
+#ifndef FRAME_BUFFER_SIZE
+#define FRAME_BUFFER_SIZE (1024 * 1024)
+#endif
+
 volatile sig_atomic_t resizeFlag = 0;
 
+char frameBuffer[FRAME_BUFFER_SIZE];
+
+void initFrameBuffer()
+{
+        // Collect everything printed during a frame and write it out at once in flushFrame
+        setvbuf(stdout, frameBuffer, _IOFBF, sizeof(frameBuffer));
+}
+
+void flushFrame()
+{
+        fflush(stdout);
+}
+
 void setTextColor(int color)
 {
         /*
@@ -95,7 +112,6 @@ int isInputAvailable()
 void hideCursor()
 {
         printf("\033[?25l");
-        fflush(stdout);
 }
 
 void showCursor()
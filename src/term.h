@@ -23,6 +23,10 @@
 
 extern volatile sig_atomic_t resizeFlag;
 
+void initFrameBuffer(void);
+
+void flushFrame(void);
+
 void setTextColor(int color);
 
 void setTextColorRGB(int r, int g, int b);
@@ -146,6 +146,51 @@ int startsWith(const char *str, const char *prefix)
         return strncmp(str, prefix, prefixLength) == 0;
 }
 
+// Compares like strcmp, except that runs of digits are compared by their value, so "Track 2" comes before "Track 10"
+int compareNatural(const char *a, const char *b)
+{
+        while (*a != '\0' && *b != '\0')
+        {
+                if (isdigit((unsigned char)*a) && isdigit((unsigned char)*b))
+                {
+                        while (*a == '0')
+                                a++;
+                        while (*b == '0')
+                                b++;
+
+                        const char *startA = a;
+                        const char *startB = b;
+
+                        while (isdigit((unsigned char)*a))
+                                a++;
+                        while (isdigit((unsigned char)*b))
+                                b++;
+
+                        // A longer run without leading zeros is the larger number
+                        size_t lengthA = a - startA;
+                        size_t lengthB = b - startB;
+
+                        if (lengthA != lengthB)
+                                return (lengthA < lengthB) ? -1 : 1;
+
+                        int result = memcmp(startA, startB, lengthA);
+
+                        if (result != 0)
+                                return result;
+
+                        continue;
+                }
+
+                if (*a != *b)
+                        return (unsigned char)*a - (unsigned char)*b;
+
+                a++;
+                b++;
+        }
+
+        return (unsigned char)*a - (unsigned char)*b;
+}
+
 void trim(char *str)
 {
         char *start = str;
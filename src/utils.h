@@ -43,6 +43,8 @@ int endsWith(const char *str, const char *suffix);
 
 int startsWith(const char *str, const char *prefix);
 
+int compareNatural(const char *a, const char *b);
+
 void trim(char *str);
 
 const char *getHomePath();
@@ -12,13 +12,53 @@ visuals.c
 #define MAX_BUFFER_SIZE 4800
 #endif
 
-int bufferSize = 4800;
+const char WISDOM_FILE[] = "fftwwisdom";
+
+#ifndef SPECTRUM_FFT_SIZE
+#define SPECTRUM_FFT_SIZE 1024
+#endif
+
+#ifndef MIN_FFT_SIZE
+#define MIN_FFT_SIZE 256
+#endif
+
+#ifndef MAX_FFT_SIZE
+#define MAX_FFT_SIZE 4096
+#endif
+
+#ifndef MIN_BAND_FREQUENCY
+#define MIN_BAND_FREQUENCY 30.0f
+#endif
+
+int visualizerFftSize = SPECTRUM_FFT_SIZE;
+bool visualizerStereo = false;
+int bufferSize = SPECTRUM_FFT_SIZE;
 int prevBufferSize = 0;
 float alpha = 0.2f;
 float lastMax = -1.0f;
 bool unicodeSupport = false;
-fftwf_complex *fftInput = NULL;
+float *fftInput = NULL;
 fftwf_complex *fftOutput = NULL;
+float *hammingWindow = NULL;
+float tapLeft[MAX_FFT_SIZE];
+float tapRight[MAX_FFT_SIZE];
+fftwf_plan fftPlan = NULL;
+
+// Spectrum cells as they are currently shown on screen, so only changed cells are redrawn
+unsigned char *prevCells = NULL;
+int prevCellsWidth = 0;
+int prevCellsHeight = 0;
+int prevCellsIndentation = 0;
+PixelData prevCellsColor;
+bool prevCellsUseProfileColors = false;
+bool cellsValid = false;
+
+// FFT bin range [bandStart, bandEnd) covered by each bar
+int bandStart[MAX_BUFFER_SIZE];
+int bandEnd[MAX_BUFFER_SIZE];
+int prevNumBands = 0;
+int prevBandFftSize = 0;
+ma_uint32 prevBandSampleRate = 0;
 
 int bufferIndex = 0;
 
@@ -36,12 +76,49 @@ int terminalSupportsUnicode()
         return 0;
 }
 
+char *getWisdomFilePath()
+{
+        char *configdir = getConfigPath();
+
+        if (configdir == NULL)
+                return NULL;
+
+        size_t filepath_length = strlen(configdir) + strlen("/") + strlen(WISDOM_FILE) + 1;
+        char *filepath = (char *)malloc(filepath_length);
+
+        if (filepath != NULL)
+                snprintf(filepath, filepath_length, "%s/%s", configdir, WISDOM_FILE);
+
+        free(configdir);
+        return filepath;
+}
+
 void initVisuals()
 {
         unicodeSupport = false;
 
         if (terminalSupportsUnicode() > 0)
                 unicodeSupport = true;
+
+        // Plans measured in earlier sessions are reused instead of measured again
+        char *wisdomPath = getWisdomFilePath();
+
+        if (wisdomPath != NULL)
+        {
+                fftwf_import_wisdom_from_filename(wisdomPath);
+                free(wisdomPath);
+        }
+}
+
+void saveWisdom()
+{
+        char *wisdomPath = getWisdomFilePath();
+
+        if (wisdomPath != NULL)
+        {
+                fftwf_export_wisdom_to_filename(wisdomPath);
+                free(wisdomPath);
+        }
 }
 
 #define MOVING_AVERAGE_WINDOW_SIZE 2
@@ -148,132 +225,149 @@ void enhancePeaks(int numBars, float *magnitudes, int height)
         }
 }
 
-void calc(int height, int numBars, ma_int32 *audioBuffer, int bitDepth, fftwf_complex *fftInput, fftwf_complex *fftOutput, float *magnitudes, fftwf_plan plan)
+int getValidFftSize(int size)
 {
-        int bufferSize = getBufferSize();
+        if (size < MIN_FFT_SIZE)
+                return MIN_FFT_SIZE;
 
-        if (audioBuffer == NULL)
-        {
-                fprintf(stderr, "Audio buffer is NULL.\n");
+        if (size > MAX_FFT_SIZE)
+                return MAX_FFT_SIZE;
+
+        // Round down to a power of two
+        int validSize = MIN_FFT_SIZE;
+
+        while (validSize * 2 <= size)
+                validSize *= 2;
+
+        return validSize;
+}
+
+void calcBandRanges(int numBands, int fftSize, ma_uint32 sampleRate)
+{
+        if (numBands == prevNumBands && fftSize == prevBandFftSize && sampleRate == prevBandSampleRate)
                 return;
-        }
 
-        for (int i = 0; i < bufferSize; i++)
+        int halfSize = fftSize / 2;
+        float binWidth = (float)sampleRate / fftSize;
+        float minFreq = MIN_BAND_FREQUENCY;
+        float maxFreq = sampleRate / 2.0f;
+
+        if (minFreq < binWidth)
+                minFreq = binWidth;
+
+        float ratio = maxFreq / minFreq;
+
+        for (int i = 0; i < numBands; i++)
         {
-                ma_int32 sample = audioBuffer[i];
-                float normalizedSample = 0.0f;
+                // Each band spans the same number of octaves
+                float low = minFreq * powf(ratio, (float)i / numBands);
+                float high = minFreq * powf(ratio, (float)(i + 1) / numBands);
+
+                int start = (int)floorf(low / binWidth);
+                int end = (int)ceilf(high / binWidth);
+
+                if (start < 1)
+                        start = 1;
+                if (start > halfSize - 1)
+                        start = halfSize - 1;
+                if (end > halfSize)
+                        end = halfSize;
+                if (end <= start)
+                        end = start + 1;
+
+                bandStart[i] = start;
+                bandEnd[i] = end;
+        }
 
-                switch (bitDepth)
-                {
-                case 8:
-                        normalizedSample = ((float)sample - 128.0f) / 127.0f;
-                        break;
-                case 16:
-                        normalizedSample = (float)sample / 32768.0f;
-                        break;
-                case 24:
-                {
-                        int32_t lower24Bits = sample & 0xFFFFFF;
-                        if (lower24Bits & 0x800000)
-                        {
-                                lower24Bits |= 0xFF000000; // Sign extension
-                        }
-                        normalizedSample = (float)lower24Bits / 8388608.0f;
-                        break;
-                }
-                case 32: // Assuming 32-bit integers
-                        normalizedSample = (float)sample / 2147483648.0f;
-                        break;
-                default:
-                        fprintf(stderr, "Unsupported bit depth: %d\n", bitDepth);
-                        return;
-                }
+        prevNumBands = numBands;
+        prevBandFftSize = fftSize;
+        prevBandSampleRate = sampleRate;
+}
 
-                fftInput[i][0] = normalizedSample;
-                fftInput[i][1] = 0.0f;
+void calcBandMagnitudes(float *samples, float *fftInput, fftwf_complex *fftOutput, fftwf_plan plan, int numBands, float *bands, int step)
+{
+        for (int i = 0; i < bufferSize; i++)
+        {
+                fftInput[i] = samples[i] * hammingWindow[i];
         }
 
-        // Apply Windowing (Hamming Window)
-        if (bufferSize > 1)
+        fftwf_execute(plan);
+
+        for (int i = 0; i < numBands; i++)
         {
-                for (int i = 0; i < bufferSize; i++)
+                // Use the strongest bin in the band so narrow peaks stay visible
+                float peak = 0.0f;
+
+                for (int j = bandStart[i]; j < bandEnd[i]; j++)
                 {
-                        float window = 0.54f - 0.46f * cosf(2.0f * M_PI * i / (bufferSize - 1));
-                        fftInput[i][0] *= window;
+                        float real = fftOutput[j][0];
+                        float imag = fftOutput[j][1];
+                        float magnitude = sqrtf(real * real + imag * imag);
+
+                        if (magnitude > peak)
+                                peak = magnitude;
                 }
+
+                bands[i * step] = peak;
         }
+}
 
-        fftwf_execute(plan); // Execute FFT
+void calc(int height, int numBars, float *left, float *right, float *fftInput, fftwf_complex *fftOutput, float *magnitudes, fftwf_plan plan)
+{
+        ma_uint32 sampleRate = (audioData.sampleRate > 0) ? audioData.sampleRate : 44100;
 
         clearMagnitudes(numBars, magnitudes);
 
-        int halfSize = bufferSize / 2;
-        int limit = (numBars < halfSize) ? numBars : halfSize;
+        if (visualizerStereo && numBars >= 2)
+        {
+                // Left channel runs from high to low frequencies, right channel from low to high
+                int numBands = numBars / 2;
+
+                calcBandRanges(numBands, bufferSize, sampleRate);
 
-        for (int i = 0; i < limit; i++)
+                calcBandMagnitudes(left, fftInput, fftOutput, plan, numBands, &magnitudes[numBands - 1], -1);
+                calcBandMagnitudes(right, fftInput, fftOutput, plan, numBands, &magnitudes[numBands], 1);
+        }
+        else
         {
-                // Compute magnitude for each frequency bin
-                float real = fftOutput[i][0];
-                float imag = fftOutput[i][1];
-                float magnitude = sqrtf(real * real + imag * imag);
-                magnitudes[i] = magnitude;
+                for (int i = 0; i < bufferSize; i++)
+                {
+                        // Mix to mono
+                        left[i] = 0.5f * (left[i] + right[i]);
+                }
+
+                calcBandRanges(numBars, bufferSize, sampleRate);
+
+                calcBandMagnitudes(left, fftInput, fftOutput, plan, numBars, magnitudes, 1);
         }
 
         // Normalize and update magnitudes for visualization
-        float maxMagnitude = calcMaxMagnitude(limit, magnitudes);
+        float maxMagnitude = calcMaxMagnitude(numBars, magnitudes);
 
-        updateMagnitudes(height, limit, maxMagnitude, magnitudes);
+        updateMagnitudes(height, numBars, maxMagnitude, magnitudes);
 
         enhancePeaks(numBars, magnitudes, height);
 }
 
-wchar_t *upwardMotionChars[] = {
-    L" ", L"▁", L"▂", L"▃", L"▄", L"▅", L"▆", L"▇", L"█"};
+// Each cell is a space followed by the bar glyph so a cell is printed with one call
+const char *upwardMotionCells[] = {
+    "  ", " ▁", " ▂", " ▃", " ▄", " ▅", " ▆", " ▇", " █"};
 
-wchar_t *getUpwardMotionChar(int level)
+const char *getUpwardMotionCell(int level)
 {
         if (level < 0 || level > 8)
         {
                 level = 8;
         }
-        return upwardMotionChars[level];
+        return upwardMotionCells[level];
 }
 
-int calcSpectrum(int height, int numBars, fftwf_complex *fftInput, fftwf_complex *fftOutput, float *magnitudes, fftwf_plan plan)
+int calcSpectrum(int height, int numBars, float *fftInput, fftwf_complex *fftOutput, float *magnitudes, fftwf_plan plan)
 {
-
-        ma_int32 *g_audioBuffer = getAudioBuffer();
-
-        ma_format format = getCurrentFormat();
-
-        if (format == ma_format_unknown)
+        if (getAnalysisFrames(tapLeft, tapRight, bufferSize) < bufferSize)
                 return -1;
 
-        int bitDepth = 32;
-
-        switch (format)
-        {
-        case ma_format_u8:
-                bitDepth = 8;
-                break;
-
-        case ma_format_s16:
-                bitDepth = 16;
-                break;
-
-        case ma_format_s24:
-                bitDepth = 24;
-                break;
-
-        case ma_format_f32:
-        case ma_format_s32:
-                bitDepth = 32;
-                break;
-        default:
-                break;
-        }
-
-        calc(height, numBars, g_audioBuffer, bitDepth, fftInput, fftOutput, magnitudes, plan);
+        calc(height, numBars, tapLeft, tapRight, fftInput, fftOutput, magnitudes, plan);
 
         return 0;
 }
@@ -288,73 +382,120 @@ PixelData increaseLuminosity(PixelData pixel, int amount)
         return pixel2;
 }
 
+void setSpectrumRowColor(int row, int height, PixelData color, bool useProfileColors)
+{
+        if (color.r != 0 || color.g != 0 || color.b != 0)
+        {
+                if (!useProfileColors)
+                {
+                        PixelData tmp = increaseLuminosity(color, round(row * height * 4));
+                        printf("\033[38;2;%d;%d;%dm", tmp.r, tmp.g, tmp.b);
+                }
+        }
+        else
+        {
+                setDefaultTextColor();
+        }
+}
+
+unsigned char getCellLevel(float magnitude, int row)
+{
+        if (magnitude >= row)
+                return 8;
+
+        if (magnitude + 1 >= row && unicodeSupport)
+        {
+                int firstDecimalDigit = (int)(fmod(magnitude * 10, 10));
+                return (firstDecimalDigit < 0 || firstDecimalDigit > 8) ? 8 : firstDecimalDigit;
+        }
+
+        return 0;
+}
+
+void invalidateSpectrum()
+{
+        cellsValid = false;
+}
+
 void printSpectrum(int height, int width, float *magnitudes, PixelData color, int indentation, bool useProfileColors)
 {
         printf("\n");
-        clearRestOfScreen();
 
-        PixelData tmp;
+        bool fullRedraw = !cellsValid || width != prevCellsWidth || height != prevCellsHeight || indentation != prevCellsIndentation ||
+                          color.r != prevCellsColor.r || color.g != prevCellsColor.g || color.b != prevCellsColor.b ||
+                          useProfileColors != prevCellsUseProfileColors;
+
+        if (fullRedraw)
+        {
+                unsigned char *cells = realloc(prevCells, (size_t)width * height);
+
+                if (cells == NULL)
+                        return;
+
+                prevCells = cells;
+                prevCellsWidth = width;
+                prevCellsHeight = height;
+                prevCellsIndentation = indentation;
+                prevCellsColor = color;
+                prevCellsUseProfileColors = useProfileColors;
+                cellsValid = true;
+        }
+
+        bool silent = isPaused() || isStopped();
 
         for (int j = height; j > 0; j--)
         {
-                printf("\r");
-                printBlankSpaces(indentation);
-                if (color.r != 0 || color.g != 0 || color.b != 0)
-                {
-                        if (!useProfileColors)
-                        {
-                                tmp = increaseLuminosity(color, round(j * height * 4));
-                                printf("\033[38;2;%d;%d;%dm", tmp.r, tmp.g, tmp.b);
-                        }
-                }
-                else
+                unsigned char *rowCells = &prevCells[(height - j) * width];
+
+                if (fullRedraw)
                 {
-                        setDefaultTextColor();
+                        printf("\r\033[K");
+                        printBlankSpaces(indentation);
+                        setSpectrumRowColor(j, height, color, useProfileColors);
                 }
-                if (isPaused() || isStopped())
-                {
-                        for (int i = 0; i < width; i++)
-                        {
-                                printf("  ");
-                        }
-                }
-                else
+
+                // Column the cursor is at, or -1 if it isn't inside the visualizer
+                int cursorColumn = fullRedraw ? 0 : -1;
+                bool colorSet = fullRedraw;
+
+                for (int i = 0; i < width; i++)
                 {
-                        for (int i = 0; i < width; i++)
+                        unsigned char level = silent ? 0 : getCellLevel(magnitudes[i], j);
+
+                        if (!fullRedraw && rowCells[i] == level)
+                                continue;
+
+                        if (!colorSet)
                         {
-                                if (j >= 0)
-                                {
-                                        if (magnitudes[i] >= j)
-                                        {
-                                                if (unicodeSupport)
-                                                {
-                                                        printf(" %S", getUpwardMotionChar(10));
-                                                }
-                                                else
-                                                {
-                                                        printf(" █");
-                                                }
-                                        }
-                                        else if (magnitudes[i] + 1 >= j && unicodeSupport)
-                                        {
-                                                int firstDecimalDigit = (int)(fmod(magnitudes[i] * 10, 10));
-                                                printf(" %S", getUpwardMotionChar(firstDecimalDigit));
-                                        }
-                                        else
-                                        {
-                                                printf("  ");
-                                        }
-                                }
+                                setSpectrumRowColor(j, height, color, useProfileColors);
+                                colorSet = true;
                         }
+
+                        if (cursorColumn != i)
+                                printf("\033[%dG", indentation + i * 2 + 1);
+
+                        fputs(getUpwardMotionCell(level), stdout);
+
+                        rowCells[i] = level;
+                        cursorColumn = i + 1;
                 }
-                printf("\n ");
+                printf("\n");
         }
         printf("\r");
-        fflush(stdout);
 }
 
 void freeVisuals()
 {
+        if (fftPlan != NULL)
+        {
+                fftwf_destroy_plan(fftPlan);
+                fftPlan = NULL;
+        }
+        if (hammingWindow != NULL)
+        {
+                free(hammingWindow);
+                hammingWindow = NULL;
+        }
         if (fftInput != NULL)
         {
                 fftwf_free(fftInput);
@@ -365,11 +506,17 @@ void freeVisuals()
                 fftwf_free(fftOutput);
                 fftOutput = NULL;
         }
+        if (prevCells != NULL)
+        {
+                free(prevCells);
+                prevCells = NULL;
+        }
+        cellsValid = false;
 }
 
 void drawSpectrumVisualizer(int height, int width, PixelData c, int indentation, bool useProfileColors)
 {
-        bufferSize = getBufferSize();
+        bufferSize = getValidFftSize(visualizerFftSize);
         PixelData color;
         color.r = c.r;
         color.g = c.g;
@@ -378,6 +525,9 @@ void drawSpectrumVisualizer(int height, int width, PixelData c, int indentation,
         int numBars = (width / 2);
         height = height - 1;
 
+        if (numBars > MAX_BUFFER_SIZE)
+                numBars = MAX_BUFFER_SIZE;
+
         if (height <= 0 || width <= 0)
         {
                 return;
@@ -392,33 +542,51 @@ void drawSpectrumVisualizer(int height, int width, PixelData c, int indentation,
 
                 freeVisuals();
 
-                fftInput = (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * bufferSize);
-                if (fftInput == NULL)
+                fftInput = (float *)fftwf_malloc(sizeof(float) * bufferSize);
+                fftOutput = (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * (bufferSize / 2 + 1));
+                hammingWindow = (float *)malloc(sizeof(float) * bufferSize);
+
+                if (fftInput == NULL || fftOutput == NULL || hammingWindow == NULL)
                 {
+                        freeVisuals();
+                        prevBufferSize = 0;
                         return;
                 }
 
-                fftOutput = (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * bufferSize);
-                if (fftOutput == NULL)
+                // Hamming window
+                for (int i = 0; i < bufferSize; i++)
                 {
-                        fftwf_free(fftInput);
-                        fftInput = NULL;
+                        hammingWindow[i] = (bufferSize > 1) ? 0.54f - 0.46f * cosf(2.0f * M_PI * i / (bufferSize - 1)) : 1.0f;
+                }
+
+                // Use a plan from the wisdom file if there is one, otherwise measure and remember it
+                fftPlan = fftwf_plan_dft_r2c_1d(bufferSize, fftInput, fftOutput, FFTW_MEASURE | FFTW_WISDOM_ONLY);
+
+                if (fftPlan == NULL)
+                {
+                        fftPlan = fftwf_plan_dft_r2c_1d(bufferSize, fftInput, fftOutput, FFTW_MEASURE);
+
+                        if (fftPlan != NULL)
+                                saveWisdom();
+                }
+
+                if (fftPlan == NULL)
+                {
+                        freeVisuals();
+                        prevBufferSize = 0;
                         return;
                 }
+
                 prevBufferSize = bufferSize;
         }
 
-        fftwf_plan plan = fftwf_plan_dft_1d(bufferSize, fftInput, fftOutput, FFTW_FORWARD, FFTW_ESTIMATE);
-
         float magnitudes[numBars];
         for (int i = 0; i < numBars; i++)
         {
                 magnitudes[i] = 0.0f;
         }
 
-        calcSpectrum(height, numBars, fftInput, fftOutput, magnitudes, plan);
+        calcSpectrum(height, numBars, fftInput, fftOutput, magnitudes, fftPlan);
 
         printSpectrum(height, numBars, magnitudes, color, indentation, useProfileColors);
-
-        fftwf_destroy_plan(plan);
 }
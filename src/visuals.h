@@ -22,10 +22,16 @@
     } PixelData;
 #endif
 
+extern int visualizerFftSize;
+
+extern bool visualizerStereo;
+
 void initVisuals();
 
 void freeVisuals();
 
+void invalidateSpectrum();
+
 void drawSpectrumVisualizer(int height, int width, PixelData c, int indentation, bool useProfileColors);
 
 PixelData increaseLuminosity(PixelData pixel, int amount);